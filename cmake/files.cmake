@@ -4,12 +4,18 @@ set(cwhttpd_SRC
     ${cwhttpd_DIR}/src/auth.c
     ${cwhttpd_DIR}/src/base64.c
     ${cwhttpd_DIR}/src/captdns.c
+    ${cwhttpd_DIR}/src/compress.c
+    ${cwhttpd_DIR}/src/fs_cache.c
     ${cwhttpd_DIR}/src/httpd.c
+    ${cwhttpd_DIR}/src/mime.c
     ${cwhttpd_DIR}/src/plat_posix.c
     ${cwhttpd_DIR}/src/snprintf.c
+    ${cwhttpd_DIR}/src/stat_cache.c
     ${cwhttpd_DIR}/src/route_fs.c
     ${cwhttpd_DIR}/src/route_redirect.c
+    ${cwhttpd_DIR}/src/router.c
     ${cwhttpd_DIR}/src/sha1.c
+    ${cwhttpd_DIR}/src/tpl_cache.c
     ${cwhttpd_DIR}/src/ws.c
 )
 
@@ -18,6 +24,7 @@ set(cwhttpd_IDF_SRC
 )
 
 set(cwhttpd_LINUX_SRC
+    ${cwhttpd_DIR}/src/fs_watch.c
     ${cwhttpd_DIR}/src/port_linux.c
 )
 
@@ -18,4 +18,87 @@ function(target_add_resource target path)
         VERBATIM
     )
     target_sources(${target} PRIVATE ${output}.c)
-endfunction()
\ No newline at end of file
+endfunction()
+
+function(target_add_routes target path)
+    if(IS_ABSOLUTE ${path})
+        set(input ${path})
+    else()
+        set(input ${CMAKE_CURRENT_SOURCE_DIR}/${path})
+    endif()
+    file(RELATIVE_PATH rel_input ${CMAKE_CURRENT_SOURCE_DIR} ${input})
+    set(output ${CMAKE_CURRENT_BINARY_DIR}/${rel_input})
+    get_filename_component(dir ${output} DIRECTORY)
+
+    add_custom_command(OUTPUT ${output}.c
+        COMMAND ${CMAKE_COMMAND} -E make_directory ${dir}
+        COMMAND ${python} ${cwhttpd_DIR}/tools/routegen.py ${input} ${output}.c
+        DEPENDS ${input} ${cwhttpd_DIR}/tools/routegen.py
+        COMMENT "Building route table for ${rel_input}"
+        VERBATIM
+    )
+    target_sources(${target} PRIVATE ${output}.c)
+endfunction()
+
+function(target_add_bundle target path)
+    cmake_parse_arguments(arg "GZIP;BROTLI" "SYMBOL" "" ${ARGN})
+    if(IS_ABSOLUTE ${path})
+        set(input ${path})
+    else()
+        set(input ${CMAKE_CURRENT_SOURCE_DIR}/${path})
+    endif()
+    file(RELATIVE_PATH rel_input ${CMAKE_CURRENT_SOURCE_DIR} ${input})
+    set(output ${CMAKE_CURRENT_BINARY_DIR}/${rel_input})
+    get_filename_component(dir ${output} DIRECTORY)
+
+    set(options)
+    if(arg_GZIP)
+        list(APPEND options --gzip)
+    endif()
+    if(arg_BROTLI)
+        list(APPEND options --brotli)
+    endif()
+    if(arg_SYMBOL)
+        list(APPEND options --symbol ${arg_SYMBOL})
+    endif()
+
+    file(GLOB_RECURSE inputs CONFIGURE_DEPENDS ${input}/*)
+    add_custom_command(OUTPUT ${output}.c ${output}.c.bin
+        COMMAND ${CMAKE_COMMAND} -E make_directory ${dir}
+        COMMAND ${python} ${cwhttpd_DIR}/tools/bundle.py ${options} ${input}
+                ${output}.c
+        DEPENDS ${inputs} ${cwhttpd_DIR}/tools/bundle.py
+                ${cwhttpd_DIR}/tools/routegen.py
+        COMMENT "Building bundle for ${rel_input}"
+        VERBATIM
+    )
+    target_sources(${target} PRIVATE ${output}.c)
+endfunction()
+
+function(target_add_template target path)
+    cmake_parse_arguments(arg "" "SYMBOL" "" ${ARGN})
+    if(IS_ABSOLUTE ${path})
+        set(input ${path})
+    else()
+        set(input ${CMAKE_CURRENT_SOURCE_DIR}/${path})
+    endif()
+    file(RELATIVE_PATH rel_input ${CMAKE_CURRENT_SOURCE_DIR} ${input})
+    set(output ${CMAKE_CURRENT_BINARY_DIR}/${rel_input})
+    get_filename_component(dir ${output} DIRECTORY)
+
+    set(options)
+    if(arg_SYMBOL)
+        list(APPEND options --symbol ${arg_SYMBOL})
+    endif()
+
+    add_custom_command(OUTPUT ${output}.c
+        COMMAND ${CMAKE_COMMAND} -E make_directory ${dir}
+        COMMAND ${python} ${cwhttpd_DIR}/tools/tpl2c.py ${options} ${input}
+                ${output}.c
+        DEPENDS ${input} ${cwhttpd_DIR}/tools/tpl2c.py
+                ${cwhttpd_DIR}/tools/bundle.py ${cwhttpd_DIR}/tools/routegen.py
+        COMMENT "Building template for ${rel_input}"
+        VERBATIM
+    )
+    target_sources(${target} PRIVATE ${output}.c)
+endfunction()
@@ -24,4 +24,8 @@ if(EXISTS ${CMAKE_CURRENT_LIST_DIR}/../../frogfs)
         ${frogfs_INC}
         ${frogfs_cwhttpd_INC}
     )
+    target_compile_definitions(${COMPONENT_LIB}
+    PUBLIC
+        CONFIG_CWHTTPD_FROGFS=1
+    )
 endif()
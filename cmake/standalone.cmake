@@ -21,6 +21,13 @@ PUBLIC
     rt
 )
 
+option(CWHTTPD_GZIP "Compress chunked responses with zlib" OFF)
+if(CWHTTPD_GZIP)
+    find_package(ZLIB REQUIRED)
+    target_compile_definitions(cwhttpd PUBLIC CONFIG_CWHTTPD_GZIP=1)
+    target_link_libraries(cwhttpd PUBLIC ZLIB::ZLIB)
+endif()
+
 if(EXISTS ${CMAKE_CURRENT_LIST_DIR}/../../frogfs)
     include(${CMAKE_CURRENT_LIST_DIR}/../../frogfs/cmake/files.cmake)
 
@@ -34,4 +41,8 @@ if(EXISTS ${CMAKE_CURRENT_LIST_DIR}/../../frogfs)
         ${frogfs_INC}
         ${frogfs_PRIV_INC}
     )
+    target_compile_definitions(cwhttpd
+    PUBLIC
+        CONFIG_CWHTTPD_FROGFS=1
+    )
 endif()
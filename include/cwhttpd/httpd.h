@@ -17,6 +17,8 @@ extern "C" {
 #include <stdbool.h>
 #include <stddef.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
 #if defined(ESP_PLATFORM)
@@ -48,16 +50,22 @@ extern "C" {
  *********************/
 
 typedef struct cwhttpd_route_t cwhttpd_route_t;
+typedef struct cwhttpd_router_t cwhttpd_router_t;
 typedef struct cwhttpd_inst_t cwhttpd_inst_t;
 typedef struct cwhttpd_request_t cwhttpd_request_t;
 typedef struct cwhttpd_conn_t cwhttpd_conn_t;
 typedef struct cwhttpd_post_t cwhttpd_post_t;
 typedef struct frogfs_fs_t frogfs_fs_t;
+typedef struct cwhttpd_fs_cache_t cwhttpd_fs_cache_t;
+typedef struct cwhttpd_stat_cache_t cwhttpd_stat_cache_t;
+typedef struct cwhttpd_tpl_cache_t cwhttpd_tpl_cache_t;
+typedef struct cwhttpd_compress_pool_t cwhttpd_compress_pool_t;
 typedef struct cwhttpd_method_entry_t cwhttpd_method_entry_t;
 
 typedef enum cwhttpd_flags_t cwhttpd_flags_t;
 typedef enum cwhttpd_status_t cwhttpd_status_t;
 typedef enum cwhttpd_method_t cwhttpd_method_t;
+typedef enum cwhttpd_encoding_t cwhttpd_encoding_t;
 
 typedef cwhttpd_status_t (*cwhttpd_route_handler_t)(cwhttpd_conn_t *conn);
 typedef cwhttpd_status_t (*cwhttpd_recv_handler_t)(cwhttpd_conn_t *conn,
@@ -82,23 +90,71 @@ enum cwhttpd_flags_t {
  * This is used to send dispatch URL requests to route handlers.
  */
 typedef struct cwhttpd_route_t {
-    cwhttpd_route_t *next; /**< next route entry */
     cwhttpd_route_handler_t handler; /**< route handler function */
     const char *path; /**< path expression for this route */
+    size_t path_len; /**< length of path expression */
+    uint32_t methods; /**< mask of accepted methods, 0 for any */
     size_t argc; /**< argument count */
     const void *argv[]; /**< argument list */
 } cwhttpd_route_t;
 
+/**
+ * \brief Marks the absence of an index in a static route table
+ */
+#define CWHTTPD_STATIC_NONE UINT16_MAX
+
+/**
+ * \brief An exact path or wildcard prefix in a static route table
+ */
+typedef struct cwhttpd_static_key_t {
+    const char *path; /**< exact path or prefix without '*', NULL if the
+                           slot is empty */
+    uint16_t path_len; /**< length of path */
+    uint16_t parent; /**< index of the longest prefix of this prefix, or
+                          \a CWHTTPD_STATIC_NONE */
+    uint16_t first; /**< first entry of this key in the index list */
+    uint16_t count; /**< number of routes with this key */
+} cwhttpd_static_key_t;
+
+/**
+ * \brief A route table compiled at build time
+ *
+ * \par Description
+ * \verbatim embed:rst:leading-asterisk
+ *
+ * These tables are generated by ``tools/routegen.py``, usually through the
+ * ``target_add_routes()`` cmake function, and live in read-only memory.
+ * Exact paths are found through a perfect hash, wildcard prefixes through a
+ * sorted list where every prefix links to the longest other prefix it
+ * starts with.
+ *
+ * \endverbatim */
+typedef struct cwhttpd_static_routes_t {
+    const cwhttpd_route_t *const *routes; /**< routes in dispatch order */
+    uint16_t num_routes; /**< number of routes */
+    const uint16_t *indexes; /**< route indexes grouped by key, ascending
+                                  within each key */
+    const uint16_t *seeds; /**< hash seed of every bucket */
+    uint16_t num_buckets; /**< number of buckets */
+    const cwhttpd_static_key_t *exact; /**< exact paths by hash slot */
+    uint16_t num_slots; /**< number of hash slots */
+    const cwhttpd_static_key_t *prefixes; /**< prefixes, sorted */
+    uint16_t num_prefixes; /**< number of prefixes */
+} cwhttpd_static_routes_t;
+
 /**
  * \brief A struct for httpd instances
  *
  * This struct is shared between all connections.
  */
 struct cwhttpd_inst_t {
-    cwhttpd_route_t *route_head; /**< head of route linked list */
-    cwhttpd_route_t *route_tail; /**< tail of route linked list */
-    size_t num_routes; /**< number of routes */
+    cwhttpd_router_t *router; /**< route tables */
     frogfs_fs_t *frogfs; /**< \a frogfs_fs_t instance */
+    cwhttpd_fs_cache_t *fs_cache; /**< file content cache or NULL */
+    cwhttpd_stat_cache_t *stat_cache; /**< file metadata cache or NULL */
+    cwhttpd_tpl_cache_t *tpl_cache; /**< parsed template cache or NULL */
+    cwhttpd_compress_pool_t *compress; /**< idle response compressors or
+            NULL */
     void *user; /**< user data */
 };
 
@@ -114,6 +170,55 @@ cwhttpd_inst_t *cwhttpd_init(
     cwhttpd_flags_t flags /** [in] configuration flags */
 );
 
+/**
+ * \brief Insert a route for given methods at a given index in the route list
+ *
+ * \par Description
+ * \verbatim embed:rst:leading-asterisk
+ *
+ * Routes with a method mask are skipped during dispatch unless the request
+ * method is in the mask, so their handler is never called. Build the mask
+ * with :c:macro:`CWHTTPD_METHOD_MASK`, for example::
+ *
+ *     CWHTTPD_METHOD_MASK(CWHTTPD_METHOD_GET) |
+ *             CWHTTPD_METHOD_MASK(CWHTTPD_METHOD_POST)
+ *
+ * \endverbatim */
+void cwhttpd_route_vinsert_method(
+    cwhttpd_inst_t *inst, /** [in] httpd instance */
+    ssize_t index, /** [in] index of route entry, can be negative */
+    uint32_t methods, /** [in] mask of accepted methods, 0 for any */
+    const char *path, /** [in] path expression for this route */
+    cwhttpd_route_handler_t handler, /** [in] route handler function */
+    size_t argc, /** [in] argument count */
+    va_list args /** [in] arguments */
+);
+
+/**
+ * \brief Insert a route for given methods at a given index in the route list
+ */
+void cwhttpd_route_insert_method(
+    cwhttpd_inst_t *inst, /** [in] httpd instance */
+    ssize_t index, /** [in] index of route entry, can be negative */
+    uint32_t methods, /** [in] mask of accepted methods, 0 for any */
+    const char *path, /** [in] path expression for this route */
+    cwhttpd_route_handler_t handler, /** [in] route handler function */
+    size_t argc, /** [in] argument count */
+    ... /** [in] arguments */
+);
+
+/**
+ * \brief Append a route for given methods to the end of the route list
+ */
+void cwhttpd_route_append_method(
+    cwhttpd_inst_t *inst, /** [in] httpd instance */
+    uint32_t methods, /** [in] mask of accepted methods, 0 for any */
+    const char *path, /** [in] path expression for this route */
+    cwhttpd_route_handler_t handler, /** [in] route handler function */
+    size_t argc, /** [in] argument count */
+    ... /** [in] arguments */
+);
+
 /**
  * \brief Insert a route at a given index in the route list
  */
@@ -153,6 +258,9 @@ void cwhttpd_route_append(
  * \brief Return the route at the given index of the route list
  *
  * \returns The route at the given index
+ *
+ * \note Routes can be inserted and removed while the server is running.
+ *       The returned route is valid until it is removed.
  */
 cwhttpd_route_t *cwhttpd_route_get(
     cwhttpd_inst_t *inst, /** [in] httpd instance */
@@ -167,6 +275,109 @@ void cwhttpd_route_remove(
     ssize_t index /** [in] index of route entry, can be negative */
 );
 
+/**
+ * \brief Set the static route table of the default route list
+ *
+ * \par Description
+ * \verbatim embed:rst:leading-asterisk
+ *
+ * Static routes are tried before the routes of the route list, in the order
+ * they were compiled in. They are not counted by the index of the route list
+ * functions. Pass NULL to remove the table again.
+ *
+ * \endverbatim */
+void cwhttpd_route_set_static(
+    cwhttpd_inst_t *inst, /** [in] httpd instance */
+    const cwhttpd_static_routes_t *routes /** [in] static route table, or
+                                                   NULL */
+);
+
+/**
+ * \brief Insert a route at a given index in the route list of a virtual host
+ *
+ * \par Description
+ * \verbatim embed:rst:leading-asterisk
+ *
+ * Each virtual host has its own route list. Requests are dispatched to the
+ * routes of the host named in their Host header, compared without port and
+ * case, or to the default route list if there is no such host. Only one
+ * route list is searched per request, the default route list is not a
+ * fallback for the routes of a virtual host.
+ *
+ * A virtual host is added with its first route and removed with its last.
+ * Passing NULL for ``host`` uses the default route list.
+ *
+ * \endverbatim */
+void cwhttpd_vhost_route_vinsert(
+    cwhttpd_inst_t *inst, /** [in] httpd instance */
+    const char *host, /** [in] host name, or NULL for the default */
+    ssize_t index, /** [in] index of route entry, can be negative */
+    uint32_t methods, /** [in] mask of accepted methods, 0 for any */
+    const char *path, /** [in] path expression for this route */
+    cwhttpd_route_handler_t handler, /** [in] route handler function */
+    size_t argc, /** [in] argument count */
+    va_list args /** [in] arguments */
+);
+
+/**
+ * \brief Insert a route at a given index in the route list of a virtual host
+ */
+void cwhttpd_vhost_route_insert(
+    cwhttpd_inst_t *inst, /** [in] httpd instance */
+    const char *host, /** [in] host name, or NULL for the default */
+    ssize_t index, /** [in] index of route entry, can be negative */
+    uint32_t methods, /** [in] mask of accepted methods, 0 for any */
+    const char *path, /** [in] path expression for this route */
+    cwhttpd_route_handler_t handler, /** [in] route handler function */
+    size_t argc, /** [in] argument count */
+    ... /** [in] arguments */
+);
+
+/**
+ * \brief Append a route to the end of the route list of a virtual host
+ */
+void cwhttpd_vhost_route_append(
+    cwhttpd_inst_t *inst, /** [in] httpd instance */
+    const char *host, /** [in] host name, or NULL for the default */
+    uint32_t methods, /** [in] mask of accepted methods, 0 for any */
+    const char *path, /** [in] path expression for this route */
+    cwhttpd_route_handler_t handler, /** [in] route handler function */
+    size_t argc, /** [in] argument count */
+    ... /** [in] arguments */
+);
+
+/**
+ * \brief Return the route at the given index of the route list of a virtual
+ *        host
+ *
+ * \returns The route at the given index, or NULL if the host has no routes
+ */
+cwhttpd_route_t *cwhttpd_vhost_route_get(
+    cwhttpd_inst_t *inst, /** [in] httpd instance */
+    const char *host, /** [in] host name, or NULL for the default */
+    ssize_t index /** [in] index of route entry, can be negative */
+);
+
+/**
+ * \brief Delete a route at the given index of the route list of a virtual
+ *        host
+ */
+void cwhttpd_vhost_route_remove(
+    cwhttpd_inst_t *inst, /** [in] httpd instance */
+    const char *host, /** [in] host name, or NULL for the default */
+    ssize_t index /** [in] index of route entry, can be negative */
+);
+
+/**
+ * \brief Set the static route table of a virtual host
+ */
+void cwhttpd_vhost_route_set_static(
+    cwhttpd_inst_t *inst, /** [in] httpd instance */
+    const char *host, /** [in] host name, or NULL for the default */
+    const cwhttpd_static_routes_t *routes /** [in] static route table, or
+                                                   NULL */
+);
+
 #if defined(CONFIG_CWHTTPD_MBEDTLS)
 /**
  * \brief Set the ssl certificate and private key (in DER format)
@@ -260,6 +471,26 @@ enum cwhttpd_method_t {
     CWHTTPD_METHOD_UNKNOWN,
 };
 
+/**
+ * \brief Route method mask bit for a \a cwhttpd_method_t
+ */
+#define CWHTTPD_METHOD_MASK(method) (1 << (method))
+
+/**
+ * \brief Content codings, in increasing order of preference
+ */
+enum cwhttpd_encoding_t {
+    CWHTTPD_ENCODING_IDENTITY,
+    CWHTTPD_ENCODING_DEFLATE,
+    CWHTTPD_ENCODING_GZIP,
+    CWHTTPD_ENCODING_BR,
+};
+
+/**
+ * \brief Mask bit for a \a cwhttpd_encoding_t
+ */
+#define CWHTTPD_ENCODING_MASK(encoding) (1 << (encoding))
+
 /**
  * \brief HTTP request data
  */
@@ -325,9 +556,73 @@ ssize_t cwhttpd_plat_send(
     size_t len /** [in] data length */
 );
 
+/**
+ * \brief Send several buffers over connection at once
+ *
+ * \return number of bytes that were actually written, or -1 on error
+ */
+ssize_t cwhttpd_plat_sendv(
+    cwhttpd_conn_t *conn, /** [in] connection instance */
+    const struct iovec *iov, /** [in] buffers */
+    int iovcnt /** [in] number of buffers */
+);
+
+/**
+ * \brief Send part of a file over connection
+ *
+ * \par Description
+ * \verbatim embed:rst:leading-asterisk
+ *
+ * Uses ``sendfile()`` where the platform has it, otherwise the file is read
+ * and sent in pieces. The file position of **fd** is undefined afterwards.
+ *
+ * \endverbatim
+ *
+ * \return number of bytes that were actually written, or -1 on error
+ */
+ssize_t cwhttpd_plat_sendfile(
+    cwhttpd_conn_t *conn, /** [in] connection instance */
+    int fd, /** [in] file descriptor */
+    off_t offset, /** [in] file offset */
+    size_t len /** [in] number of bytes to send */
+);
+
+/**
+ * \brief Receive data over connection into part of a file
+ *
+ * \par Description
+ * \verbatim embed:rst:leading-asterisk
+ *
+ * Uses ``splice()`` through a pipe on Linux, otherwise the data is received
+ * and written in pieces. Data already buffered by the server is not
+ * included, see :cpp:member:`cwhttpd_post_t::buf`. The file position of
+ * **fd** is undefined afterwards.
+ *
+ * \endverbatim
+ *
+ * \return number of bytes that were actually received, or -1 on error
+ */
+ssize_t cwhttpd_plat_recvfile(
+    cwhttpd_conn_t *conn, /** [in] connection instance */
+    int fd, /** [in] file descriptor */
+    off_t offset, /** [in] file offset */
+    size_t len /** [in] number of bytes to receive */
+);
+
 /**
  * \brief Receive data over connection, using req data first if available
  *
+ * \par Description
+ * \verbatim embed:rst:leading-asterisk
+ *
+ * On connections without a request body, such as WebSockets, reads smaller
+ * than CONFIG_CWHTTPD_RECV_BUFFER_SIZE fill a per-connection buffer and are
+ * served from it until it runs dry, so a stream of small messages costs one
+ * read from the socket per buffer rather than per field. Fewer bytes than
+ * requested may be returned.
+ *
+ * \endverbatim
+ *
  * \return number of bytes that were actually read, or -1 on error
  */
 ssize_t cwhttpd_recv(
@@ -336,9 +631,46 @@ ssize_t cwhttpd_recv(
     size_t len /** [in] number of bytes to recv */
 );
 
+/**
+ * \brief Let a client waiting for ``100 Continue`` send the request body
+ *
+ * \par Description
+ * \verbatim embed:rst:leading-asterisk
+ *
+ * A client that sent ``Expect: 100-continue`` holds the body back until the
+ * interim response, so the server doesn't read ahead of the route handler.
+ * The post buffer is empty on the first call of the handler, and the
+ * interim response goes out on the first body read through
+ * :cpp:func:`cwhttpd_recv()`, :cpp:func:`cwhttpd_plat_recvfile()` or
+ * :cpp:func:`cwhttpd_param_str()`, or when the handler returns
+ * **CWHTTPD_STATUS_MORE**. Handlers that read with
+ * :cpp:func:`cwhttpd_plat_recv()` call this first. A connection whose
+ * body was never asked for is closed after the response.
+ *
+ * Does nothing if the client isn't waiting.
+ *
+ * \endverbatim
+ *
+ * \return number of bytes sent, or -1 on error
+ */
+ssize_t cwhttpd_continue(
+    cwhttpd_conn_t *conn /** [in] connection instance */
+);
+
 /**
  * \brief Send data over connection
  *
+ * When built with CONFIG_CWHTTPD_GZIP, a chunked response whose
+ * Content-Type is compressible and that sent neither Content-Length nor
+ * Content-Encoding is compressed on the fly if the client accepts gzip or
+ * deflate and the body reaches CONFIG_CWHTTPD_GZIP_MIN_SIZE. The data is
+ * then consumed as it comes and len is returned. zlib holds output back
+ * until its buffer fills, cwhttpd_flush() or the end of the response, and
+ * a full send buffer is flushed the same way.
+ *
+ * On a buffered connection, see cwhttpd_set_buffered(), the data is
+ * collected and len is returned.
+ *
  * \return number of bytes that were actually written, or -1 on error
  */
 ssize_t cwhttpd_send(
@@ -347,6 +679,20 @@ ssize_t cwhttpd_send(
     ssize_t len /** [out] number of bytes to send or -1 for strlen */
 );
 
+/**
+ * \brief Send part of a file over connection
+ *
+ * Like cwhttpd_send(), but the data comes from a file.
+ *
+ * \return number of bytes that were actually written, or -1 on error
+ */
+ssize_t cwhttpd_sendfile(
+    cwhttpd_conn_t *conn, /** [in] connection instance */
+    int fd, /** [in] file descriptor */
+    off_t offset, /** [in] file offset */
+    size_t len /** [in] number of bytes to send */
+);
+
 /**
  * \brief Send data over connection using a format string
  *
@@ -358,6 +704,19 @@ ssize_t cwhttpd_sendf(
     ... /** [in] format arguments */
 );
 
+/**
+ * \brief Send response data collected by a buffered connection
+ *
+ * A compressed response also gets everything zlib holds back, as a chunk
+ * ending in a sync flush, so streamed output reaches the client as it is
+ * produced.
+ *
+ * \return number of bytes that were actually written, or -1 on error
+ */
+ssize_t cwhttpd_flush(
+    cwhttpd_conn_t *conn /** [in] connection instance */
+);
+
 /**
  * \brief Get the value of a header in the connection's head buffer
  *
@@ -388,6 +747,26 @@ void cwhttpd_set_close(
     bool close /** [in] true to set close */
 );
 
+/**
+ * \brief Collect response data before sending it
+ *
+ * \verbatim embed:rst:leading-asterisk
+ *
+ * Routes that produce their body in many small pieces can turn this on so
+ * :cpp:func:`cwhttpd_send()` copies the pieces into a buffer of
+ * CONFIG_CWHTTPD_SEND_BUFFER_SIZE bytes, which is sent with a single write
+ * (or as a single chunk) once it is full. The buffer is also sent before
+ * :cpp:func:`cwhttpd_sendfile()` or :cpp:func:`cwhttpd_chunk_start()`, by
+ * :cpp:func:`cwhttpd_flush()`, when buffering is turned off and when the
+ * response ends.
+ *
+ * \endverbatim
+ */
+void cwhttpd_set_buffered(
+    cwhttpd_conn_t *conn, /** [in] connection instance */
+    bool enable /** [in] true to buffer */
+);
+
 /**
  * \brief Start a http response
  *
@@ -398,6 +777,55 @@ ssize_t cwhttpd_response(
     int code /** [in] HTTP status code */
 );
 
+/**
+ * \brief Send a complete response with a single write
+ *
+ * \par Description
+ * \verbatim embed:rst:leading-asterisk
+ *
+ * Sends the status line, the ``Server``, ``Content-Length`` and
+ * ``Connection`` headers, the given headers and the body together. The
+ * headers must each end with ``\r\n``. Nothing else can be sent for this
+ * request afterwards. ``Content-Length`` is left out for 204 and 304
+ * responses, which never have a body.
+ *
+ * \endverbatim
+ *
+ * \return bytes sent or -1 on error
+ */
+ssize_t cwhttpd_send_response(
+    cwhttpd_conn_t *conn, /** [in] connection instance */
+    int code, /** [in] HTTP status code */
+    const char *headers, /** [in] header lines, can be NULL if headers_len
+                                  is 0 */
+    size_t headers_len, /** [in] length of headers */
+    const void *body, /** [in] body, can be NULL if body_len is 0 */
+    size_t body_len /** [in] length of body */
+);
+
+/**
+ * \brief Send a response head for a body of known length
+ *
+ * \par Description
+ * \verbatim embed:rst:leading-asterisk
+ *
+ * Sends the same head as :cpp:func:`cwhttpd_send_response()`, in a single
+ * write. The body of **content_length** bytes is sent afterwards with
+ * :cpp:func:`cwhttpd_send()` or :cpp:func:`cwhttpd_sendfile()`.
+ *
+ * \endverbatim
+ *
+ * \return bytes sent or -1 on error
+ */
+ssize_t cwhttpd_send_head(
+    cwhttpd_conn_t *conn, /** [in] connection instance */
+    int code, /** [in] HTTP status code */
+    const char *headers, /** [in] header lines, can be NULL if headers_len
+                                  is 0 */
+    size_t headers_len, /** [in] length of headers */
+    size_t content_length /** [in] length of the body */
+);
+
 /**
  * \brief Send a custom HTTP header
  *
@@ -409,6 +837,34 @@ ssize_t cwhttpd_send_header(
     const char *value /** [in] header value */
 );
 
+/**
+ * \brief Return the Cache-Control value cwhttpd_send_cache_header() sends
+ *
+ * \return header value or NULL if none is sent for the mime type
+ */
+const char *cwhttpd_cache_control(
+    const char *mime /** [in] mime type */
+);
+
+/**
+ * \brief Choose a content coding for the response from Accept-Encoding
+ *
+ * \par Description
+ * \verbatim embed:rst:leading-asterisk
+ *
+ * Codings are weighed by their ``q`` values, a ``*`` entry applies to those
+ * not listed. On equal weight the most compact coding wins. ``identity`` is
+ * returned if the request has no ``Accept-Encoding`` header or accepts none
+ * of the available codings.
+ *
+ * \endverbatim
+ * \return chosen coding
+ */
+cwhttpd_encoding_t cwhttpd_negotiate_encoding(
+    cwhttpd_conn_t *conn, /** [in] connection instance */
+    unsigned int available /** [in] mask of CWHTTPD_ENCODING_MASK() bits */
+);
+
 /**
  * \brief Send a sensible cache control header
  *
@@ -465,7 +921,8 @@ void cwhttpd_redirect(
  *
  * \return actual number of bytes written excluding the NULL terminator
  *
- * \note Output buffer is always NULL terminated
+ * \note Output buffer is always NULL terminated. \a out may be the same
+ *       buffer as \a in to decode in place.
  */
 size_t cwhttpd_url_decode(
     const char *in, /** [in] input buffer */
@@ -491,15 +948,182 @@ ssize_t cwhttpd_find_param(
                                   required */
 );
 
+/**
+ * \brief Look up a GET or POST parameter of the current request
+ *
+ * \par Description
+ * \verbatim embed:rst:leading-asterisk
+ *
+ * On first use, the query string and a fully received, non-multipart POST
+ * body are split into a per-request index and every key and value is
+ * urldecoded once, so ``a%5Fb`` is found as ``a_b``. Later lookups are
+ * answered from that index, however many parameters the request has. Query
+ * string parameters take precedence over POST parameters with the same
+ * name.
+ *
+ * \endverbatim
+ *
+ * \return urldecoded value, or NULL if not found
+ *
+ * \note The returned value is NULL terminated and valid until the end of the
+ *       request.
+ */
+const char *cwhttpd_param_str(
+    cwhttpd_conn_t *conn, /** [in] connection instance */
+    const char *name, /** [in] parameter name */
+    size_t *len /** [out] decoded value length, or NULL */
+);
+
+/**
+ * \brief Look up a GET or POST parameter as an integer
+ *
+ * \return true if the parameter was found and is a valid integer
+ */
+bool cwhttpd_param_int(
+    cwhttpd_conn_t *conn, /** [in] connection instance */
+    const char *name, /** [in] parameter name */
+    long *value /** [out] parameter value */
+);
+
+/**
+ * \brief Look up a named segment captured by the current route
+ *
+ * \par Description
+ * \verbatim embed:rst:leading-asterisk
+ *
+ * A route path segment of the form ``:name`` matches one non-empty URL
+ * segment, for example ``/api/device/:id`` matches ``/api/device/42``. The
+ * captured segments are recorded while matching the route, so this only
+ * looks up the name in the route path.
+ *
+ * \endverbatim
+ *
+ * \return start of the segment in the request URL, or NULL if the route has
+ *         no such capture
+ *
+ * \note The returned value is neither NULL terminated nor urldecoded. It is
+ *       valid until the end of the request.
+ */
+const char *cwhttpd_route_param(
+    cwhttpd_conn_t *conn, /** [in] connection instance */
+    const char *name, /** [in] capture name without the ':' */
+    size_t *len /** [out] segment length, or NULL */
+);
+
 /**
  * \brief Return the mimetype for a given URL
  *
- * \return mime type string
+ * \par Description
+ * \verbatim embed:rst:leading-asterisk
+ *
+ * The extension of the last path segment is looked up case-insensitively in
+ * a hash table holding the builtin types and those added with
+ * :c:func:`cwhttpd_mime_add` or :c:func:`cwhttpd_mime_load`. URLs without a
+ * known extension are ``text/html``.
+ *
+ * \endverbatim
+ *
+ * \return mime type string, valid for the lifetime of the program
  */
 const char *cwhttpd_get_mimetype(
     const char *url /** [in] URL */
 );
 
+/**
+ * \brief Map a file extension to a mime type
+ *
+ * \par Description
+ * \verbatim embed:rst:leading-asterisk
+ *
+ * The mapping replaces a builtin or earlier one of the same extension, also
+ * for files the stat cache has already resolved. Mappings are kept for the
+ * lifetime of the program and are shared by all server instances, so add
+ * them at startup rather than per request.
+ *
+ * \endverbatim
+ *
+ * \return true on success
+ */
+bool cwhttpd_mime_add(
+    const char *ext, /** [in] extension, with or without the leading dot */
+    const char *mimetype /** [in] mime type, copied */
+);
+
+/**
+ * \brief Add the mappings of a mime.types file
+ *
+ * \par Description
+ * \verbatim embed:rst:leading-asterisk
+ *
+ * Every line is a mime type followed by its extensions, text after ``#`` is
+ * ignored. This is the format of ``/etc/mime.types``, so on Linux::
+ *
+ *     cwhttpd_mime_load("/etc/mime.types");
+ *
+ * makes the server agree with the rest of the system. Mappings from the
+ * file replace builtin ones of the same extension.
+ *
+ * \endverbatim
+ *
+ * \return number of extensions added, or -1 if the file can't be opened
+ */
+ssize_t cwhttpd_mime_load(
+    const char *path /** [in] path of the file */
+);
+
+/**
+ * \brief Check if content of a mime type shrinks when compressed
+ *
+ * Parameters such as charset are ignored. Event streams are never
+ * compressible, as they must not be held back.
+ *
+ * \return true for text and text-like types
+ */
+bool cwhttpd_mime_compressible(
+    const char *mime /** [in] mime type, can be NULL */
+);
+
+/**
+ * \brief Buffer size for an HTTP date, including the terminator
+ */
+#define CWHTTPD_DATE_LEN 30
+
+/**
+ * \brief Format a time as an HTTP date
+ *
+ * \par Description
+ * \verbatim embed:rst:leading-asterisk
+ *
+ * The IMF-fixdate format is used, for example
+ * ``Sun, 06 Nov 1994 08:49:37 GMT``.
+ *
+ * \endverbatim
+ *
+ * \return length of the date
+ */
+size_t cwhttpd_format_date(
+    char *buf, /** [out] buffer of CWHTTPD_DATE_LEN bytes */
+    time_t t /** [in] seconds since the epoch */
+);
+
+/**
+ * \brief Parse an HTTP date
+ *
+ * \par Description
+ * \verbatim embed:rst:leading-asterisk
+ *
+ * Accepts the IMF-fixdate format as well as the obsolete RFC 850 and asctime
+ * formats.
+ *
+ * \endverbatim
+ *
+ * \return true on success
+ */
+bool cwhttpd_parse_date(
+    const char *s, /** [in] date string */
+    time_t *t /** [out] seconds since the epoch */
+);
+
 /**
  * \brief Custom sprintf implementation
  *
@@ -16,33 +16,149 @@
 # define CONFIG_CWHTTPD_MAX_REQUEST_SIZE 1024
 #endif
 
+/**
+ * \brief GET/POST parameters indexed per request without an allocation.
+ */
+#ifndef CONFIG_CWHTTPD_MAX_PARAMS
+# define CONFIG_CWHTTPD_MAX_PARAMS 16
+#endif
+
+/**
+ * \brief Max number of named segment captures in a route path.
+ */
+#ifndef CONFIG_CWHTTPD_MAX_ROUTE_PARAMS
+# define CONFIG_CWHTTPD_MAX_ROUTE_PARAMS 4
+#endif
+
+/**
+ * \brief Bytes of response data a buffered connection collects per write.
+ */
+#ifndef CONFIG_CWHTTPD_SEND_BUFFER_SIZE
+# define CONFIG_CWHTTPD_SEND_BUFFER_SIZE 2048
+#endif
+
+/**
+ * \brief Bytes cwhttpd_recv() reads ahead on connections without a request
+ * body.
+ */
+#ifndef CONFIG_CWHTTPD_RECV_BUFFER_SIZE
+# define CONFIG_CWHTTPD_RECV_BUFFER_SIZE 2048
+#endif
+
+/**
+ * \brief Number of worker tasks per instance.
+ */
+#ifndef CONFIG_CWHTTPD_WORKER_COUNT
+# define CONFIG_CWHTTPD_WORKER_COUNT 8
+#endif
+
+/**
+ * \brief Bytes of file content kept in memory per instance, 0 to disable.
+ */
+#ifndef CONFIG_CWHTTPD_FS_CACHE_SIZE
+# define CONFIG_CWHTTPD_FS_CACHE_SIZE 262144
+#endif
+
+/**
+ * \brief Largest file that is kept in the file content cache.
+ */
+#ifndef CONFIG_CWHTTPD_FS_CACHE_MAX_FILE
+# define CONFIG_CWHTTPD_FS_CACHE_MAX_FILE 32768
+#endif
+
+/**
+ * \brief Number of independently locked parts of the file content cache.
+ */
+#ifndef CONFIG_CWHTTPD_FS_CACHE_SHARDS
+# define CONFIG_CWHTTPD_FS_CACHE_SHARDS 4
+#endif
+
+/**
+ * \brief Paths whose stat result is kept per instance, 0 to disable.
+ */
+#ifndef CONFIG_CWHTTPD_STAT_CACHE_SIZE
+# define CONFIG_CWHTTPD_STAT_CACHE_SIZE 128
+#endif
+
+/**
+ * \brief Milliseconds a stat result of an existing path is reused.
+ */
+#ifndef CONFIG_CWHTTPD_STAT_CACHE_TTL_MS
+# define CONFIG_CWHTTPD_STAT_CACHE_TTL_MS 1000
+#endif
+
+/**
+ * \brief Milliseconds a failed stat of a path is reused.
+ */
+#ifndef CONFIG_CWHTTPD_STAT_CACHE_NEG_TTL_MS
+# define CONFIG_CWHTTPD_STAT_CACHE_NEG_TTL_MS 250
+#endif
+
+/**
+ * \brief Parsed templates kept per instance, 0 to disable.
+ */
+#ifndef CONFIG_CWHTTPD_TPL_CACHE_SIZE
+# define CONFIG_CWHTTPD_TPL_CACHE_SIZE 16
+#endif
+
+/**
+ * \brief Largest template that is parsed in memory, larger ones are
+ *        streamed.
+ */
+#ifndef CONFIG_CWHTTPD_TPL_MAX_FILE
+# define CONFIG_CWHTTPD_TPL_MAX_FILE 32768
+#endif
+
+/**
+ * \brief Keep stat results until inotify reports a change, Linux only.
+ */
+#if defined(__linux__) && !defined(CONFIG_CWHTTPD_FS_WATCH)
+# define CONFIG_CWHTTPD_FS_WATCH 1
+#endif
+
+/**
+ * \brief Send files to TLS connections from shared read-only mappings,
+ *        Linux only.
+ *
+ * Requires the stat cache. A file truncated in place while it is being sent
+ * raises SIGBUS, so this is off by default.
+ */
+#ifndef CONFIG_CWHTTPD_FS_MMAP
+# define CONFIG_CWHTTPD_FS_MMAP 0
+#endif
+
+/**
+ * \brief Max number of directories watched per instance.
+ */
+#ifndef CONFIG_CWHTTPD_FS_WATCH_MAX
+# define CONFIG_CWHTTPD_FS_WATCH_MAX 256
+#endif
+
+/**
+ * \brief Compress chunked responses with zlib when the client accepts it.
+ */
+#ifndef CONFIG_CWHTTPD_GZIP
+# define CONFIG_CWHTTPD_GZIP 0
+#endif
+
+/**
+ * \brief zlib compression level of chunked responses, 1 (fast) to 9 (small).
+ */
+#ifndef CONFIG_CWHTTPD_GZIP_LEVEL
+# define CONFIG_CWHTTPD_GZIP_LEVEL 6
+#endif
+
+/**
+ * \brief Smallest chunked response body that is compressed.
+ */
+#ifndef CONFIG_CWHTTPD_GZIP_MIN_SIZE
+# define CONFIG_CWHTTPD_GZIP_MIN_SIZE 1024
+#endif
+
 typedef struct cwhttpd_conn_t cwhttpd_conn_t;
 typedef struct cwhttpd_conn_priv_t cwhttpd_conn_priv_t;
-
-// Struct to keep extension->mime data in
-typedef struct {
-    const char *ext;
-    const char *mimetype;
-} mime_map_t;
-
-// The mappings from file extensions to mime types. If you need an extra mime
-// type, add it here.
-static const mime_map_t mime_types[] = {
-    {"htm",   "text/html"},
-    {"html",  "text/html"},
-    {"css",   "text/css"},
-    {"js",    "text/javascript"},
-    {"txt",   "text/plain"},
-    {"jpg",   "image/jpeg"},
-    {"jpeg",  "image/jpeg"},
-    {"png",   "image/png"},
-    {"svg",   "image/svg+xml"},
-    {"xml",   "text/xml"},
-    {"json",  "application/json"},
-    {"woff",  "font/woff"},
-    {"woff2", "font/woff2"},
-    {NULL,    "text/html"}, // default value
-};
+typedef struct cwhttpd_param_t cwhttpd_param_t;
+typedef struct cwhttpd_span_t cwhttpd_span_t;
 
 // Flags
 enum {
@@ -51,6 +167,9 @@ enum {
     HFL_SENDING_HEADER      = (1 << 2),
     HFL_SENDING_CHUNK       = (1 << 3),
     HFL_CLOSE               = (1 << 4),
+    HFL_COMPRESSIBLE        = (1 << 5),
+    HFL_SEND_BUFFERED       = (1 << 6),
+    HFL_EXPECT_CONTINUE     = (1 << 7),
 
     HFL_RECEIVED_HTTP11     = (1 << 8),
     HFL_RECEIVED_CONN_CLOSE = (1 << 9),
@@ -61,6 +180,29 @@ enum {
     HFL_SENT_CONTENT_LENGTH = (1 << 18),
     HFL_SENT_FINAL_CHUNK    = (1 << 19),
     HFL_SENT_CONN_CLOSE     = (1 << 20),
+    HFL_SENT_ENCODING       = (1 << 21),
+
+    HFL_PARAMS_INDEXED      = (1 << 24),
+    HFL_PARAMS_POST         = (1 << 25),
+};
+
+/**
+ * \brief Indexed GET/POST parameter
+ */
+struct cwhttpd_param_t {
+    const char *key; /**< key, NULL terminated */
+    const char *value; /**< urldecoded value, NULL terminated */
+    size_t key_len; /**< key length */
+    size_t value_len; /**< decoded value length */
+    uint32_t hash; /**< key hash */
+};
+
+/**
+ * \brief Span of a string that is not NULL terminated
+ */
+struct cwhttpd_span_t {
+    const char *ptr; /**< start of span */
+    size_t len; /**< span length */
 };
 
 /**
@@ -72,4 +214,21 @@ struct cwhttpd_conn_priv_t {
     size_t req_len;
     size_t chunk_left;
     uint32_t flags; /**< connection state */
+    cwhttpd_param_t params[CONFIG_CWHTTPD_MAX_PARAMS]; /**< parameter index */
+    size_t num_params; /**< number of indexed parameters */
+    cwhttpd_param_t *more_params; /**< parameters past params, or NULL */
+    size_t more_params_cap; /**< slots in more_params */
+    char *param_buf; /**< parameter key and value storage */
+    cwhttpd_span_t route_params[CONFIG_CWHTTPD_MAX_ROUTE_PARAMS]; /**< URL
+            segments captured by the matched route */
+    char *url_buf; /**< rewritten URL storage */
+    char *send_buf; /**< response data collected by cwhttpd_set_buffered() */
+    size_t send_buf_len; /**< bytes in send_buf */
+    char *recv_buf; /**< data read ahead by cwhttpd_recv() */
+    size_t recv_pos; /**< next unread byte in recv_buf */
+    size_t recv_len; /**< bytes in recv_buf */
+#if CONFIG_CWHTTPD_GZIP
+    struct compress_ctx_t *compress; /**< response compression state or
+            NULL */
+#endif
 };
@@ -34,6 +34,15 @@ void cwhttpd_delay_ms(
     uint32_t ms /** [in] milliseconds */
 );
 
+/**
+ * \brief Return a monotonic time in milliseconds
+ *
+ * The counter wraps around, so compare times by their difference.
+ *
+ * \return milliseconds since an arbitrary point
+ */
+uint32_t cwhttpd_time_ms(void);
+
 
 /******************
  * \section Mutex
@@ -41,6 +41,40 @@ typedef void (*cwhttpd_tpl_cb_t)(
  * If path is a directory, ``index.html`` is tried in that directory next.
  * Failing that, it falls through to the next route handler.
  *
+ * Responses carry an ``ETag`` made from the inode, size and modification
+ * time of the file, or from a hash of its content on filesystems without
+ * timestamps, and a ``Last-Modified`` header. Requests with a matching
+ * ``If-None-Match`` or ``If-Modified-Since`` header are answered with
+ * **304 Not Modified** without reading the file.
+ *
+ * Byte ranges requested with a ``Range`` header are answered with
+ * **206 Partial Content**, several ranges as ``multipart/byteranges``, and
+ * ranges that lie entirely beyond the end of the file with **416 Range Not
+ * Satisfiable**. An ``If-Range`` header that does not match the current
+ * ``ETag`` or ``Last-Modified`` value turns the request into a full one.
+ *
+ * Text-like files with a precompressed ``.br`` or ``.gz`` sibling that is
+ * not older than the file itself are served from that sibling if the
+ * ``Accept-Encoding`` header of the request prefers it, see
+ * :cpp:func:`cwhttpd_negotiate_encoding()`. Such responses carry
+ * ``Content-Encoding`` and do not support ranges, and every response for
+ * the file carries ``Vary: Accept-Encoding``.
+ *
+ * Stat results, including those of missing paths, are reused for
+ * ``CONFIG_CWHTTPD_STAT_CACHE_TTL_MS`` (``_NEG_TTL_MS`` for missing paths)
+ * when ``CONFIG_CWHTTPD_STAT_CACHE_SIZE`` is not 0. On Linux the open file
+ * is kept with them. A file replaced within that time may be served in its
+ * old version until the entry expires. With ``CONFIG_CWHTTPD_FS_MMAP``, TLS
+ * connections, which can't use ``sendfile()``, write straight from a
+ * read-only mapping of that file shared by all workers.
+ *
+ * On Linux the directories of looked up paths are watched with inotify, and
+ * their entries are kept until a file in them is modified, created, deleted
+ * or moved. Only symbolic links and paths in directories beyond
+ * ``CONFIG_CWHTTPD_FS_WATCH_MAX`` still expire. Replacing a directory by
+ * renaming one of its parents, or by changing a symbolic link that leads to
+ * it, is not noticed.
+ *
  * There are a few different ways of specifying routes, which all provide
  * slightly different results:
  *
@@ -106,6 +140,13 @@ cwhttpd_status_t cwhttpd_route_fs_get(cwhttpd_conn_t *conn);
  *
  * **arg2** or **template_cb** gets called every time it finds a
  * ``%token%`` in the template file, allowing you to emit dynamic content.
+ * ``%%`` emits a single ``%``.
+ *
+ * Templates up to CONFIG_CWHTTPD_TPL_MAX_FILE bytes are parsed once and
+ * kept until the file changes, CONFIG_CWHTTPD_TPL_CACHE_SIZE of them per
+ * instance. The response is buffered, see
+ * :cpp:func:`cwhttpd_set_buffered()`, so output of the callback is sent
+ * along with the surrounding text.
  *
  * \endverbatim */
 cwhttpd_status_t cwhttpd_route_fs_tpl(cwhttpd_conn_t *conn);
@@ -127,6 +168,25 @@ cwhttpd_status_t cwhttpd_route_fs_tpl(cwhttpd_conn_t *conn);
  *   2. Inside multipart/form-data (TODO: not supported yet)
  *   3. URL Parameter. **POST** ``/upload.cgi?filename=path%2Fnewfile.txt``
  *
+ * The ``filename`` parameter is only taken from the query string, never
+ * from the body. **POST** is accepted alongside **PUT** for upload forms
+ * and scripts, the body is the raw file content in both cases.
+ *
+ * Missing directories are created, and names with ``..`` components are
+ * refused with **403 Forbidden**. A ``Content-Length`` header is required,
+ * multipart bodies are answered with **415 Unsupported Media Type**.
+ *
+ * The body is written to a temporary file next to the target, which
+ * replaces the target once it is complete, so readers never see a partial
+ * file. On Linux the space is reserved up front, a full disk is answered
+ * with **507 Insufficient Storage**, and the body is moved from the socket
+ * to the file with ``splice()``, see :cpp:func:`cwhttpd_plat_recvfile()`.
+ * The response is **201 Created** for a new file and **200 OK** for a
+ * replaced one. A filesystem that can't rename over an existing file gets
+ * **500 Internal Server Error** and keeps the old file. Clients sending
+ * ``Expect: 100-continue`` only get the go-ahead once the request has been
+ * accepted.
+ *
  * Usage:
  * ::
  *
@@ -154,6 +214,252 @@ cwhttpd_status_t cwhttpd_route_fs_tpl(cwhttpd_conn_t *conn);
  * \endverbatim */
 cwhttpd_status_t cwhttpd_route_fs_put(cwhttpd_conn_t *conn);
 
+/**
+ * \brief File content cache counters
+ */
+typedef struct cwhttpd_fs_cache_stats_t {
+    unsigned long hits; /**< requests served from memory */
+    unsigned long misses; /**< cacheable requests read from the filesystem */
+    unsigned long evictions; /**< entries dropped to make room */
+    size_t entries; /**< entries currently cached */
+    size_t bytes; /**< memory used by the current entries */
+} cwhttpd_fs_cache_stats_t;
+
+/**
+ * \brief Get the file content cache counters of an instance
+ *
+ * \par Description
+ * \verbatim embed:rst:leading-asterisk
+ *
+ * :cpp:func:`cwhttpd_route_fs_get()` keeps the contents of small files in a
+ * size bounded cache along with their response headers, so that repeated
+ * requests are answered from memory with a single write. Entries are keyed
+ * by filesystem path and dropped when the modification time, size or inode
+ * of the file changes. The least recently used entries are evicted first.
+ *
+ * The cache is sized with ``CONFIG_CWHTTPD_FS_CACHE_SIZE``. All counters are
+ * zero if it is disabled.
+ *
+ * \endverbatim */
+void cwhttpd_fs_cache_get_stats(
+    cwhttpd_inst_t *inst, /** [in] httpd instance */
+    cwhttpd_fs_cache_stats_t *stats /** [out] counters */
+);
+
+/**
+ * \brief Drop all entries from the file content cache of an instance
+ */
+void cwhttpd_fs_cache_flush(
+    cwhttpd_inst_t *inst /** [in] httpd instance */
+);
+
+
+/**************************
+ * \section Bundle Routes
+ **************************/
+
+/**
+ * \brief One encoding of a bundled file
+ */
+typedef struct cwhttpd_bundle_variant_t {
+    const char *etag; /**< quoted entity tag */
+    const char *headers; /**< ETag, Cache-Control and Vary lines, followed
+                              by Content-Type and Content-Encoding */
+    uint16_t headers_len; /**< length of headers */
+    uint16_t cond_len; /**< length of the lines a 304 response repeats */
+    uint8_t encoding; /**< \a cwhttpd_encoding_t of body */
+    const uint8_t *body; /**< content */
+    uint32_t body_len; /**< length of body */
+} cwhttpd_bundle_variant_t;
+
+/**
+ * \brief A path in a bundle
+ */
+typedef struct cwhttpd_bundle_file_t {
+    const char *path; /**< path below the bundle root without a leading '/',
+                           NULL if the slot is empty */
+    uint16_t path_len; /**< length of path */
+    uint8_t encodings; /**< mask of the encodings of the variants */
+    uint8_t num_variants; /**< number of variants */
+    const cwhttpd_bundle_variant_t *variants; /**< variants, identity
+                                                   first */
+} cwhttpd_bundle_file_t;
+
+/**
+ * \brief A directory tree compiled at build time
+ *
+ * \par Description
+ * \verbatim embed:rst:leading-asterisk
+ *
+ * Bundles are generated by ``tools/bundle.py``, usually through the
+ * ``target_add_bundle()`` cmake function, and live in read-only memory.
+ * Paths are found through a perfect hash of the same kind as the one of
+ * :cpp:type:`cwhttpd_static_routes_t`.
+ *
+ * \endverbatim */
+typedef struct cwhttpd_bundle_t {
+    const uint16_t *seeds; /**< hash seed of every bucket */
+    uint16_t num_buckets; /**< number of buckets */
+    const cwhttpd_bundle_file_t *files; /**< files by hash slot */
+    uint16_t num_slots; /**< number of hash slots */
+} cwhttpd_bundle_t;
+
+/**
+ * \brief Bundle GET route handler
+ *
+ * \par Description
+ * \verbatim embed:rst:leading-asterisk
+ *
+ * The **arg** is expected to be a :cpp:type:`cwhttpd_bundle_t`. The part of
+ * the request path matched by a trailing ``*`` of the route is looked up in
+ * the bundle, and directories map to their ``index.html``. Paths that are
+ * not in the bundle fall through to the next route handler.
+ *
+ * Every response is a single write of prebuilt headers and content, without
+ * any filesystem access. Files that were stored with gzip or brotli variants
+ * are sent in the encoding the ``Accept-Encoding`` header of the request
+ * prefers, see :cpp:func:`cwhttpd_negotiate_encoding()`, and carry
+ * ``Vary: Accept-Encoding``. Each variant has its own ``ETag``, made from a
+ * hash of its content, and a matching ``If-None-Match`` header is answered
+ * with **304 Not Modified**. Ranges are not supported.
+ *
+ * Generate a bundle from a directory with::
+ *
+ *     target_add_bundle(app www GZIP BROTLI)
+ *
+ * and route to it with::
+ *
+ *     extern const cwhttpd_bundle_t www;
+ *     cwhttpd_route_append(inst, "*", cwhttpd_route_bundle, 1, &www);
+ *
+ * \endverbatim */
+cwhttpd_status_t cwhttpd_route_bundle(cwhttpd_conn_t *conn);
+
+/****************************
+ * \section Template Routes
+ ****************************/
+
+/**
+ * \brief Literal text or token of a template
+ */
+typedef struct cwhttpd_tpl_segment_t {
+    const char *text; /**< literal text or token name */
+    uint32_t len; /**< length of text */
+    bool token; /**< text is a token name */
+} cwhttpd_tpl_segment_t;
+
+/**
+ * \brief A template compiled at build time
+ *
+ * \par Description
+ * \verbatim embed:rst:leading-asterisk
+ *
+ * Templates are generated from ``.tpl`` files by ``tools/tpl2c.py``, usually
+ * through the ``target_add_template()`` cmake function. ``%%`` escapes are
+ * resolved and adjacent text merged at build time, so the segments
+ * alternate between literals and tokens.
+ *
+ * \endverbatim */
+typedef struct cwhttpd_tpl_t {
+    const char *mimetype; /**< Content-Type of the rendered template */
+    const cwhttpd_tpl_segment_t *segments; /**< segments in output order */
+    uint32_t num_segments; /**< number of segments */
+} cwhttpd_tpl_t;
+
+/**
+ * \brief Compiled template route handler
+ *
+ * \par Description
+ * \verbatim embed:rst:leading-asterisk
+ *
+ * The **arg** is expected to be a :cpp:type:`cwhttpd_tpl_t` and **arg2** a
+ * :cpp:type:`cwhttpd_tpl_cb_t`, which is called for every token as with
+ * :cpp:func:`cwhttpd_route_fs_tpl()`. Rendering needs no filesystem access
+ * and no scanning, and the response is buffered like the one of
+ * :cpp:func:`cwhttpd_route_fs_tpl()`.
+ *
+ * Compile a template with::
+ *
+ *     target_add_template(app status.tpl)
+ *
+ * and route to it with::
+ *
+ *     extern const cwhttpd_tpl_t status_tpl;
+ *     cwhttpd_route_append(inst, "/status", cwhttpd_route_tpl, 2,
+ *             &status_tpl, status_cb);
+ *
+ * \endverbatim */
+cwhttpd_status_t cwhttpd_route_tpl(cwhttpd_conn_t *conn);
+
+#if defined(CONFIG_CWHTTPD_FROGFS)
+/**************************
+ * \section FrogFS Routes
+ **************************/
+
+/**
+ * \brief A FrogFS image mapped from a file
+ */
+typedef struct cwhttpd_frogfs_image_t {
+    frogfs_fs_t *fs; /**< filesystem, NULL if not loaded */
+    const void *addr; /**< start of the mapping */
+    size_t len; /**< length of the mapping */
+} cwhttpd_frogfs_image_t;
+
+# if !defined(ESP_PLATFORM)
+/**
+ * \brief Map a FrogFS image file read-only
+ *
+ * \par Description
+ * \verbatim embed:rst:leading-asterisk
+ *
+ * The filesystem in **image** can be assigned to the ``frogfs`` field of
+ * an instance for :cpp:func:`cwhttpd_route_frogfs_get()`. The image file
+ * must not be modified while it is mapped.
+ *
+ * \endverbatim
+ *
+ * \return true on success
+ */
+bool cwhttpd_frogfs_image_load(
+    cwhttpd_frogfs_image_t *image, /** [out] loaded image */
+    const char *path /** [in] path of the image file */
+);
+
+/**
+ * \brief Release a FrogFS image mapped with cwhttpd_frogfs_image_load()
+ */
+void cwhttpd_frogfs_image_unload(
+    cwhttpd_frogfs_image_t *image /** [in] image */
+);
+# endif /* !defined(ESP_PLATFORM) */
+
+/**
+ * \brief FrogFS GET route handler
+ *
+ * \par Description
+ * \verbatim embed:rst:leading-asterisk
+ *
+ * This handler serves files straight from the FrogFS image of the instance,
+ * looked up through the hash table of the image, without going through a
+ * VFS. The **arg** is an optional path prefix inside the image. The part of
+ * the request path matched by a trailing ``*`` of the route is appended to
+ * it, and directories map to their ``index.html``. Paths that are not in
+ * the image fall through to the next route handler.
+ *
+ * Entries stored deflate compressed are sent as they are stored, with
+ * ``Content-Encoding: deflate``, to clients whose ``Accept-Encoding`` header
+ * allows it, and inflated for all others. Their responses carry
+ * ``Vary: Accept-Encoding``. Stored content is written from the image in a
+ * single write. The ``ETag`` is a hash of the stored bytes, computed the
+ * first time an entry is served and kept until the image is released with
+ * :cpp:func:`cwhttpd_frogfs_image_unload()`, and a matching
+ * ``If-None-Match`` header is answered with **304 Not Modified**.
+ *
+ * \endverbatim */
+cwhttpd_status_t cwhttpd_route_frogfs_get(cwhttpd_conn_t *conn);
+#endif /* defined(CONFIG_CWHTTPD_FROGFS) */
+
+
 /****************************
  * \section Redirect Routes
  ****************************/
@@ -202,6 +508,100 @@ cwhttpd_status_t cwhttpd_route_redirect(cwhttpd_conn_t *conn);
  * \endverbatim */
 cwhttpd_status_t cwhttpd_route_redirect_hostname(cwhttpd_conn_t *conn);
 
+/**
+ * \brief Opaque redirect map
+ */
+typedef struct cwhttpd_redirect_map_t cwhttpd_redirect_map_t;
+
+/**
+ * \brief Create an empty redirect map
+ *
+ * \return redirect map or NULL on error
+ */
+cwhttpd_redirect_map_t *cwhttpd_redirect_map_create(void);
+
+/**
+ * \brief Load a redirect map from a file
+ *
+ * \par Description
+ * \verbatim embed:rst:leading-asterisk
+ *
+ * Every line of the file is a rule of the form ``[CODE] FROM TO``. CODE is
+ * one of 301, 302, 303, 307 or 308, or ``rewrite``, and defaults to 301.
+ * Text after ``#`` is ignored. Example::
+ *
+ *     /old/page.html  /new/page
+ *     302 /promo      https://example.com/sale
+ *     /blog*          /news*
+ *     rewrite /app*   /app.html
+ *
+ * \endverbatim
+ *
+ * \return redirect map or NULL on error
+ */
+cwhttpd_redirect_map_t *cwhttpd_redirect_map_load(
+    const char *path /** [in] path of the map file */
+);
+
+/**
+ * \brief Add a rule to a redirect map
+ *
+ * \par Description
+ * \verbatim embed:rst:leading-asterisk
+ *
+ * A **from** path ending with ``*`` is a prefix rule, other rules match the
+ * request path exactly. Exact rules take precedence, and of the prefix rules
+ * the longest matching one wins. If **to** ends with ``*`` as well, the rest
+ * of the request path after the prefix is appended to it. The query string
+ * of the request is carried over to redirects.
+ *
+ * A **code** of 0 rewrites the request path to **to** instead of
+ * redirecting, and routing continues with the next route. Rewrite targets
+ * cannot contain a query string.
+ *
+ * Rules must be added before the map is used by a route.
+ *
+ * \endverbatim
+ *
+ * \return true on success
+ */
+bool cwhttpd_redirect_map_add(
+    cwhttpd_redirect_map_t *map, /** [in] redirect map */
+    int code, /** [in] redirect status code, or 0 to rewrite */
+    const char *from, /** [in] request path or prefix */
+    const char *to /** [in] redirect URL or rewritten path */
+);
+
+/**
+ * \brief Free a redirect map
+ */
+void cwhttpd_redirect_map_free(
+    cwhttpd_redirect_map_t *map /** [in] redirect map, can be NULL */
+);
+
+/**
+ * \brief Redirect or rewrite URLs through a redirect map
+ *
+ * \par Description
+ * \verbatim embed:rst:leading-asterisk
+ *
+ * The **arg** is a :c:type:`cwhttpd_redirect_map_t`. Exact rules are found
+ * through a hash table and prefix rules through a sorted list, so the cost
+ * of a lookup barely depends on the number of rules. The header of a
+ * redirect to a fixed URL is built when the rule is added, and the whole
+ * response is sent with a single write.
+ *
+ * Requests without a matching rule fall through to the next route, as do
+ * rewritten ones, so place this route before the routes it rewrites to.
+ *
+ * Example::
+ *
+ *     cwhttpd_redirect_map_t *map = cwhttpd_redirect_map_load("/redirects");
+ *     cwhttpd_route_insert(inst, 0, "*", cwhttpd_route_redirect_map, 1, map);
+ *
+ * \endverbatim */
+cwhttpd_status_t cwhttpd_route_redirect_map(cwhttpd_conn_t *conn);
+
 
 /************************
  * \section Auth Routes
@@ -0,0 +1,157 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "compress.h"
+#include "log.h"
+#include "cwhttpd/httpd.h"
+#include "cwhttpd/port.h"
+
+#if CONFIG_CWHTTPD_GZIP
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+
+/* Only one response per worker can be compressing at a time, so a pool that
+ * keeps that many contexts never has to allocate once warm */
+struct cwhttpd_compress_pool_t {
+    cwhttpd_mutex_t *mutex;
+    compress_ctx_t *free; /**< idle contexts */
+    size_t num_free;
+};
+
+
+static bool ctx_init(compress_ctx_t *ctx, cwhttpd_encoding_t encoding)
+{
+    /* 16 added to the window bits selects the gzip wrapper */
+    int window_bits = encoding == CWHTTPD_ENCODING_GZIP ? 15 + 16 : 15;
+    int ret = deflateInit2(&ctx->zs, CONFIG_CWHTTPD_GZIP_LEVEL, Z_DEFLATED,
+            window_bits, 8, Z_DEFAULT_STRATEGY);
+    if (ret != Z_OK) {
+        LOGE(__func__, "deflateInit2 %d", ret);
+        return false;
+    }
+    ctx->encoding = encoding;
+    return true;
+}
+
+cwhttpd_compress_pool_t *compress_pool_create(void)
+{
+    cwhttpd_compress_pool_t *pool = calloc(1,
+            sizeof(cwhttpd_compress_pool_t));
+    if (pool == NULL) {
+        LOGE(__func__, "calloc failed");
+        return NULL;
+    }
+
+    pool->mutex = cwhttpd_mutex_create(false);
+    if (pool->mutex == NULL) {
+        LOGE(__func__, "cwhttpd_mutex_create failed");
+        free(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+void compress_pool_destroy(cwhttpd_compress_pool_t *pool)
+{
+    if (pool == NULL) {
+        return;
+    }
+
+    while (pool->free != NULL) {
+        compress_ctx_t *ctx = pool->free;
+        pool->free = ctx->next;
+        deflateEnd(&ctx->zs);
+        free(ctx);
+    }
+    cwhttpd_mutex_delete(pool->mutex);
+    free(pool);
+}
+
+compress_ctx_t *compress_acquire(cwhttpd_compress_pool_t *pool,
+        cwhttpd_encoding_t encoding)
+{
+    cwhttpd_mutex_lock(pool->mutex);
+    compress_ctx_t *ctx = pool->free;
+    if (ctx != NULL) {
+        pool->free = ctx->next;
+        pool->num_free--;
+    }
+    cwhttpd_mutex_unlock(pool->mutex);
+
+    if (ctx == NULL) {
+        ctx = malloc(sizeof(compress_ctx_t));
+        if (ctx == NULL) {
+            LOGE(__func__, "malloc failed");
+            return NULL;
+        }
+        memset(&ctx->zs, 0, sizeof(ctx->zs));
+        if (!ctx_init(ctx, encoding)) {
+            free(ctx);
+            return NULL;
+        }
+    } else if (ctx->encoding != encoding) {
+        /* the wrapper can only be chosen at init */
+        deflateEnd(&ctx->zs);
+        if (!ctx_init(ctx, encoding)) {
+            free(ctx);
+            return NULL;
+        }
+    } else {
+        deflateReset(&ctx->zs);
+    }
+    ctx->pending_len = 0;
+
+    return ctx;
+}
+
+void compress_release(cwhttpd_compress_pool_t *pool, compress_ctx_t *ctx)
+{
+    cwhttpd_mutex_lock(pool->mutex);
+    if (pool->num_free < CONFIG_CWHTTPD_WORKER_COUNT) {
+        ctx->next = pool->free;
+        pool->free = ctx;
+        pool->num_free++;
+        ctx = NULL;
+    }
+    cwhttpd_mutex_unlock(pool->mutex);
+
+    if (ctx != NULL) {
+        deflateEnd(&ctx->zs);
+        free(ctx);
+    }
+}
+
+bool compress_write(compress_ctx_t *ctx, const void *buf, size_t len,
+        int flush, compress_out_cb_t cb, void *arg)
+{
+    ctx->zs.next_in = (Bytef *) buf;
+    ctx->zs.avail_in = len;
+
+    while (true) {
+        ctx->zs.next_out = ctx->out;
+        ctx->zs.avail_out = sizeof(ctx->out);
+        int ret = deflate(&ctx->zs, flush);
+        if (ret == Z_STREAM_ERROR) {
+            LOGE(__func__, "deflate %d", ret);
+            return false;
+        }
+        size_t n = sizeof(ctx->out) - ctx->zs.avail_out;
+        if (n > 0 && !cb(arg, ctx->out, n)) {
+            return false;
+        }
+        /* a repeated sync flush has nothing to do and fails with
+         * Z_BUF_ERROR, leaving the output empty */
+        if (flush == Z_FINISH ? ret == Z_STREAM_END :
+                ctx->zs.avail_out != 0) {
+            return true;
+        }
+    }
+}
+
+#endif /* CONFIG_CWHTTPD_GZIP */
@@ -0,0 +1,93 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include "cwhttpd/httpd.h"
+
+#if CONFIG_CWHTTPD_GZIP
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <zlib.h>
+
+
+/* Bytes of compressed output sent per chunk at most */
+#define COMPRESS_OUT_LEN (2048)
+
+typedef struct compress_ctx_t compress_ctx_t;
+
+/**
+ * \brief Compression state of a response
+ */
+struct compress_ctx_t {
+    z_stream zs; /**< zlib stream */
+    compress_ctx_t *next; /**< next free context in the pool */
+    cwhttpd_encoding_t encoding; /**< CWHTTPD_ENCODING_GZIP or _DEFLATE */
+    size_t pending_len; /**< length of pending */
+    uint8_t pending[CONFIG_CWHTTPD_GZIP_MIN_SIZE]; /**< body held back until
+            it is known to be worth compressing */
+    uint8_t out[COMPRESS_OUT_LEN]; /**< compressed output */
+};
+
+/**
+ * \brief Compressed output callback
+ *
+ * \return false to abort
+ */
+typedef bool (*compress_out_cb_t)(
+    void *arg, /** [in] user argument */
+    const void *data, /** [in] compressed data */
+    size_t len /** [in] length of data */
+);
+
+/**
+ * \brief Create a pool of compression contexts
+ *
+ * \return pool or NULL on error
+ */
+cwhttpd_compress_pool_t *compress_pool_create(void);
+
+/**
+ * \brief Free a pool and all idle contexts in it
+ */
+void compress_pool_destroy(
+    cwhttpd_compress_pool_t *pool /** [in] pool, can be NULL */
+);
+
+/**
+ * \brief Take a reset context from the pool, or make a new one
+ *
+ * \return context or NULL on error
+ */
+compress_ctx_t *compress_acquire(
+    cwhttpd_compress_pool_t *pool, /** [in] pool */
+    cwhttpd_encoding_t encoding /** [in] CWHTTPD_ENCODING_GZIP or _DEFLATE */
+);
+
+/**
+ * \brief Return a context to the pool
+ */
+void compress_release(
+    cwhttpd_compress_pool_t *pool, /** [in] pool */
+    compress_ctx_t *ctx /** [in] context */
+);
+
+/**
+ * \brief Compress data, passing output to a callback as it fills
+ *
+ * \return false on error
+ */
+bool compress_write(
+    compress_ctx_t *ctx, /** [in] context */
+    const void *buf, /** [in] data */
+    size_t len, /** [in] length of data */
+    int flush, /** [in] Z_NO_FLUSH, Z_SYNC_FLUSH to push out everything so
+                        far, or Z_FINISH to end the stream */
+    compress_out_cb_t cb, /** [in] output callback */
+    void *arg /** [in] callback argument */
+);
+
+#endif /* CONFIG_CWHTTPD_GZIP */
@@ -0,0 +1,330 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "fs_cache.h"
+#include "kref.h"
+#include "log.h"
+#include "cwhttpd/httpd.h"
+#include "cwhttpd/port.h"
+#include "cwhttpd/route.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+
+/* Hash chains per shard */
+#define FS_CACHE_BUCKETS 64
+
+typedef struct fs_cache_shard_t fs_cache_shard_t;
+
+struct fs_cache_shard_t {
+    cwhttpd_mutex_t *mutex;
+    fs_cache_entry_t *buckets[FS_CACHE_BUCKETS];
+    fs_cache_entry_t lru; /**< list head, lru.lru_next is the most recent */
+    size_t entries;
+    size_t bytes;
+};
+
+struct cwhttpd_fs_cache_t {
+    size_t shard_size; /**< bytes per shard */
+    size_t max_file;
+    atomic_ulong hits;
+    atomic_ulong misses;
+    atomic_ulong evictions;
+    fs_cache_shard_t shards[CONFIG_CWHTTPD_FS_CACHE_SHARDS];
+};
+
+
+static uint32_t path_hash(const char *path)
+{
+    uint32_t hash = 2166136261;
+    while (*path) {
+        hash ^= (uint8_t) *path++;
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+static inline fs_cache_shard_t *get_shard(cwhttpd_fs_cache_t *cache,
+        uint32_t hash)
+{
+    /* the low bits select the bucket */
+    return &cache->shards[(hash >> 16) % CONFIG_CWHTTPD_FS_CACHE_SHARDS];
+}
+
+static void entry_release(struct kref *ref)
+{
+    free(kcontainer_of(ref, fs_cache_entry_t, ref));
+}
+
+/* Both unlink functions expect the shard to be locked, the cache reference
+ * is dropped by the caller */
+static void lru_unlink(fs_cache_entry_t *entry)
+{
+    entry->lru_prev->lru_next = entry->lru_next;
+    entry->lru_next->lru_prev = entry->lru_prev;
+}
+
+static void lru_push(fs_cache_shard_t *shard, fs_cache_entry_t *entry)
+{
+    entry->lru_prev = &shard->lru;
+    entry->lru_next = shard->lru.lru_next;
+    shard->lru.lru_next->lru_prev = entry;
+    shard->lru.lru_next = entry;
+}
+
+static void shard_unlink(fs_cache_shard_t *shard, fs_cache_entry_t *entry)
+{
+    fs_cache_entry_t **p = &shard->buckets[entry->hash % FS_CACHE_BUCKETS];
+    while (*p != entry) {
+        p = &(*p)->next;
+    }
+    *p = entry->next;
+    lru_unlink(entry);
+    shard->entries--;
+    shard->bytes -= entry->charge;
+}
+
+static fs_cache_entry_t *shard_find(fs_cache_shard_t *shard, uint32_t hash,
+        const char *path)
+{
+    fs_cache_entry_t *entry = shard->buckets[hash % FS_CACHE_BUCKETS];
+    while (entry != NULL) {
+        if (entry->hash == hash && strcmp(entry->path, path) == 0) {
+            return entry;
+        }
+        entry = entry->next;
+    }
+    return NULL;
+}
+
+static void shard_flush(fs_cache_shard_t *shard)
+{
+    while (shard->lru.lru_prev != &shard->lru) {
+        fs_cache_entry_t *entry = shard->lru.lru_prev;
+        shard_unlink(shard, entry);
+        kref_put(&entry->ref, entry_release);
+    }
+}
+
+cwhttpd_fs_cache_t *fs_cache_create(size_t size, size_t max_file)
+{
+    cwhttpd_fs_cache_t *cache = calloc(1, sizeof(cwhttpd_fs_cache_t));
+    if (cache == NULL) {
+        LOGE(__func__, "calloc failed");
+        return NULL;
+    }
+
+    cache->shard_size = size / CONFIG_CWHTTPD_FS_CACHE_SHARDS;
+    cache->max_file = max_file;
+    atomic_init(&cache->hits, 0);
+    atomic_init(&cache->misses, 0);
+    atomic_init(&cache->evictions, 0);
+
+    for (int i = 0; i < CONFIG_CWHTTPD_FS_CACHE_SHARDS; i++) {
+        fs_cache_shard_t *shard = &cache->shards[i];
+        shard->lru.lru_prev = &shard->lru;
+        shard->lru.lru_next = &shard->lru;
+        shard->mutex = cwhttpd_mutex_create(false);
+        if (shard->mutex == NULL) {
+            LOGE(__func__, "cwhttpd_mutex_create failed");
+            fs_cache_destroy(cache);
+            return NULL;
+        }
+    }
+
+    return cache;
+}
+
+void fs_cache_destroy(cwhttpd_fs_cache_t *cache)
+{
+    if (cache == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < CONFIG_CWHTTPD_FS_CACHE_SHARDS; i++) {
+        fs_cache_shard_t *shard = &cache->shards[i];
+        if (shard->mutex != NULL) {
+            shard_flush(shard);
+            cwhttpd_mutex_delete(shard->mutex);
+        }
+    }
+    free(cache);
+}
+
+fs_cache_entry_t *fs_cache_lookup(cwhttpd_fs_cache_t *cache,
+        const char *path, const struct stat *st)
+{
+    if (cache == NULL || st->st_size > cache->max_file) {
+        return NULL;
+    }
+
+    uint32_t hash = path_hash(path);
+    fs_cache_shard_t *shard = get_shard(cache, hash);
+
+    cwhttpd_mutex_lock(shard->mutex);
+    fs_cache_entry_t *entry = shard_find(shard, hash, path);
+    if (entry != NULL) {
+        if (entry->mtime == st->st_mtime && entry->size == st->st_size &&
+                entry->ino == st->st_ino) {
+            kref_get(&entry->ref);
+            lru_unlink(entry);
+            lru_push(shard, entry);
+            cwhttpd_mutex_unlock(shard->mutex);
+            atomic_fetch_add(&cache->hits, 1);
+            return entry;
+        }
+        shard_unlink(shard, entry);
+        kref_put(&entry->ref, entry_release);
+    }
+    cwhttpd_mutex_unlock(shard->mutex);
+
+    atomic_fetch_add(&cache->misses, 1);
+    return NULL;
+}
+
+fs_cache_entry_t *fs_cache_entry_alloc(cwhttpd_fs_cache_t *cache,
+        const char *path, const struct stat *st, const char *etag,
+        const char *mimetype, const char *headers, size_t headers_len)
+{
+    if (cache == NULL || st->st_size > cache->max_file) {
+        return NULL;
+    }
+
+    size_t path_len = strlen(path);
+    size_t etag_len = strlen(etag);
+    size_t charge = sizeof(fs_cache_entry_t) + path_len + 1 + etag_len + 1 +
+            headers_len + st->st_size;
+    if (charge > cache->shard_size) {
+        return NULL;
+    }
+
+    fs_cache_entry_t *entry = malloc(charge);
+    if (entry == NULL) {
+        LOGE(__func__, "malloc failed");
+        return NULL;
+    }
+
+    kref_init(&entry->ref);
+    entry->hash = path_hash(path);
+    entry->mtime = st->st_mtime;
+    entry->size = st->st_size;
+    entry->ino = st->st_ino;
+    entry->charge = charge;
+
+    char *p = (char *) (entry + 1);
+    memcpy(p, path, path_len + 1);
+    entry->path = p;
+    p += path_len + 1;
+    memcpy(p, etag, etag_len + 1);
+    entry->etag = p;
+    p += etag_len + 1;
+    entry->mimetype = mimetype;
+    memcpy(p, headers, headers_len);
+    entry->headers = p;
+    entry->headers_len = headers_len;
+    p += headers_len;
+    entry->body = (uint8_t *) p;
+    entry->body_len = st->st_size;
+
+    return entry;
+}
+
+void fs_cache_insert(cwhttpd_fs_cache_t *cache, fs_cache_entry_t *entry)
+{
+    fs_cache_shard_t *shard = get_shard(cache, entry->hash);
+
+    cwhttpd_mutex_lock(shard->mutex);
+    fs_cache_entry_t *old = shard_find(shard, entry->hash, entry->path);
+    if (old != NULL) {
+        shard_unlink(shard, old);
+        kref_put(&old->ref, entry_release);
+    }
+
+    unsigned long evictions = 0;
+    while (shard->bytes + entry->charge > cache->shard_size) {
+        fs_cache_entry_t *victim = shard->lru.lru_prev;
+        shard_unlink(shard, victim);
+        kref_put(&victim->ref, entry_release);
+        evictions++;
+    }
+
+    kref_get(&entry->ref);
+    fs_cache_entry_t **bucket = &shard->buckets[entry->hash %
+            FS_CACHE_BUCKETS];
+    entry->next = *bucket;
+    *bucket = entry;
+    lru_push(shard, entry);
+    shard->entries++;
+    shard->bytes += entry->charge;
+    cwhttpd_mutex_unlock(shard->mutex);
+
+    if (evictions) {
+        atomic_fetch_add(&cache->evictions, evictions);
+    }
+}
+
+void fs_cache_invalidate(cwhttpd_fs_cache_t *cache, const char *path)
+{
+    if (cache == NULL) {
+        return;
+    }
+
+    uint32_t hash = path_hash(path);
+    fs_cache_shard_t *shard = get_shard(cache, hash);
+
+    cwhttpd_mutex_lock(shard->mutex);
+    fs_cache_entry_t *entry = shard_find(shard, hash, path);
+    if (entry != NULL) {
+        shard_unlink(shard, entry);
+        kref_put(&entry->ref, entry_release);
+    }
+    cwhttpd_mutex_unlock(shard->mutex);
+}
+
+void fs_cache_entry_put(fs_cache_entry_t *entry)
+{
+    kref_put(&entry->ref, entry_release);
+}
+
+void cwhttpd_fs_cache_get_stats(cwhttpd_inst_t *inst,
+        cwhttpd_fs_cache_stats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+
+    cwhttpd_fs_cache_t *cache = inst->fs_cache;
+    if (cache == NULL) {
+        return;
+    }
+
+    stats->hits = atomic_load(&cache->hits);
+    stats->misses = atomic_load(&cache->misses);
+    stats->evictions = atomic_load(&cache->evictions);
+    for (int i = 0; i < CONFIG_CWHTTPD_FS_CACHE_SHARDS; i++) {
+        fs_cache_shard_t *shard = &cache->shards[i];
+        cwhttpd_mutex_lock(shard->mutex);
+        stats->entries += shard->entries;
+        stats->bytes += shard->bytes;
+        cwhttpd_mutex_unlock(shard->mutex);
+    }
+}
+
+void cwhttpd_fs_cache_flush(cwhttpd_inst_t *inst)
+{
+    cwhttpd_fs_cache_t *cache = inst->fs_cache;
+    if (cache == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < CONFIG_CWHTTPD_FS_CACHE_SHARDS; i++) {
+        fs_cache_shard_t *shard = &cache->shards[i];
+        cwhttpd_mutex_lock(shard->mutex);
+        shard_flush(shard);
+        cwhttpd_mutex_unlock(shard->mutex);
+    }
+}
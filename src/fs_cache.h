@@ -0,0 +1,115 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include "kref.h"
+#include "cwhttpd/httpd.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+
+typedef struct fs_cache_entry_t fs_cache_entry_t;
+
+/**
+ * \brief A cached file with its response headers
+ *
+ * Entries are reference counted so a connection can keep sending one after
+ * it has been evicted. Everything but the body is immutable once inserted.
+ */
+struct fs_cache_entry_t {
+    struct kref ref; /**< reference count */
+    fs_cache_entry_t *next; /**< next entry in the hash chain */
+    fs_cache_entry_t *lru_prev; /**< more recently used entry */
+    fs_cache_entry_t *lru_next; /**< less recently used entry */
+    uint32_t hash; /**< hash of path */
+    time_t mtime; /**< modification time of the file */
+    off_t size; /**< size of the file */
+    ino_t ino; /**< inode of the file */
+    size_t charge; /**< bytes accounted to the cache */
+    const char *path; /**< filesystem path */
+    const char *etag; /**< entity tag of the content */
+    const char *mimetype; /**< type the headers were built with */
+    const char *headers; /**< response header lines */
+    size_t headers_len; /**< length of headers */
+    uint8_t *body; /**< file content */
+    size_t body_len; /**< length of body */
+};
+
+/**
+ * \brief Create a file content cache
+ *
+ * \return cache or NULL on error
+ */
+cwhttpd_fs_cache_t *fs_cache_create(
+    size_t size, /** [in] total bytes to keep */
+    size_t max_file /** [in] largest file to keep */
+);
+
+/**
+ * \brief Free a file content cache
+ *
+ * Entries still referenced by connections are freed when they are put.
+ */
+void fs_cache_destroy(
+    cwhttpd_fs_cache_t *cache /** [in] cache, can be NULL */
+);
+
+/**
+ * \brief Look up a file, validated against a fresh stat
+ *
+ * A stale entry is dropped. Misses are only counted for files that could be
+ * cached.
+ *
+ * \return referenced entry or NULL on a miss
+ */
+fs_cache_entry_t *fs_cache_lookup(
+    cwhttpd_fs_cache_t *cache, /** [in] cache, can be NULL */
+    const char *path, /** [in] filesystem path */
+    const struct stat *st /** [in] current stat of path */
+);
+
+/**
+ * \brief Allocate an entry for a file, to be filled in and inserted
+ *
+ * \return entry with body_len bytes of uninitialized body, or NULL if the
+ *         file is too large or on error
+ */
+fs_cache_entry_t *fs_cache_entry_alloc(
+    cwhttpd_fs_cache_t *cache, /** [in] cache, can be NULL */
+    const char *path, /** [in] filesystem path */
+    const struct stat *st, /** [in] stat of path */
+    const char *etag, /** [in] entity tag of the content */
+    const char *mimetype, /** [in] type from cwhttpd_get_mimetype() */
+    const char *headers, /** [in] response header lines */
+    size_t headers_len /** [in] length of headers */
+);
+
+/**
+ * \brief Insert a filled in entry, replacing any entry of the same path
+ *
+ * The caller keeps its reference.
+ */
+void fs_cache_insert(
+    cwhttpd_fs_cache_t *cache, /** [in] cache */
+    fs_cache_entry_t *entry /** [in] entry from fs_cache_entry_alloc() */
+);
+
+/**
+ * \brief Drop the entry of a path
+ */
+void fs_cache_invalidate(
+    cwhttpd_fs_cache_t *cache, /** [in] cache, can be NULL */
+    const char *path /** [in] filesystem path */
+);
+
+/**
+ * \brief Drop a reference to an entry
+ */
+void fs_cache_entry_put(
+    fs_cache_entry_t *entry /** [in] entry */
+);
@@ -0,0 +1,242 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "fs_cache.h"
+#include "fs_watch.h"
+#include "log.h"
+#include "stat_cache.h"
+#include "tpl_cache.h"
+#include "cwhttpd/httpd.h"
+#include "cwhttpd/port.h"
+#include "cwhttpd/route.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+
+#define WATCH_MASK (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | \
+        IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | \
+        IN_MOVE_SELF | IN_ONLYDIR)
+
+typedef struct watch_dir_t {
+    int wd;
+    char *path;
+} watch_dir_t;
+
+struct fs_watch_t {
+    cwhttpd_inst_t *inst;
+    int fd;
+    cwhttpd_mutex_t *mutex;
+    watch_dir_t dirs[CONFIG_CWHTTPD_FS_WATCH_MAX];
+    size_t num_dirs;
+};
+
+
+fs_watch_t *fs_watch_create(cwhttpd_inst_t *inst)
+{
+    fs_watch_t *watch = calloc(1, sizeof(fs_watch_t));
+    if (watch == NULL) {
+        LOGE(__func__, "calloc failed");
+        return NULL;
+    }
+    watch->inst = inst;
+
+    watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch->fd < 0) {
+        LOGE(__func__, "inotify_init1 %d", errno);
+        free(watch);
+        return NULL;
+    }
+
+    watch->mutex = cwhttpd_mutex_create(false);
+    if (watch->mutex == NULL) {
+        LOGE(__func__, "cwhttpd_mutex_create failed");
+        close(watch->fd);
+        free(watch);
+        return NULL;
+    }
+
+    return watch;
+}
+
+void fs_watch_destroy(fs_watch_t *watch)
+{
+    if (watch == NULL) {
+        return;
+    }
+
+    for (size_t i = 0; i < watch->num_dirs; i++) {
+        free(watch->dirs[i].path);
+    }
+    close(watch->fd);
+    cwhttpd_mutex_delete(watch->mutex);
+    free(watch);
+}
+
+int fs_watch_fd(fs_watch_t *watch)
+{
+    return watch->fd;
+}
+
+bool fs_watch_dir(fs_watch_t *watch, const char *path)
+{
+    if (watch == NULL) {
+        return false;
+    }
+
+    char dir[PATH_MAX];
+    const char *slash = strrchr(path, '/');
+    if (slash == NULL) {
+        strcpy(dir, ".");
+    } else if (slash == path) {
+        strcpy(dir, "/");
+    } else if (slash - path < sizeof(dir)) {
+        memcpy(dir, path, slash - path);
+        dir[slash - path] = '\0';
+    } else {
+        return false;
+    }
+
+    bool watched = false;
+    cwhttpd_mutex_lock(watch->mutex);
+    for (size_t i = 0; i < watch->num_dirs; i++) {
+        if (strcmp(watch->dirs[i].path, dir) == 0) {
+            watched = true;
+            goto done;
+        }
+    }
+
+    if (watch->num_dirs == CONFIG_CWHTTPD_FS_WATCH_MAX) {
+        goto done;
+    }
+
+    int wd = inotify_add_watch(watch->fd, dir, WATCH_MASK);
+    if (wd < 0) {
+        if (errno == ENOSPC) {
+            LOGW(__func__, "inotify watch limit reached");
+        }
+        goto done;
+    }
+    for (size_t i = 0; i < watch->num_dirs; i++) {
+        if (watch->dirs[i].wd == wd) {
+            /* another name for a watched directory, events only carry the
+             * first one */
+            goto done;
+        }
+    }
+
+    char *dup = strdup(dir);
+    if (dup == NULL) {
+        inotify_rm_watch(watch->fd, wd);
+        goto done;
+    }
+    watch->dirs[watch->num_dirs].wd = wd;
+    watch->dirs[watch->num_dirs].path = dup;
+    watch->num_dirs++;
+    watched = true;
+
+done:
+    cwhttpd_mutex_unlock(watch->mutex);
+    return watched;
+}
+
+static void invalidate(fs_watch_t *watch, const char *path)
+{
+    stat_cache_invalidate(watch->inst->stat_cache, path);
+    fs_cache_invalidate(watch->inst->fs_cache, path);
+    tpl_cache_invalidate(watch->inst->tpl_cache, path);
+}
+
+/* Directories that went away take all paths below them along */
+static void invalidate_all(fs_watch_t *watch)
+{
+    stat_cache_flush(watch->inst->stat_cache);
+    cwhttpd_fs_cache_flush(watch->inst);
+    tpl_cache_flush(watch->inst->tpl_cache);
+}
+
+static void remove_dir(fs_watch_t *watch, int wd)
+{
+    cwhttpd_mutex_lock(watch->mutex);
+    for (size_t i = 0; i < watch->num_dirs; i++) {
+        if (watch->dirs[i].wd == wd) {
+            free(watch->dirs[i].path);
+            watch->dirs[i] = watch->dirs[--watch->num_dirs];
+            break;
+        }
+    }
+    cwhttpd_mutex_unlock(watch->mutex);
+}
+
+static void handle_event(fs_watch_t *watch, const struct inotify_event *ev)
+{
+    if (ev->mask & IN_Q_OVERFLOW) {
+        LOGW(__func__, "inotify queue overflow");
+        invalidate_all(watch);
+        return;
+    }
+
+    if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+        if (ev->mask & IN_MOVE_SELF) {
+            /* the old name may be reused by an unrelated directory */
+            inotify_rm_watch(watch->fd, ev->wd);
+        }
+        remove_dir(watch, ev->wd);
+        invalidate_all(watch);
+        return;
+    }
+
+    /* Rebuild the path the way it was looked up */
+    char path[PATH_MAX];
+    bool found = false;
+    cwhttpd_mutex_lock(watch->mutex);
+    for (size_t i = 0; i < watch->num_dirs; i++) {
+        if (watch->dirs[i].wd == ev->wd) {
+            const char *dir = watch->dirs[i].path;
+            size_t len;
+            if (ev->len == 0) {
+                len = cwhttpd_snprintf(path, sizeof(path), "%s", dir);
+            } else if (strcmp(dir, ".") == 0) {
+                len = cwhttpd_snprintf(path, sizeof(path), "%s", ev->name);
+            } else {
+                len = cwhttpd_snprintf(path, sizeof(path), "%s/%s",
+                        strcmp(dir, "/") == 0 ? "" : dir, ev->name);
+            }
+            found = len < sizeof(path);
+            break;
+        }
+    }
+    cwhttpd_mutex_unlock(watch->mutex);
+
+    if (found) {
+        invalidate(watch, path);
+    }
+}
+
+void fs_watch_process(fs_watch_t *watch)
+{
+    char buf[4096]
+            __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (true) {
+        ssize_t len = read(watch->fd, buf, sizeof(buf));
+        if (len <= 0) {
+            if (len < 0 && errno != EAGAIN && errno != EINTR) {
+                LOGE(__func__, "read %d", errno);
+            }
+            return;
+        }
+
+        for (char *p = buf; p < buf + len; ) {
+            const struct inotify_event *ev = (const struct inotify_event *) p;
+            handle_event(watch, ev);
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+}
@@ -0,0 +1,56 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include "cwhttpd/httpd.h"
+
+#include <stdbool.h>
+
+
+typedef struct fs_watch_t fs_watch_t;
+
+/**
+ * \brief Create an inotify watcher that invalidates the caches of an
+ *        instance
+ *
+ * \return watcher or NULL on error
+ */
+fs_watch_t *fs_watch_create(
+    cwhttpd_inst_t *inst /** [in] instance whose caches are invalidated */
+);
+
+/**
+ * \brief Free a watcher
+ */
+void fs_watch_destroy(
+    fs_watch_t *watch /** [in] watcher, can be NULL */
+);
+
+/**
+ * \brief Descriptor that becomes readable when events are pending
+ */
+int fs_watch_fd(
+    fs_watch_t *watch /** [in] watcher */
+);
+
+/**
+ * \brief Watch the directory that contains a path
+ *
+ * Must be called before the path is looked at, so that no change can slip
+ * in between.
+ *
+ * \return true if changes of path are reported
+ */
+bool fs_watch_dir(
+    fs_watch_t *watch, /** [in] watcher, can be NULL */
+    const char *path /** [in] filesystem path */
+);
+
+/**
+ * \brief Invalidate cache entries for all pending events, without blocking
+ */
+void fs_watch_process(
+    fs_watch_t *watch /** [in] watcher */
+);
@@ -7,16 +7,30 @@
 /* Copyright 2021 Jeff Kent <jeff@jkent.net> */
 
 #include "cb.h"
+#include "compress.h"
 #include "log.h"
+#include "router.h"
 #include "cwhttpd/httpd.h"
 #include "cwhttpd/httpd_priv.h"
 
 #include <assert.h>
+#include <ctype.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
+#include <time.h>
+
+#if defined(__SSE2__)
+# include <immintrin.h>
+#endif
+
+#if CONFIG_CWHTTPD_GZIP
+# include <sys/uio.h>
+# include <unistd.h>
+#endif
 
 
 #define MIN(a, b) ({ \
@@ -29,49 +43,112 @@
  * \section Instance Functions
  *******************************/
 
-void cwhttpd_route_vinsert(cwhttpd_inst_t *inst, ssize_t index, const char *path,
+void cwhttpd_vhost_route_vinsert(cwhttpd_inst_t *inst, const char *host,
+        ssize_t index, uint32_t methods, const char *path,
         cwhttpd_route_handler_t handler, size_t argc, va_list args)
 {
-    cwhttpd_route_t *new_route = calloc(1,
-            sizeof(cwhttpd_route_t) + (sizeof(void *) * argc));
+    cwhttpd_route_t *new_route = router_route_alloc(argc);
     if (new_route == NULL) {
         return;
     }
 
-    if (index < 0) {
-        index = inst->num_routes + index;
-        if (index >= inst->num_routes) {
-            index = 0;
-        }
-    } else if (index >= inst->num_routes) {
-        index = inst->num_routes;
-    }
-
-    if (inst->num_routes == 0) {
-        inst->route_head = new_route;
-        inst->route_tail = new_route;
-    } else if (index == 0) {
-        new_route->next = inst->route_head;
-        inst->route_head = new_route;
-    } else if (index == inst->num_routes) {
-        inst->route_tail->next = new_route;
-        inst->route_tail = new_route;
-    } else {
-        cwhttpd_route_t *route = inst->route_head;
-        for (int i = 0; i < index - 1; i++) {
-            route = route->next;
-        }
-        new_route->next = route->next;
-        route->next = new_route;
-    }
-
     new_route->path = path;
+    new_route->path_len = strlen(path);
+    new_route->methods = methods;
     new_route->handler = handler;
     new_route->argc = argc;
     for (int i = 0; i < argc; i++) {
         new_route->argv[i] = va_arg(args, void *);
     }
-    inst->num_routes++;
+
+    if (!router_insert(inst->router, host, index, new_route)) {
+        router_route_put(new_route);
+    }
+}
+
+void cwhttpd_vhost_route_insert(cwhttpd_inst_t *inst, const char *host,
+        ssize_t index, uint32_t methods, const char *path,
+        cwhttpd_route_handler_t handler, size_t argc, ...)
+{
+    va_list args;
+
+    va_start(args, argc);
+    cwhttpd_vhost_route_vinsert(inst, host, index, methods, path, handler,
+            argc, args);
+    va_end(args);
+}
+
+void cwhttpd_vhost_route_append(cwhttpd_inst_t *inst, const char *host,
+        uint32_t methods, const char *path, cwhttpd_route_handler_t handler,
+        size_t argc, ...)
+{
+    va_list args;
+
+    va_start(args, argc);
+    cwhttpd_vhost_route_vinsert(inst, host, SSIZE_MAX, methods, path,
+            handler, argc, args);
+    va_end(args);
+}
+
+cwhttpd_route_t *cwhttpd_vhost_route_get(cwhttpd_inst_t *inst,
+        const char *host, ssize_t index)
+{
+    return router_get(inst->router, host, index);
+}
+
+void cwhttpd_vhost_route_remove(cwhttpd_inst_t *inst, const char *host,
+        ssize_t index)
+{
+    router_remove(inst->router, host, index);
+}
+
+void cwhttpd_vhost_route_set_static(cwhttpd_inst_t *inst, const char *host,
+        const cwhttpd_static_routes_t *routes)
+{
+    router_set_static(inst->router, host, routes);
+}
+
+void cwhttpd_route_set_static(cwhttpd_inst_t *inst,
+        const cwhttpd_static_routes_t *routes)
+{
+    router_set_static(inst->router, NULL, routes);
+}
+
+void cwhttpd_route_vinsert_method(cwhttpd_inst_t *inst, ssize_t index,
+        uint32_t methods, const char *path, cwhttpd_route_handler_t handler,
+        size_t argc, va_list args)
+{
+    cwhttpd_vhost_route_vinsert(inst, NULL, index, methods, path, handler,
+            argc, args);
+}
+
+void cwhttpd_route_insert_method(cwhttpd_inst_t *inst, ssize_t index,
+        uint32_t methods, const char *path, cwhttpd_route_handler_t handler,
+        size_t argc, ...)
+{
+    va_list args;
+
+    va_start(args, argc);
+    cwhttpd_route_vinsert_method(inst, index, methods, path, handler, argc,
+            args);
+    va_end(args);
+}
+
+void cwhttpd_route_append_method(cwhttpd_inst_t *inst, uint32_t methods,
+        const char *path, cwhttpd_route_handler_t handler, size_t argc, ...)
+{
+    va_list args;
+
+    va_start(args, argc);
+    cwhttpd_route_vinsert_method(inst, SSIZE_MAX, methods, path, handler,
+            argc, args);
+    va_end(args);
+}
+
+void cwhttpd_route_vinsert(cwhttpd_inst_t *inst, ssize_t index, const char *path,
+        cwhttpd_route_handler_t handler, size_t argc, va_list args)
+{
+    cwhttpd_route_vinsert_method(inst, index, 0, path, handler, argc, args);
 }
 
 void cwhttpd_route_insert(cwhttpd_inst_t *inst, ssize_t index, const char *path,
@@ -90,83 +167,301 @@ void cwhttpd_route_append(cwhttpd_inst_t *inst, const char *path,
     va_list args;
 
     va_start(args, argc);
-    cwhttpd_route_vinsert(inst, inst->num_routes, path, handler, argc, args);
+    cwhttpd_route_vinsert(inst, SSIZE_MAX, path, handler, argc, args);
     va_end(args);
 }
 
 cwhttpd_route_t *cwhttpd_route_get(cwhttpd_inst_t *inst, ssize_t index)
 {
-    if (inst->num_routes == 0) {
-        return NULL;
-    } else if (index < 0) {
-        index = inst->num_routes + index;
-        if (index >= inst->num_routes) {
-            index = 0;
+    return router_get(inst->router, NULL, index);
+}
+
+void cwhttpd_route_remove(cwhttpd_inst_t *inst, ssize_t index)
+{
+    router_remove(inst->router, NULL, index);
+}
+
+
+/*********************************
+ * \section Connection Functions
+ *********************************/
+
+ssize_t cwhttpd_continue(cwhttpd_conn_t *conn)
+{
+    if (!(conn->priv.flags & HFL_EXPECT_CONTINUE)) {
+        return 0;
+    }
+    conn->priv.flags &= ~HFL_EXPECT_CONTINUE;
+
+    /* after a final response the client decides on its own */
+    if (conn->priv.flags & HFL_SENT_RESPONSE) {
+        return 0;
+    }
+    return cwhttpd_plat_send(conn, "HTTP/1.1 100 Continue\r\n\r\n", 25);
+}
+
+ssize_t cwhttpd_recv(cwhttpd_conn_t *conn, void *buf, size_t len)
+{
+    if (cwhttpd_continue(conn) < 0) {
+        return -1;
+    }
+
+    /* whatever came in with the request headers goes first */
+    size_t datalen = conn->priv.req + conn->priv.req_len - conn->priv.data;
+    if (datalen > 0) {
+        len = MIN(len, datalen);
+        memcpy(buf, conn->priv.data, len);
+        conn->priv.data += len;
+        return len;
+    }
+
+    if (conn->priv.recv_pos < conn->priv.recv_len) {
+        len = MIN(len, conn->priv.recv_len - conn->priv.recv_pos);
+        memcpy(buf, conn->priv.recv_buf + conn->priv.recv_pos, len);
+        conn->priv.recv_pos += len;
+        return len;
+    }
+
+    /* Reading ahead could consume the next request after a body, and large
+     * reads gain nothing from a copy */
+    if (conn->post != NULL || len >= CONFIG_CWHTTPD_RECV_BUFFER_SIZE) {
+        return cwhttpd_plat_recv(conn, buf, len);
+    }
+
+    if (conn->priv.recv_buf == NULL) {
+        conn->priv.recv_buf = malloc(CONFIG_CWHTTPD_RECV_BUFFER_SIZE);
+        if (conn->priv.recv_buf == NULL) {
+            LOGW(__func__, "malloc failed");
+            return cwhttpd_plat_recv(conn, buf, len);
         }
-    } else if (index >= inst->num_routes - 1) {
-        index = inst->num_routes - 1;
     }
 
-    cwhttpd_route_t *route = inst->route_head;
-    for (int i = 0; i < index - 1; i++) {
-        route = route->next;
+    ssize_t ret = cwhttpd_plat_recv(conn, conn->priv.recv_buf,
+            CONFIG_CWHTTPD_RECV_BUFFER_SIZE);
+    if (ret <= 0) {
+        return ret;
     }
-    return route;
+    len = MIN(len, (size_t) ret);
+    memcpy(buf, conn->priv.recv_buf, len);
+    conn->priv.recv_pos = len;
+    conn->priv.recv_len = ret;
+    return len;
 }
 
-void cwhttpd_route_remove(cwhttpd_inst_t *inst, ssize_t index)
+/* End headers if we're sending data */
+static void end_headers(cwhttpd_conn_t *conn)
 {
-    if (inst->num_routes == 0) {
+    if (conn->priv.flags & HFL_SENT_HEADERS) {
         return;
-    } else if (index < 0) {
-        index = inst->num_routes + index;
-        if (index >= inst->num_routes) {
-            index = 0;
+    }
+
+    if (conn->priv.flags & HFL_SEND_CHUNKED) {
+        cwhttpd_send_header(conn, "Transfer-Encoding", "chunked");
+    }
+    if (conn->priv.flags & HFL_REQUEST_CLOSE) {
+        cwhttpd_send_header(conn, "Connection", "close");
+    } else if (!(conn->priv.flags & HFL_SENT_CONTENT_LENGTH)) {
+        if (!(conn->priv.flags & HFL_SEND_CHUNKED)) {
+            if (conn->priv.flags & HFL_RECEIVED_HTTP11) {
+                cwhttpd_send_header(conn, "Connection", "close");
+            }
         }
-    } else if (index >= inst->num_routes - 1) {
-        index = inst->num_routes - 1;
+    } else if (conn->priv.flags & HFL_RECEIVED_CONN_ALIVE) {
+        cwhttpd_send_header(conn, "Connection", "keep-alive");
     }
+    cwhttpd_plat_send(conn, "\r\n", 2);
+    conn->priv.flags |= HFL_SENT_HEADERS;
+}
 
-    cwhttpd_route_t *route = inst->route_head;
-    if (index == 0) {
-        inst->route_head = route->next;
-        if (inst->num_routes == 2) {
-            inst->route_tail = route->next;
-        } else if (inst->num_routes == 1) {
-            inst->route_tail = NULL;
+#if CONFIG_CWHTTPD_GZIP
+/* Start compressing the response if nothing rules it out yet */
+static bool compress_begin(cwhttpd_conn_t *conn)
+{
+    if ((conn->priv.flags & (HFL_SEND_CHUNKED | HFL_COMPRESSIBLE)) !=
+            (HFL_SEND_CHUNKED | HFL_COMPRESSIBLE)) {
+        return false;
+    }
+    if (conn->priv.flags & (HFL_SENDING_HEADER | HFL_SENDING_CHUNK |
+            HFL_SENT_HEADERS | HFL_SENT_CONTENT_LENGTH | HFL_SENT_ENCODING)) {
+        return false;
+    }
+    if (conn->inst->compress == NULL) {
+        return false;
+    }
+
+    cwhttpd_encoding_t encoding = cwhttpd_negotiate_encoding(conn,
+            CWHTTPD_ENCODING_MASK(CWHTTPD_ENCODING_GZIP) |
+            CWHTTPD_ENCODING_MASK(CWHTTPD_ENCODING_DEFLATE));
+    if (encoding == CWHTTPD_ENCODING_IDENTITY) {
+        return false;
+    }
+
+    conn->priv.compress = compress_acquire(conn->inst->compress, encoding);
+    return conn->priv.compress != NULL;
+}
+
+static void compress_end(cwhttpd_conn_t *conn)
+{
+    if (conn->priv.compress != NULL) {
+        compress_release(conn->inst->compress, conn->priv.compress);
+        conn->priv.compress = NULL;
+    }
+}
+
+/* Send compressed output as one chunk */
+static bool compress_out(void *arg, const void *data, size_t len)
+{
+    cwhttpd_conn_t *conn = arg;
+
+    char head[12];
+    int head_len = cwhttpd_snprintf(head, sizeof(head), "%x\r\n",
+            (unsigned) len);
+    struct iovec iov[] = {
+        {.iov_base = head, .iov_len = head_len},
+        {.iov_base = (void *) data, .iov_len = len},
+        {.iov_base = "\r\n", .iov_len = 2},
+    };
+    return cwhttpd_plat_sendv(conn, iov, 3) >= 0;
+}
+
+/* Compress response data, len 0 ends the response */
+static ssize_t compress_send(cwhttpd_conn_t *conn, const void *buf,
+        size_t len)
+{
+    compress_ctx_t *ctx = conn->priv.compress;
+    bool finish = len == 0;
+
+    if (!(conn->priv.flags & HFL_SENT_HEADERS)) {
+        /* Hold the body back until it is large enough to be worth it */
+        if (!finish && ctx->pending_len + len <= sizeof(ctx->pending)) {
+            memcpy(ctx->pending + ctx->pending_len, buf, len);
+            ctx->pending_len += len;
+            return len;
         }
-    } else {
-        for (int i = 0; i < index - 1; i++) {
-            route = route->next;
+
+        if (finish) {
+            /* Too small, send it as it is */
+            conn->priv.compress = NULL;
+            conn->priv.flags &= ~HFL_COMPRESSIBLE;
+            ssize_t ret = 0;
+            if (ctx->pending_len > 0) {
+                ret = cwhttpd_send(conn, ctx->pending, ctx->pending_len);
+            }
+            compress_release(conn->inst->compress, ctx);
+            if (ret < 0) {
+                return ret;
+            }
+            return cwhttpd_send(conn, NULL, 0);
         }
-        cwhttpd_route_t *temp = route->next;
-        route->next = route->next->next;
-        if (index == inst->num_routes - 1) {
-            inst->route_tail = route;
+
+        cwhttpd_send_header(conn, "Content-Encoding",
+                ctx->encoding == CWHTTPD_ENCODING_GZIP ? "gzip" : "deflate");
+        cwhttpd_send_header(conn, "Vary", "Accept-Encoding");
+        end_headers(conn);
+        if (!compress_write(ctx, ctx->pending, ctx->pending_len, Z_NO_FLUSH,
+                compress_out, conn)) {
+            return -1;
+        }
+    }
+
+    if (!compress_write(ctx, buf, len, finish ? Z_FINISH : Z_NO_FLUSH,
+            compress_out, conn)) {
+        return -1;
+    }
+
+    if (finish) {
+        compress_end(conn);
+        conn->priv.flags |= HFL_SENT_FINAL_CHUNK;
+        if (cwhttpd_plat_send(conn, "0\r\n\r\n", 5) < 0) {
+            return -1;
         }
-        route = temp;
     }
 
-    free(route);
-    inst->num_routes--;
+    return len;
 }
 
+/* Send what zlib holds back as a chunk, once the response is committed to
+ * compression. A body still too small to compress stays pending. */
+static ssize_t compress_flush(cwhttpd_conn_t *conn)
+{
+    compress_ctx_t *ctx = conn->priv.compress;
+    if (ctx == NULL || !(conn->priv.flags & HFL_SENT_HEADERS)) {
+        return 0;
+    }
+    if (!compress_write(ctx, NULL, 0, Z_SYNC_FLUSH, compress_out, conn)) {
+        return -1;
+    }
+    return 0;
+}
+#endif
 
-/*********************************
- * \section Connection Functions
- *********************************/
+/* Send response data without buffering */
+static ssize_t send_data(cwhttpd_conn_t *conn, const void *buf, size_t len)
+{
+#if CONFIG_CWHTTPD_GZIP
+    if (conn->priv.compress != NULL ||
+            (len > 0 && compress_begin(conn))) {
+        return compress_send(conn, buf, len);
+    }
+#endif
 
-ssize_t cwhttpd_recv(cwhttpd_conn_t *conn, void *buf, size_t len)
+    end_headers(conn);
+
+    ssize_t count;
+    if (conn->priv.flags & HFL_SEND_CHUNKED) {
+        if (!(conn->priv.flags & HFL_SENDING_CHUNK)) {
+            /* frame the data as a chunk of its own, in a single write */
+            char head[12];
+            int head_len = cwhttpd_snprintf(head, sizeof(head), "%x\r\n",
+                    (unsigned) len);
+            struct iovec iov[] = {
+                {.iov_base = head, .iov_len = head_len},
+                {.iov_base = (void *) buf, .iov_len = len},
+                {.iov_base = "\r\n", .iov_len = 2},
+            };
+            count = cwhttpd_plat_sendv(conn, iov, 3);
+        } else {
+            if (len > conn->priv.chunk_left) {
+                LOGE(__func__, "chunk overflow");
+                return -1;
+            }
+            conn->priv.chunk_left -= len;
+            count = cwhttpd_plat_send(conn, buf, len);
+        }
+    } else {
+        conn->priv.chunk_left -= len;
+        count = cwhttpd_plat_send(conn, buf, len);
+    }
+
+    if (len == 0) {
+        conn->priv.flags |= HFL_SENT_FINAL_CHUNK;
+    }
+
+    return count;
+}
+
+/* Send the buffer of a buffered connection, compressed data may stay in
+ * zlib */
+static ssize_t flush_buffer(cwhttpd_conn_t *conn)
 {
-    size_t datalen = conn->priv.data - conn->priv.req - conn->priv.req_len;
-    if (datalen > 0) {
-        len = (len > datalen) ? datalen : len;
-        memcpy(buf, conn->priv.data, len);
-        conn->priv.data += len;
-        return len;
+    size_t len = conn->priv.send_buf_len;
+    if (len == 0) {
+        return 0;
     }
 
-    return cwhttpd_plat_recv(conn, buf, len);
+    conn->priv.send_buf_len = 0;
+    return send_data(conn, conn->priv.send_buf, len);
+}
+
+ssize_t cwhttpd_flush(cwhttpd_conn_t *conn)
+{
+    ssize_t ret = flush_buffer(conn);
+#if CONFIG_CWHTTPD_GZIP
+    if (ret >= 0 && compress_flush(conn) < 0) {
+        return -1;
+    }
+#endif
+    return ret;
 }
 
 ssize_t cwhttpd_send(cwhttpd_conn_t *conn, const void *buf, ssize_t len)
@@ -175,33 +470,66 @@ ssize_t cwhttpd_send(cwhttpd_conn_t *conn, const void *buf, ssize_t len)
         len = strlen(buf);
     }
 
-    if (!(conn->priv.flags & HFL_SENT_HEADERS)) {
-        /* End headers if we're sending data */
-        if (conn->priv.flags & HFL_SEND_CHUNKED) {
-            cwhttpd_send_header(conn, "Transfer-Encoding", "chunked");
-        }
-        if (conn->priv.flags & HFL_REQUEST_CLOSE) {
-            cwhttpd_send_header(conn, "Connection", "close");
-        } else if (!(conn->priv.flags & HFL_SENT_CONTENT_LENGTH)) {
-            if (!(conn->priv.flags & HFL_SEND_CHUNKED)) {
-                if (conn->priv.flags & HFL_RECEIVED_HTTP11) {
-                    cwhttpd_send_header(conn, "Connection", "close");
-                }
+    /* data inside of a chunk started by the caller goes out as it is */
+    if ((conn->priv.flags & (HFL_SEND_BUFFERED | HFL_SENDING_CHUNK)) ==
+            HFL_SEND_BUFFERED) {
+        size_t room = CONFIG_CWHTTPD_SEND_BUFFER_SIZE - conn->priv.send_buf_len;
+        if (len > 0 && len <= room) {
+            memcpy(conn->priv.send_buf + conn->priv.send_buf_len, buf, len);
+            conn->priv.send_buf_len += len;
+            return len;
+        }
+        if (cwhttpd_flush(conn) < 0) {
+            return -1;
+        }
+        if (len > 0 && len < CONFIG_CWHTTPD_SEND_BUFFER_SIZE) {
+            memcpy(conn->priv.send_buf, buf, len);
+            conn->priv.send_buf_len = len;
+            return len;
+        }
+    }
+
+    return send_data(conn, buf, len);
+}
+
+ssize_t cwhttpd_sendfile(cwhttpd_conn_t *conn, int fd, off_t offset,
+        size_t len)
+{
+    if (len == 0) {
+        return 0;
+    }
+
+    if (flush_buffer(conn) < 0) {
+        return -1;
+    }
+
+#if CONFIG_CWHTTPD_GZIP
+    if (conn->priv.compress != NULL || compress_begin(conn)) {
+        uint8_t buf[1024];
+        size_t count = 0;
+        while (count < len) {
+            ssize_t n = pread(fd, buf, MIN(sizeof(buf), len - count),
+                    offset + count);
+            if (n <= 0) {
+                return -1;
+            }
+            if (compress_send(conn, buf, n) < 0) {
+                return -1;
             }
-        } else if (conn->priv.flags & HFL_RECEIVED_CONN_ALIVE) {
-            cwhttpd_send_header(conn, "Connection", "keep-alive");
+            count += n;
         }
-        cwhttpd_plat_send(conn, "\r\n", 2);
-        conn->priv.flags |= HFL_SENT_HEADERS;
+        return count;
     }
+#endif
+
+    end_headers(conn);
 
     bool end_chunk = false;
     size_t count = 0;
+    ssize_t ret;
     if (conn->priv.flags & HFL_SEND_CHUNKED) {
-        ssize_t ret;
         if (!(conn->priv.flags & HFL_SENDING_CHUNK)) {
             end_chunk = true;
-            conn->priv.chunk_left = len;
             ret = cwhttpd_chunk_start(conn, len);
             if (ret < 0) {
                 return ret;
@@ -212,26 +540,19 @@ ssize_t cwhttpd_send(cwhttpd_conn_t *conn, const void *buf, ssize_t len)
             LOGE(__func__, "chunk overflow");
             return -1;
         }
-        conn->priv.chunk_left -= len;
-        ret = cwhttpd_plat_send(conn, buf, len);
+    }
+    conn->priv.chunk_left -= len;
+    ret = cwhttpd_plat_sendfile(conn, fd, offset, len);
+    if (ret < 0) {
+        return ret;
+    }
+    count += ret;
+    if (end_chunk) {
+        ret = cwhttpd_chunk_end(conn);
         if (ret < 0) {
             return ret;
         }
         count += ret;
-        if (end_chunk) {
-            ret = cwhttpd_chunk_end(conn);
-            if (ret < 0) {
-                return ret;
-            }
-            count += ret;
-        }
-    } else {
-        conn->priv.chunk_left -= len;
-        count = cwhttpd_plat_send(conn, buf, len);
-    }
-
-    if (len == 0) {
-        conn->priv.flags |= HFL_SENT_FINAL_CHUNK;
     }
 
     return count;
@@ -319,6 +640,24 @@ void cwhttpd_set_chunked(cwhttpd_conn_t *conn, bool enable)
     }
 }
 
+void cwhttpd_set_buffered(cwhttpd_conn_t *conn, bool enable)
+{
+    if (!enable) {
+        flush_buffer(conn);
+        conn->priv.flags &= ~HFL_SEND_BUFFERED;
+        return;
+    }
+
+    if (conn->priv.send_buf == NULL) {
+        conn->priv.send_buf = malloc(CONFIG_CWHTTPD_SEND_BUFFER_SIZE);
+        if (conn->priv.send_buf == NULL) {
+            LOGW(__func__, "malloc failed");
+            return;
+        }
+    }
+    conn->priv.flags |= HFL_SEND_BUFFERED;
+}
+
 void cwhttpd_set_close(cwhttpd_conn_t *conn, bool close)
 {
     if (conn->priv.flags & HFL_SENT_HEADERS) {
@@ -334,76 +673,67 @@ void cwhttpd_set_close(cwhttpd_conn_t *conn, bool close)
     }
 }
 
-ssize_t cwhttpd_response(cwhttpd_conn_t *conn, int code)
+static const char *status_message(int code)
 {
-    const char *message;
-
-    if (conn->priv.flags & HFL_SENT_RESPONSE) {
-        LOGE(__func__, "response already sent");
-        return 0;
-    }
-
     switch (code) {
         case 100:
-            message = "Continue";
-            break;
+            return "Continue";
         case 101:
-            message = "Switching Protocol";
-            break;
+            return "Switching Protocol";
         case 200:
-            message = "OK";
-            break;
+            return "OK";
         case 201:
-            message = "Created";
-            break;
+            return "Created";
         case 204:
-            message = "No Content";
-            break;
+            return "No Content";
+        case 206:
+            return "Partial Content";
         case 301:
-            message = "Moved Permanently";
-            break;
+            return "Moved Permanently";
         case 302:
-            message = "Found";
-            break;
+            return "Found";
         case 303:
-            message = "See Other";
-            break;
+            return "See Other";
         case 307:
-            message = "Temporary Redirect";
-            break;
+            return "Temporary Redirect";
+        case 304:
+            return "Not Modified";
         case 308:
-            message = "Permanent Redirect";
-            break;
+            return "Permanent Redirect";
         case 400:
-            message = "Bad Request";
-            break;
+            return "Bad Request";
         case 401:
-            message = "Unauthorized";
-            break;
+            return "Unauthorized";
         case 403:
-            message = "Forbidden";
-            break;
+            return "Forbidden";
         case 404:
-            message = "Not Found";
-            break;
+            return "Not Found";
         case 405:
-            message = "Method Not Allowed";
-            break;
+            return "Method Not Allowed";
         case 411:
-            message = "Length Required";
-            break;
+            return "Length Required";
         case 414:
-            message = "URI Too Long";
-            break;
+            return "URI Too Long";
+        case 415:
+            return "Unsupported Media Type";
+        case 416:
+            return "Range Not Satisfiable";
         case 500:
-            message = "Internal Server Error";
-            break;
+            return "Internal Server Error";
         case 501:
-            message = "Not Implemented";
-            break;
+            return "Not Implemented";
+        case 507:
+            return "Insufficient Storage";
         default:
-            message = "OK";
-            break;
+            return "OK";
+    }
+}
+
+ssize_t cwhttpd_response(cwhttpd_conn_t *conn, int code)
+{
+    if (conn->priv.flags & HFL_SENT_RESPONSE) {
+        LOGE(__func__, "response already sent");
+        return 0;
     }
 
     size_t total = 0;
@@ -411,7 +741,8 @@ ssize_t cwhttpd_response(cwhttpd_conn_t *conn, int code)
     uint32_t flags = conn->priv.flags;
     conn->priv.flags |= HFL_SENDING_HEADER;
     ssize_t r = cwhttpd_sendf(conn, "HTTP/1.%d %d %s\r\n",
-            (conn->priv.flags & HFL_RECEIVED_HTTP11) ? 1 : 0, code, message);
+            (conn->priv.flags & HFL_RECEIVED_HTTP11) ? 1 : 0, code,
+            status_message(code));
     conn->priv.flags = flags | HFL_SENT_RESPONSE;
     if (r <= 0) {
         return r;
@@ -427,6 +758,80 @@ ssize_t cwhttpd_response(cwhttpd_conn_t *conn, int code)
     return total;
 }
 
+/* Format the status line and the Server, Connection and Content-Length
+ * headers, and mark the headers as sent */
+static int format_head(cwhttpd_conn_t *conn, char *head, size_t len,
+        int code, size_t content_length)
+{
+    const char *connection = "";
+    if (conn->priv.flags & HFL_REQUEST_CLOSE) {
+        connection = "Connection: close\r\n";
+        conn->priv.flags |= HFL_SENT_CONN_CLOSE;
+    } else if (conn->priv.flags & HFL_RECEIVED_CONN_ALIVE) {
+        connection = "Connection: keep-alive\r\n";
+    }
+
+    int head_len = cwhttpd_snprintf(head, len,
+            "HTTP/1.%d %d %s\r\nServer: cwhttpd/" CWHTTPD_VERSION "\r\n%s",
+            (conn->priv.flags & HFL_RECEIVED_HTTP11) ? 1 : 0, code,
+            status_message(code), connection);
+    /* 204 and 304 responses never have a body */
+    if (code != 204 && code != 304) {
+        head_len += cwhttpd_snprintf(head + head_len, len - head_len,
+                "Content-Length: %zu\r\n", content_length);
+    }
+
+    conn->priv.flags &= ~HFL_SEND_CHUNKED;
+    conn->priv.flags |= HFL_SENT_RESPONSE | HFL_SENT_HEADERS |
+            HFL_SENT_CONTENT_LENGTH;
+    conn->priv.chunk_left = content_length;
+
+    return head_len;
+}
+
+ssize_t cwhttpd_send_head(cwhttpd_conn_t *conn, int code,
+        const char *headers, size_t headers_len, size_t content_length)
+{
+    if (conn->priv.flags & HFL_SENT_RESPONSE) {
+        LOGE(__func__, "response already sent");
+        return 0;
+    }
+
+    char head[160];
+    int head_len = format_head(conn, head, sizeof(head), code,
+            content_length);
+
+    struct iovec iov[] = {
+        {.iov_base = head, .iov_len = head_len},
+        {.iov_base = (void *) headers, .iov_len = headers_len},
+        {.iov_base = "\r\n", .iov_len = 2},
+    };
+    return cwhttpd_plat_sendv(conn, iov, 3);
+}
+
+ssize_t cwhttpd_send_response(cwhttpd_conn_t *conn, int code,
+        const char *headers, size_t headers_len, const void *body,
+        size_t body_len)
+{
+    if (conn->priv.flags & HFL_SENT_RESPONSE) {
+        LOGE(__func__, "response already sent");
+        return 0;
+    }
+
+    char head[160];
+    int head_len = format_head(conn, head, sizeof(head), code, body_len);
+    conn->priv.chunk_left = 0;
+
+    /* gather the whole response so it goes out in one write */
+    struct iovec iov[] = {
+        {.iov_base = head, .iov_len = head_len},
+        {.iov_base = (void *) headers, .iov_len = headers_len},
+        {.iov_base = "\r\n", .iov_len = 2},
+        {.iov_base = (void *) body, .iov_len = body_len},
+    };
+    return cwhttpd_plat_sendv(conn, iov, body_len ? 4 : 3);
+}
+
 ssize_t cwhttpd_send_header(cwhttpd_conn_t *conn, const char *name, const char *value)
 {
     if (conn->priv.flags & HFL_SENT_HEADERS) {
@@ -439,6 +844,18 @@ ssize_t cwhttpd_send_header(cwhttpd_conn_t *conn, const char *name, const char *
         conn->priv.flags |= HFL_SENT_CONTENT_LENGTH;
     }
 
+    if (strcasecmp(name, "Content-Type") == 0) {
+        if (cwhttpd_mime_compressible(value)) {
+            conn->priv.flags |= HFL_COMPRESSIBLE;
+        } else {
+            conn->priv.flags &= ~HFL_COMPRESSIBLE;
+        }
+    }
+
+    if (strcasecmp(name, "Content-Encoding") == 0) {
+        conn->priv.flags |= HFL_SENT_ENCODING;
+    }
+
     if ((strcasecmp(name, "Connection") == 0) &&
             (strcasecmp(name, "close") == 0)) {
         conn->priv.flags |= HFL_SENT_CONN_CLOSE;
@@ -452,25 +869,146 @@ ssize_t cwhttpd_send_header(cwhttpd_conn_t *conn, const char *name, const char *
     return r;
 }
 
-ssize_t cwhttpd_send_cache_header(cwhttpd_conn_t *conn, const char *mime)
+const char *cwhttpd_cache_control(const char *mime)
 {
     if (mime != NULL) {
         if (strcmp(mime, "text/html") == 0) {
-            return 0;
+            return NULL;
         }
         if (strcmp(mime, "text/plain") == 0) {
-            return 0;
+            return NULL;
         }
         if (strcmp(mime, "text/csv") == 0) {
-            return 0;
+            return NULL;
         }
         if (strcmp(mime, "application/json") == 0) {
-            return 0;
+            return NULL;
+        }
+    }
+
+    return "max-age=7200, public, must-revalidate";
+}
+
+ssize_t cwhttpd_send_cache_header(cwhttpd_conn_t *conn, const char *mime)
+{
+    const char *value = cwhttpd_cache_control(mime);
+    if (value == NULL) {
+        return 0;
+    }
+
+    return cwhttpd_send_header(conn, "Cache-Control", value);
+}
+
+/* Parse a qvalue into thousandths, -1 if malformed */
+static int parse_qvalue(const char *s, const char *end)
+{
+    if (s == end || (*s != '0' && *s != '1')) {
+        return -1;
+    }
+    int q = (*s++ - '0') * 1000;
+    if (s < end && *s == '.') {
+        s++;
+        for (int scale = 100; s < end && isdigit((unsigned char) *s) &&
+                scale > 0; scale /= 10) {
+            q += (*s++ - '0') * scale;
+        }
+    }
+    if (s != end || q > 1000) {
+        return -1;
+    }
+    return q;
+}
+
+cwhttpd_encoding_t cwhttpd_negotiate_encoding(cwhttpd_conn_t *conn,
+        unsigned int available)
+{
+    static const struct {
+        const char *name;
+        cwhttpd_encoding_t encoding;
+    } codings[] = {
+        {"identity", CWHTTPD_ENCODING_IDENTITY},
+        {"deflate",  CWHTTPD_ENCODING_DEFLATE},
+        {"gzip",     CWHTTPD_ENCODING_GZIP},
+        {"x-gzip",   CWHTTPD_ENCODING_GZIP},
+        {"br",       CWHTTPD_ENCODING_BR},
+    };
+
+    const char *header = cwhttpd_get_header(conn, "Accept-Encoding");
+    if (header == NULL) {
+        return CWHTTPD_ENCODING_IDENTITY;
+    }
+
+    /* weights in thousandths, -1 where the header doesn't say */
+    int weights[CWHTTPD_ENCODING_BR + 1] = {-1, -1, -1, -1};
+    int any = -1;
+
+    const char *p = header;
+    while (*p != '\0') {
+        while (*p == ' ' || *p == '\t' || *p == ',') {
+            p++;
+        }
+        const char *name = p;
+        while (*p != '\0' && *p != ',' && *p != ';' && *p != ' ' &&
+                *p != '\t') {
+            p++;
+        }
+        size_t name_len = p - name;
+
+        int q = 1000;
+        while (*p != '\0' && *p != ',') {
+            if (*p != ';') {
+                p++;
+                continue;
+            }
+            p++;
+            while (*p == ' ' || *p == '\t') {
+                p++;
+            }
+            const char *param = p;
+            while (*p != '\0' && *p != ',' && *p != ';' && *p != ' ' &&
+                    *p != '\t') {
+                p++;
+            }
+            if ((param[0] == 'q' || param[0] == 'Q') && param[1] == '=') {
+                q = parse_qvalue(param + 2, p);
+            }
+        }
+        if (name_len == 0 || q < 0) {
+            continue;
+        }
+
+        if (name_len == 1 && *name == '*') {
+            any = q;
+            continue;
+        }
+        for (size_t i = 0; i < sizeof(codings) / sizeof(codings[0]); i++) {
+            if (strlen(codings[i].name) == name_len &&
+                    strncasecmp(codings[i].name, name, name_len) == 0) {
+                weights[codings[i].encoding] = q;
+                break;
+            }
         }
     }
 
-    return cwhttpd_send_header(conn, "Cache-Control",
-            "max-age=7200, public, must-revalidate");
+    /* identity is acceptable unless excluded, ties go to the codings */
+    if (weights[CWHTTPD_ENCODING_IDENTITY] < 0) {
+        weights[CWHTTPD_ENCODING_IDENTITY] = any >= 0 ? any : 1;
+    }
+
+    cwhttpd_encoding_t best = CWHTTPD_ENCODING_IDENTITY;
+    int best_weight = 0;
+    for (int e = CWHTTPD_ENCODING_IDENTITY; e <= CWHTTPD_ENCODING_BR; e++) {
+        if (e != CWHTTPD_ENCODING_IDENTITY &&
+                !(available & CWHTTPD_ENCODING_MASK(e))) {
+            continue;
+        }
+        int weight = weights[e] >= 0 ? weights[e] : (any >= 0 ? any : 0);
+        if (weight > 0 && weight >= best_weight) {
+            best = e;
+            best_weight = weight;
+        }
+    }
+    return best;
 }
 
 ssize_t cwhttpd_chunk_start(cwhttpd_conn_t *conn, size_t len)
@@ -478,10 +1016,20 @@ ssize_t cwhttpd_chunk_start(cwhttpd_conn_t *conn, size_t len)
     if (!(conn->priv.flags & HFL_SEND_CHUNKED)) {
         return 0;
     }
+#if CONFIG_CWHTTPD_GZIP
+    /* compressed output is framed as it comes out of zlib */
+    if (conn->priv.compress != NULL ||
+            (len > 0 && compress_begin(conn))) {
+        return 0;
+    }
+#endif
     if (conn->priv.flags & HFL_SENDING_CHUNK) {
         LOGE(__func__, "chunk framing");
         return -1;
     }
+    if (cwhttpd_flush(conn) < 0) {
+        return -1;
+    }
     conn->priv.flags |= HFL_SENDING_CHUNK;
     conn->priv.chunk_left = 10;
     ssize_t ret = cwhttpd_sendf(conn, "%x\r\n", len);
@@ -494,6 +1042,11 @@ ssize_t cwhttpd_chunk_end(cwhttpd_conn_t *conn)
     if (!(conn->priv.flags & HFL_SEND_CHUNKED)) {
         return 0;
     }
+#if CONFIG_CWHTTPD_GZIP
+    if (conn->priv.compress != NULL) {
+        return 0;
+    }
+#endif
     if (!(conn->priv.flags & HFL_SENDING_CHUNK) ||
             (conn->priv.chunk_left != 0)) {
         LOGE(__func__, "chunk framing");
@@ -524,90 +1077,230 @@ void cwhttpd_redirect(cwhttpd_conn_t *conn, const char *url)
     cwhttpd_send_header(conn, "Location", url);
 }
 
-// Returns a static char *to a mime type for a given url to a file.
-const char *cwhttpd_get_mimetype(const char *url)
+bool cwhttpd_mime_compressible(const char *mime)
 {
-    char *urlp = (char *) url;
-    int i = 0;
+    static const char *const types[] = {
+        "application/javascript",
+        "application/json",
+        "application/manifest+json",
+        "application/wasm",
+        "application/xml",
+        "image/svg+xml",
+        "image/x-icon",
+    };
+
+    if (mime == NULL) {
+        return false;
+    }
+    if (strncasecmp(mime, "text/event-stream", 17) == 0) {
+        /* events must not wait for a compressor to fill up */
+        return false;
+    }
+    if (strncasecmp(mime, "text/", 5) == 0) {
+        return true;
+    }
+    /* ignore parameters such as charset */
+    size_t len = strcspn(mime, "; \t");
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+        if (strncasecmp(mime, types[i], len) == 0 && types[i][len] == '\0') {
+            return true;
+        }
+    }
+    return false;
+}
+
+static const char wday_names[7][4] = {
+    "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat",
+};
+
+static const char month_names[12][4] = {
+    "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+    "Jul", "Aug", "Sep", "Oct", "Nov", "Dec",
+};
 
-    // Find the extension
-    const char *ext = urlp + strlen(urlp) - 1;
-    while (ext != urlp && *ext != '.') {
-        ext--;
+size_t cwhttpd_format_date(char *buf, time_t t)
+{
+    int64_t days = t / 86400;
+    int64_t secs = t % 86400;
+    if (secs < 0) {
+        secs += 86400;
+        days--;
     }
+    int wday = (days + 4) % 7; /* 1970-01-01 was a Thursday */
+    if (wday < 0) {
+        wday += 7;
+    }
+
+    /* civil date from days since the epoch, in 400 year eras */
+    int64_t z = days + 719468;
+    int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+    int64_t doe = z - era * 146097;
+    int64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    int64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    int64_t mp = (5 * doy + 2) / 153;
+    int mday = doy - (153 * mp + 2) / 5 + 1;
+    int mon = mp < 10 ? mp + 2 : mp - 10;
+    int year = yoe + era * 400 + (mon < 2);
+
+    return cwhttpd_snprintf(buf, CWHTTPD_DATE_LEN,
+            "%s, %02d %s %04d %02d:%02d:%02d GMT", wday_names[wday], mday,
+            month_names[mon], year, (int) (secs / 3600),
+            (int) (secs / 60 % 60), (int) (secs % 60));
+}
 
-    if (*ext == '.') {
-        ext++;
+bool cwhttpd_parse_date(const char *s, time_t *t)
+{
+    char month[4];
+    int mday, year, hour, min, sec;
+
+    const char *comma = strchr(s, ',');
+    if (comma != NULL) {
+        /* Sun, 06 Nov 1994 08:49:37 GMT */
+        if (sscanf(comma + 1, " %2d %3s %4d %2d:%2d:%2d GMT", &mday, month,
+                &year, &hour, &min, &sec) != 6) {
+            /* Sunday, 06-Nov-94 08:49:37 GMT */
+            if (sscanf(comma + 1, " %2d-%3s-%2d %2d:%2d:%2d GMT", &mday,
+                    month, &year, &hour, &min, &sec) != 6) {
+                return false;
+            }
+            year += (year < 70) ? 2000 : 1900;
+        }
+    } else {
+        /* Sun Nov  6 08:49:37 1994 */
+        if (sscanf(s, "%*3s %3s %2d %2d:%2d:%2d %4d", month, &mday, &hour,
+                &min, &sec, &year) != 6) {
+            return false;
+        }
     }
 
-    while (mime_types[i].ext != NULL && strcasecmp(ext, mime_types[i].ext) != 0) {
-        i++;
+    int mon = 0;
+    while (mon < 12 && strcmp(month, month_names[mon]) != 0) {
+        mon++;
+    }
+    if (mon == 12 || mday < 1 || mday > 31 || hour > 23 || min > 59 ||
+            sec > 60) {
+        return false;
     }
 
-    return mime_types[i].mimetype;
+    /* days since the epoch from a civil date, in 400 year eras */
+    int64_t y = year - (mon < 2);
+    int64_t era = (y >= 0 ? y : y - 399) / 400;
+    int64_t yoe = y - era * 400;
+    int64_t doy = (153 * (mon > 1 ? mon - 2 : mon + 10) + 2) / 5 + mday - 1;
+    int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    int64_t days = era * 146097 + doe - 719468;
+
+    *t = days * 86400 + hour * 3600 + min * 60 + sec;
+    return true;
 }
 
-static int decode_hex(char c)
+/* Hex digit values, anything else decodes as 0 */
+static const uint8_t hex_lut[256] = {
+    ['0'] = 0, ['1'] = 1, ['2'] = 2, ['3'] = 3, ['4'] = 4,
+    ['5'] = 5, ['6'] = 6, ['7'] = 7, ['8'] = 8, ['9'] = 9,
+    ['A'] = 10, ['B'] = 11, ['C'] = 12, ['D'] = 13, ['E'] = 14, ['F'] = 15,
+    ['a'] = 10, ['b'] = 11, ['c'] = 12, ['d'] = 13, ['e'] = 14, ['f'] = 15,
+};
+
+#define ONES  UINT64_C(0x0101010101010101)
+#define HIGHS UINT64_C(0x8080808080808080)
+#define HAS_ZERO(v) (((v) - ONES) & ~(v) & HIGHS)
+
+/* Return the offset of the first '%' or '+' in p, or len if there is none */
+static size_t find_escape(const char *p, size_t len)
 {
-    if (c >= '0' && c <= '9') {
-         return c - '0';
+    size_t i = 0;
+
+#if defined(__AVX2__)
+    const __m256i pct32 = _mm256_set1_epi8('%');
+    const __m256i plus32 = _mm256_set1_epi8('+');
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (p + i));
+        uint32_t m = _mm256_movemask_epi8(_mm256_or_si256(
+                _mm256_cmpeq_epi8(v, pct32), _mm256_cmpeq_epi8(v, plus32)));
+        if (m) {
+            return i + __builtin_ctz(m);
+        }
     }
-    if (c >= 'A' && c <= 'F') {
-        return c - 'A' + 10;
+#endif
+#if defined(__SSE2__)
+    const __m128i pct16 = _mm_set1_epi8('%');
+    const __m128i plus16 = _mm_set1_epi8('+');
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (p + i));
+        uint32_t m = _mm_movemask_epi8(_mm_or_si128(
+                _mm_cmpeq_epi8(v, pct16), _mm_cmpeq_epi8(v, plus16)));
+        if (m) {
+            return i + __builtin_ctz(m);
+        }
     }
-    if (c >= 'a' && c <= 'f') {
-        return c - 'a' + 10;
+#endif
+    for (; i + 8 <= len; i += 8) {
+        uint64_t v;
+        memcpy(&v, p + i, sizeof(v));
+        if (HAS_ZERO(v ^ (ONES * '%')) | HAS_ZERO(v ^ (ONES * '+'))) {
+            break;
+        }
     }
-    return 0;
+    for (; i < len; i++) {
+        if (p[i] == '%' || p[i] == '+') {
+            break;
+        }
+    }
+    return i;
 }
 
 size_t cwhttpd_url_decode(const char *in, ssize_t in_len, char *out,
         size_t *out_len)
 {
-    if (in_len == -1) {
+    if (in_len < 0) {
         in_len = strlen(in);
     }
 
-    const char *in_start = in;
-    char *out_start = out;
+    /* room for decoded bytes, leaving one for the NULL terminator */
+    size_t room = *out_len ? *out_len - 1 : 0;
+    size_t in_pos = 0;
     size_t out_pos = 0;
-    int escape = 0;
-
-    while (in - in_start < in_len) {
-        if (escape == 1) {
-            if (out_pos < *out_len) {
-                *out = decode_hex(*in) << 4;
-            }
-            escape++;
-        } else if (escape == 2) {
-            if (out_pos < *out_len) {
-                *out++ |= decode_hex(*in);
-            }
-            out_pos++;
-            escape = 0;
-        } else if (*in == '%') {
-            escape = 1;
-        } else if (*in == '+') {
-            if (out_pos < *out_len) {
-                *out++ = ' ';
-            }
-            out_pos++;
-        } else {
-            if (out_pos < *out_len) {
-                *out++ = *in;
+
+    while (in_pos < in_len) {
+        size_t span = find_escape(in + in_pos, in_len - in_pos);
+        if (span > 0) {
+            /* copy escape-free runs in bulk, or not at all when decoding in
+             * place and nothing has been decoded yet */
+            if (out_pos < room && out + out_pos != in + in_pos) {
+                memmove(out + out_pos, in + in_pos, MIN(span, room - out_pos));
+            }
+            in_pos += span;
+            out_pos += span;
+            if (in_pos >= in_len) {
+                break;
             }
-            out_pos++;
         }
-        in++;
+
+        char c;
+        if (in[in_pos] == '+') {
+            c = ' ';
+            in_pos += 1;
+        } else if (in_len - in_pos >= 3) {
+            c = (hex_lut[(uint8_t) in[in_pos + 1]] << 4) |
+                    hex_lut[(uint8_t) in[in_pos + 2]];
+            in_pos += 3;
+        } else {
+            /* truncated escape */
+            break;
+        }
+        if (out_pos < room) {
+            out[out_pos] = c;
+        }
+        out_pos++;
     }
 
-    if (out_pos < *out_len) {
-        *out = '\0';
-    } else if (*out_len) {
-        *out-- = '\0';
+    size_t written = MIN(out_pos, room);
+    if (*out_len > 0) {
+        out[written] = '\0';
     }
     *out_len = out_pos + 1;
-    return out - out_start;
+    return written;
 }
 
 ssize_t cwhttpd_find_param(const char *needle, const char *haystack, char *out,
@@ -635,6 +1328,244 @@ ssize_t cwhttpd_find_param(const char *needle, const char *haystack, char *out,
 }
 
 
+static uint32_t param_hash(const char *s, size_t len)
+{
+    uint32_t hash = 2166136261u;
+
+    while (len--) {
+        hash ^= (uint8_t) *s++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static cwhttpd_param_t *param_at(cwhttpd_conn_t *conn, size_t i)
+{
+    if (i < CONFIG_CWHTTPD_MAX_PARAMS) {
+        return &conn->priv.params[i];
+    }
+    return &conn->priv.more_params[i - CONFIG_CWHTTPD_MAX_PARAMS];
+}
+
+/* Parameters past the inline slots go to a growing array, so every one of
+ * them can be looked up */
+static cwhttpd_param_t *param_add(cwhttpd_conn_t *conn)
+{
+    size_t i = conn->priv.num_params;
+    if (i >= CONFIG_CWHTTPD_MAX_PARAMS &&
+            i - CONFIG_CWHTTPD_MAX_PARAMS == conn->priv.more_params_cap) {
+        size_t cap = conn->priv.more_params_cap ?
+                conn->priv.more_params_cap * 2 : CONFIG_CWHTTPD_MAX_PARAMS;
+        cwhttpd_param_t *more = realloc(conn->priv.more_params,
+                cap * sizeof(cwhttpd_param_t));
+        if (more == NULL) {
+            LOGE(__func__, "realloc failed %zu parameters", cap);
+            return NULL;
+        }
+        conn->priv.more_params = more;
+        conn->priv.more_params_cap = cap;
+    }
+    conn->priv.num_params++;
+    return param_at(conn, i);
+}
+
+static void index_param_span(cwhttpd_conn_t *conn, const char *p,
+        const char *end)
+{
+    while (p < end && *p != '\0' && *p != '\n' && *p != '\r') {
+        const char *next = p;
+        while (next < end && *next != '&' && *next != '\0' &&
+                *next != '\n' && *next != '\r') {
+            next++;
+        }
+
+        if (next > p) {
+            cwhttpd_param_t *param = param_add(conn);
+            if (param == NULL) {
+                return;
+            }
+            const char *eq = memchr(p, '=', next - p);
+            param->key = p;
+            param->key_len = (eq ? eq : next) - p;
+            param->value = eq ? eq + 1 : next;
+            param->value_len = next - param->value;
+        }
+
+        p = next;
+        if (p < end && *p == '&') {
+            p++;
+        }
+    }
+}
+
+/* Read the next piece of the body into the post buffer */
+static bool post_read(cwhttpd_conn_t *conn)
+{
+    cwhttpd_post_t *post = conn->post;
+    if (post == NULL || post->received >= post->len) {
+        return true;
+    }
+
+    ssize_t chunk;
+    if (conn->priv.req_len - (conn->priv.data - conn->priv.req) > 0) {
+        chunk = MIN(conn->priv.req_len - (conn->priv.data - conn->priv.req),
+                sizeof(post->buf) - post->buf_len);
+        memcpy(post->buf + post->buf_len, conn->priv.data, chunk);
+        conn->priv.data += chunk;
+    } else {
+        chunk = cwhttpd_plat_recv(conn, post->buf + post->buf_len,
+                MIN(post->len, sizeof(post->buf) - post->buf_len));
+        if (chunk < 0) {
+            return false;
+        }
+    }
+    post->buf_len += chunk;
+    post->received += chunk;
+    return true;
+}
+
+static bool post_is_indexable(cwhttpd_conn_t *conn)
+{
+    cwhttpd_post_t *post = conn->post;
+
+    return post != NULL && post->boundary == NULL &&
+            post->received == post->len && post->buf_len == post->len;
+}
+
+static void index_params(cwhttpd_conn_t *conn)
+{
+    free(conn->priv.param_buf);
+    conn->priv.param_buf = NULL;
+    free(conn->priv.more_params);
+    conn->priv.more_params = NULL;
+    conn->priv.more_params_cap = 0;
+    conn->priv.num_params = 0;
+    conn->priv.flags |= HFL_PARAMS_INDEXED;
+
+    if (conn->request.args) {
+        index_param_span(conn, conn->request.args,
+                conn->request.args + strlen(conn->request.args));
+    }
+    if (post_is_indexable(conn)) {
+        index_param_span(conn, conn->post->buf,
+                conn->post->buf + conn->post->buf_len);
+        conn->priv.flags |= HFL_PARAMS_POST;
+    }
+
+    /* Keys and values are copied out so the index stays valid if the
+     * handler reuses the post buffer. Decoding never grows them. */
+    size_t size = 0;
+    for (size_t i = 0; i < conn->priv.num_params; i++) {
+        const cwhttpd_param_t *param = param_at(conn, i);
+        size += param->key_len + param->value_len + 2;
+    }
+    if (size == 0) {
+        return;
+    }
+
+    char *p = malloc(size);
+    if (p == NULL) {
+        LOGE(__func__, "malloc failed %zu bytes", size);
+        conn->priv.num_params = 0;
+        return;
+    }
+    conn->priv.param_buf = p;
+
+    for (size_t i = 0; i < conn->priv.num_params; i++) {
+        cwhttpd_param_t *param = param_at(conn, i);
+        size_t out_len = param->key_len + 1;
+        param->key_len = cwhttpd_url_decode(param->key, param->key_len, p,
+                &out_len);
+        param->key = p;
+        param->hash = param_hash(param->key, param->key_len);
+        p += out_len;
+
+        out_len = param->value_len + 1;
+        param->value_len = cwhttpd_url_decode(param->value, param->value_len,
+                p, &out_len);
+        param->value = p;
+        p += out_len;
+    }
+}
+
+static const char *param_lookup(cwhttpd_conn_t *conn, const char *name,
+        size_t *len)
+{
+    if (!(conn->priv.flags & HFL_PARAMS_INDEXED) ||
+            (!(conn->priv.flags & HFL_PARAMS_POST) &&
+            post_is_indexable(conn))) {
+        index_params(conn);
+    }
+
+    size_t name_len = strlen(name);
+    uint32_t hash = param_hash(name, name_len);
+    for (size_t i = 0; i < conn->priv.num_params; i++) {
+        const cwhttpd_param_t *param = param_at(conn, i);
+        if (param->hash == hash && param->key_len == name_len &&
+                memcmp(param->key, name, name_len) == 0) {
+            if (len) {
+                *len = param->value_len;
+            }
+            return param->value;
+        }
+    }
+    return NULL;
+}
+
+const char *cwhttpd_param_str(cwhttpd_conn_t *conn, const char *name,
+        size_t *len)
+{
+    const char *value = param_lookup(conn, name, len);
+
+    /* a form body held back for 100 Continue is only asked for when the
+     * query string doesn't have the parameter */
+    cwhttpd_post_t *post = conn->post;
+    if (value == NULL && (conn->priv.flags & HFL_EXPECT_CONTINUE) &&
+            post->boundary == NULL && post->len <= sizeof(post->buf)) {
+        if (cwhttpd_continue(conn) < 0 || !post_read(conn)) {
+            return NULL;
+        }
+        value = param_lookup(conn, name, len);
+    }
+    return value;
+}
+
+bool cwhttpd_param_int(cwhttpd_conn_t *conn, const char *name, long *value)
+{
+    const char *s = cwhttpd_param_str(conn, name, NULL);
+    if (s == NULL || *s == '\0') {
+        return false;
+    }
+
+    char *end;
+    long v = strtol(s, &end, 0);
+    if (*end != '\0') {
+        return false;
+    }
+    *value = v;
+    return true;
+}
+
+const char *cwhttpd_route_param(cwhttpd_conn_t *conn, const char *name,
+        size_t *len)
+{
+    if (conn->route == NULL) {
+        return NULL;
+    }
+
+    ssize_t index = router_param_index(conn->route, name);
+    if (index < 0) {
+        return NULL;
+    }
+
+    const cwhttpd_span_t *span = &conn->priv.route_params[index];
+    if (len) {
+        *len = span->len;
+    }
+    return span->ptr;
+}
+
+
 /*******************************
  * \section Connection Handler
  *******************************/
@@ -780,6 +1711,15 @@ static bool parse_headers(cwhttpd_conn_t *conn)
         }
     }
 
+    /* The go-ahead is sent once a route handler reads the body, see
+     * cwhttpd_continue() */
+    value = cwhttpd_get_header(conn, "Expect");
+    if (value != NULL && conn->post != NULL &&
+            (conn->priv.flags & HFL_RECEIVED_HTTP11) &&
+            strcasecmp(value, "100-continue") == 0) {
+        conn->priv.flags |= HFL_EXPECT_CONTINUE;
+    }
+
     value = cwhttpd_get_header(conn, "Content-Type");
     if (value != NULL) {
         if (strstr(value, "multipart/form-data")) {
@@ -816,7 +1756,9 @@ static bool parse_headers(cwhttpd_conn_t *conn)
     return true;
 }
 
-static const cwhttpd_route_t route_404 = {NULL, cwhttpd_route_404, NULL, 0};
+static const cwhttpd_route_t route_404 = {
+    .handler = cwhttpd_route_404,
+};
 
 // renamed to my_strnstr incase name conflict with library version
 static char *my_strnstr(const char *s1, const char *s2, size_t n)
@@ -841,15 +1783,91 @@ static char *my_strnstr(const char *s1, const char *s2, size_t n)
     return NULL;
 }
 
+static void free_request(cwhttpd_conn_t *conn)
+{
+    free(conn->post);
+    conn->post = NULL;
+    free(conn->priv.param_buf);
+    conn->priv.param_buf = NULL;
+    free(conn->priv.more_params);
+    conn->priv.more_params = NULL;
+    conn->priv.more_params_cap = 0;
+    conn->priv.num_params = 0;
+    free(conn->priv.url_buf);
+    conn->priv.url_buf = NULL;
+    free(conn->priv.send_buf);
+    conn->priv.send_buf = NULL;
+    conn->priv.send_buf_len = 0;
+    conn->priv.flags &= ~HFL_SEND_BUFFERED;
+    free(conn->priv.recv_buf);
+    conn->priv.recv_buf = NULL;
+    conn->priv.recv_pos = 0;
+    conn->priv.recv_len = 0;
+#if CONFIG_CWHTTPD_GZIP
+    compress_end(conn);
+#endif
+}
+
+static bool dispatch(cwhttpd_conn_t *conn)
+{
+    size_t route_pos = 0;
+
+    while (true) {
+        /* the handler runs with its route pinned rather than in the reader
+         * section, so a long request doesn't hold back retired tables */
+        cwhttpd_route_t *pinned;
+        conn->route = router_resolve(conn->inst->router,
+                conn->request.hostname, conn->request.method,
+                conn->request.url, &route_pos, conn->priv.route_params,
+                &pinned);
+        if (conn->route == NULL) {
+            conn->route = &route_404;
+        }
+        bool last = conn->route == &route_404;
+
+        cwhttpd_status_t status;
+more:
+        /* a client waiting for 100 Continue is left alone until the handler
+         * asks for the body */
+        if (!(conn->priv.flags & HFL_EXPECT_CONTINUE) && !post_read(conn)) {
+            status = CWHTTPD_STATUS_FAIL;
+        } else {
+            status = conn->route->handler(conn);
+        }
+        if (status == CWHTTPD_STATUS_MORE) {
+            if (cwhttpd_continue(conn) >= 0) {
+                goto more;
+            }
+            status = CWHTTPD_STATUS_FAIL;
+        }
+        router_route_put(pinned);
+        conn->route = NULL;
+
+        if ((status == CWHTTPD_STATUS_NOTFOUND) ||
+                (status == CWHTTPD_STATUS_AUTHENTICATED)) {
+            if (last) {
+                break;
+            }
+        } else if (status == CWHTTPD_STATUS_DONE) {
+            break;
+        } else if (status == CWHTTPD_STATUS_CLOSE) {
+            conn->priv.flags |= HFL_CLOSE;
+            break;
+        } else if (status == CWHTTPD_STATUS_FAIL) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
 void cwhttpd_new_conn_cb(cwhttpd_conn_t *conn)
 {
     bool first_request = true;
 
     do {
         if (!first_request) {
-            if (conn->post) {
-                free(conn->post);
-            }
+            free_request(conn);
             if (!(conn->priv.flags & HFL_CLOSE)) {
                 cwhttpd_inst_t *inst = conn->inst;
                 memset(conn, 0, sizeof(*conn));
@@ -862,14 +1880,14 @@ void cwhttpd_new_conn_cb(cwhttpd_conn_t *conn)
         ssize_t len = cwhttpd_plat_recv(conn, conn->priv.req,
                 CONFIG_CWHTTPD_MAX_REQUEST_SIZE);
         if (len <= 0) {
-            return;
+            goto done;
         }
         conn->priv.req_len = len;
         conn->priv.data = my_strnstr(conn->priv.req, "\r\n\r\n",
                 conn->priv.req_len);
         if (conn->priv.data == NULL) {
             cwhttpd_response(conn, 400);
-            return;
+            goto done;
         }
 
         /* double terminate */
@@ -879,7 +1897,7 @@ void cwhttpd_new_conn_cb(cwhttpd_conn_t *conn)
 
         if (!parse_request(conn)) {
             cwhttpd_response(conn, 400);
-            return;
+            goto done;
         }
 
 #ifdef CONFIG_CWHTTPD_ENABLE_CORS
@@ -897,63 +1915,18 @@ void cwhttpd_new_conn_cb(cwhttpd_conn_t *conn)
 
         if (!parse_headers(conn)) {
             cwhttpd_response(conn, 500);
-            return;
+            goto done;
         }
 
-        const cwhttpd_route_t *route = conn->inst->route_head;
-        while (true) {
-            while (route != NULL) {
-                if ((strcmp(route->path, conn->request.url) == 0) ||
-                        ((route->path[strlen(route->path) - 1] == '*') &&
-                        (strncmp(route->path, conn->request.url,
-                                strlen(route->path) - 1) == 0))) {
-                    conn->route = route;
-                    break;
-                }
-                route = route->next;
-            }
-
-            if (route == NULL) {
-                conn->route = &route_404;
-            }
-
-more:
-            if (conn->post && conn->post->received < conn->post->len) {
-                ssize_t chunk;
-                if (conn->priv.req_len - (conn->priv.data -
-                        conn->priv.req) > 0) {
-                    chunk = MIN(conn->priv.req_len -
-                            (conn->priv.data - conn->priv.req),
-                            sizeof(conn->post->buf) - conn->post->buf_len);
-                    memcpy(conn->post->buf + conn->post->buf_len,
-                            conn->priv.data, chunk);
-                    conn->priv.data += chunk;
-                } else {
-                    chunk = cwhttpd_plat_recv(conn, conn->post->buf +
-                            conn->post->buf_len, MIN(conn->post->len,
-                            sizeof(conn->post->buf) - conn->post->buf_len));
-                    if (chunk < 0) {
-                        return;
-                    }
-                }
-                conn->post->buf_len += chunk;
-                conn->post->received += chunk;
-            }
+        if (!dispatch(conn)) {
+            goto done;
+        }
+        flush_buffer(conn);
 
-            cwhttpd_status_t status = conn->route->handler(conn);
-            if ((status == CWHTTPD_STATUS_NOTFOUND) ||
-                    (status == CWHTTPD_STATUS_AUTHENTICATED)) {
-                route = route->next;
-            } else if (status == CWHTTPD_STATUS_MORE) {
-                goto more;
-            } else if (status == CWHTTPD_STATUS_DONE) {
-                break;
-            } else if (status == CWHTTPD_STATUS_CLOSE) {
-                conn->priv.flags |= HFL_CLOSE;
-                break;
-            } else if (status == CWHTTPD_STATUS_FAIL) {
-                return;
-            }
+        /* the body still held back by the client can't be skipped */
+        if ((conn->priv.flags & HFL_EXPECT_CONTINUE) &&
+                conn->post->received < conn->post->len) {
+            conn->priv.flags |= HFL_CLOSE;
         }
 
         if (conn->priv.flags & HFL_SEND_CHUNKED) {
@@ -971,4 +1944,7 @@ more:
             }
         }
     } while (!(conn->priv.flags & HFL_CLOSE));
+
+done:
+    free_request(conn);
 }
@@ -6,7 +6,7 @@
 #if defined(ESP_PLATFORM)
 # include <freertos/FreeRTOS.h>
 #else
-# define configAssert()
+# define configASSERT(x)
 #endif
 
 
@@ -0,0 +1,312 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "log.h"
+#include "mime.h"
+#include "cwhttpd/httpd.h"
+#include "cwhttpd/port.h"
+
+#include <ctype.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+
+/* Hash chains, a power of two */
+#define MIME_BUCKETS 128
+
+/* Type of files without a registered extension */
+#define MIME_DEFAULT "text/html"
+
+/* Entries are never freed or changed once they are in a chain, so lookups
+ * don't take the lock. Registering an extension again pushes a new entry in
+ * front of the old one and points the old one at it. */
+struct mime_entry_t {
+    mime_entry_t *_Atomic next; /**< next entry in the hash chain */
+    mime_entry_t *_Atomic replaced_by; /**< newer entry of the extension */
+    uint32_t hash; /**< hash of the lower case extension */
+    const char *ext; /**< extension without the dot */
+    const char *type; /**< mime type */
+};
+
+/* The mappings from file extensions to mime types known without a call to
+ * cwhttpd_mime_add(). tools/bundle.py keeps a copy of this table. */
+static mime_entry_t builtin_types[] = {
+    {.ext = "htm",         .type = "text/html"},
+    {.ext = "html",        .type = "text/html"},
+    {.ext = "css",         .type = "text/css"},
+    {.ext = "js",          .type = "text/javascript"},
+    {.ext = "mjs",         .type = "text/javascript"},
+    {.ext = "txt",         .type = "text/plain"},
+    {.ext = "csv",         .type = "text/csv"},
+    {.ext = "md",          .type = "text/markdown"},
+    {.ext = "xml",         .type = "text/xml"},
+    {.ext = "json",        .type = "application/json"},
+    {.ext = "map",         .type = "application/json"},
+    {.ext = "webmanifest", .type = "application/manifest+json"},
+    {.ext = "wasm",        .type = "application/wasm"},
+    {.ext = "pdf",         .type = "application/pdf"},
+    {.ext = "zip",         .type = "application/zip"},
+    {.ext = "gz",          .type = "application/gzip"},
+    {.ext = "tar",         .type = "application/x-tar"},
+    {.ext = "bin",         .type = "application/octet-stream"},
+    {.ext = "jpg",         .type = "image/jpeg"},
+    {.ext = "jpeg",        .type = "image/jpeg"},
+    {.ext = "png",         .type = "image/png"},
+    {.ext = "gif",         .type = "image/gif"},
+    {.ext = "svg",         .type = "image/svg+xml"},
+    {.ext = "ico",         .type = "image/x-icon"},
+    {.ext = "webp",        .type = "image/webp"},
+    {.ext = "avif",        .type = "image/avif"},
+    {.ext = "bmp",         .type = "image/bmp"},
+    {.ext = "woff",        .type = "font/woff"},
+    {.ext = "woff2",       .type = "font/woff2"},
+    {.ext = "ttf",         .type = "font/ttf"},
+    {.ext = "otf",         .type = "font/otf"},
+    {.ext = "mp3",         .type = "audio/mpeg"},
+    {.ext = "ogg",         .type = "audio/ogg"},
+    {.ext = "wav",         .type = "audio/wav"},
+    {.ext = "mp4",         .type = "video/mp4"},
+    {.ext = "webm",        .type = "video/webm"},
+};
+
+static mime_entry_t *_Atomic buckets[MIME_BUCKETS];
+
+/* Serializes additions, lookups only wait for the builtin types */
+static cwhttpd_mutex_t *_Atomic lock;
+static atomic_bool ready;
+
+
+static uint32_t ext_hash(const char *ext, size_t len)
+{
+    uint32_t hash = 2166136261;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint8_t) tolower((unsigned char) ext[i]);
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+/* The mutex is made on first use, false if that fails */
+static bool registry_lock(void)
+{
+    cwhttpd_mutex_t *mutex = atomic_load(&lock);
+    if (mutex == NULL) {
+        cwhttpd_mutex_t *created = cwhttpd_mutex_create(false);
+        if (created == NULL) {
+            LOGE(__func__, "cwhttpd_mutex_create failed");
+            return false;
+        }
+        if (atomic_compare_exchange_strong(&lock, &mutex, created)) {
+            mutex = created;
+        } else {
+            cwhttpd_mutex_delete(created);
+        }
+    }
+    cwhttpd_mutex_lock(mutex);
+    return true;
+}
+
+static void registry_unlock(void)
+{
+    cwhttpd_mutex_unlock(atomic_load(&lock));
+}
+
+/* The first match in a chain is the newest entry of an extension */
+static mime_entry_t *find(const char *ext, size_t len)
+{
+    uint32_t hash = ext_hash(ext, len);
+    mime_entry_t *entry = atomic_load(&buckets[hash & (MIME_BUCKETS - 1)]);
+    while (entry != NULL) {
+        if (entry->hash == hash && strncasecmp(entry->ext, ext, len) == 0 &&
+                entry->ext[len] == '\0') {
+            return entry;
+        }
+        entry = atomic_load(&entry->next);
+    }
+    return NULL;
+}
+
+/* Expects the registry to be locked */
+static void insert(mime_entry_t *entry)
+{
+    size_t len = strlen(entry->ext);
+    mime_entry_t *old = find(entry->ext, len);
+    mime_entry_t *_Atomic *bucket;
+
+    entry->hash = ext_hash(entry->ext, len);
+    bucket = &buckets[entry->hash & (MIME_BUCKETS - 1)];
+    atomic_init(&entry->replaced_by, NULL);
+    atomic_init(&entry->next, atomic_load(bucket));
+    atomic_store(bucket, entry);
+    if (old != NULL) {
+        atomic_store(&old->replaced_by, entry);
+    }
+}
+
+static void load_builtins(void)
+{
+    if (atomic_load(&ready)) {
+        return;
+    }
+
+    if (!registry_lock()) {
+        return;
+    }
+    if (!atomic_load(&ready)) {
+        for (size_t i = 0; i < sizeof(builtin_types) /
+                sizeof(builtin_types[0]); i++) {
+            insert(&builtin_types[i]);
+        }
+        atomic_store(&ready, true);
+    }
+    registry_unlock();
+}
+
+/* Extension of the last path segment, NULL if it has none */
+static const char *path_ext(const char *path, size_t *len)
+{
+    const char *end = path + strlen(path);
+    const char *p = end;
+    while (p != path && p[-1] != '.' && p[-1] != '/') {
+        p--;
+    }
+    if (p == path || p[-1] != '.') {
+        return NULL;
+    }
+    *len = end - p;
+    return p;
+}
+
+const char *mime_resolve(mime_slot_t *slot, const char *path)
+{
+    const mime_entry_t *entry = slot ? atomic_load(slot) : NULL;
+
+    if (entry != NULL) {
+        const mime_entry_t *newer;
+        while ((newer = atomic_load(&entry->replaced_by)) != NULL) {
+            entry = newer;
+            atomic_store(slot, entry);
+        }
+        return entry->type;
+    }
+
+    load_builtins();
+    size_t len;
+    const char *ext = path_ext(path, &len);
+    if (ext != NULL) {
+        entry = find(ext, len);
+    }
+    if (entry == NULL) {
+        return MIME_DEFAULT;
+    }
+    if (slot != NULL) {
+        atomic_store(slot, entry);
+    }
+    return entry->type;
+}
+
+const char *cwhttpd_get_mimetype(const char *url)
+{
+    return mime_resolve(NULL, url);
+}
+
+bool cwhttpd_mime_add(const char *ext, const char *mimetype)
+{
+    if (*ext == '.') {
+        ext++;
+    }
+    if (*ext == '\0' || strchr(ext, '/') || strchr(ext, '.') ||
+            *mimetype == '\0') {
+        LOGE(__func__, "invalid mapping %s %s", ext, mimetype);
+        return false;
+    }
+
+    load_builtins();
+
+    /* one block for the entry and its strings */
+    size_t ext_len = strlen(ext);
+    size_t type_len = strlen(mimetype);
+    mime_entry_t *entry = malloc(sizeof(mime_entry_t) + ext_len + type_len +
+            2);
+    if (entry == NULL) {
+        LOGE(__func__, "malloc failed");
+        return false;
+    }
+    char *p = (char *) (entry + 1);
+    memcpy(p, ext, ext_len + 1);
+    entry->ext = p;
+    p += ext_len + 1;
+    memcpy(p, mimetype, type_len + 1);
+    entry->type = p;
+
+    /* the check is under the lock, so racing additions insert only once */
+    if (!registry_lock()) {
+        free(entry);
+        return false;
+    }
+    mime_entry_t *old = find(ext, ext_len);
+    if (old != NULL && strcmp(old->type, mimetype) == 0) {
+        registry_unlock();
+        free(entry);
+        return true;
+    }
+    insert(entry);
+    registry_unlock();
+    return true;
+}
+
+ssize_t cwhttpd_mime_load(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        LOGE(__func__, "unable to open %s", path);
+        return -1;
+    }
+
+    char line[512];
+    size_t lineno = 0;
+    ssize_t count = 0;
+    while (fgets(line, sizeof(line), f)) {
+        lineno++;
+        if (strchr(line, '\n') == NULL && !feof(f)) {
+            LOGW(__func__, "%s:%zu: line too long", path, lineno);
+            int c;
+            while ((c = fgetc(f)) != EOF && c != '\n') {
+            }
+            continue;
+        }
+
+        char *comment = strchr(line, '#');
+        if (comment != NULL) {
+            *comment = '\0';
+        }
+
+        /* a type followed by its extensions, types without any are fine */
+        char *save;
+        const char *type = strtok_r(line, " \t\r\n", &save);
+        if (type == NULL) {
+            continue;
+        }
+        const char *ext;
+        while ((ext = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+            if (strchr(ext, '.')) {
+                /* only the part after the last dot is ever looked up */
+                continue;
+            }
+            if (cwhttpd_mime_add(ext, type)) {
+                count++;
+            } else {
+                LOGW(__func__, "%s:%zu: %s ignored", path, lineno, ext);
+            }
+        }
+    }
+
+    fclose(f);
+    return count;
+}
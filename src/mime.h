@@ -0,0 +1,27 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <stdatomic.h>
+
+
+typedef struct mime_entry_t mime_entry_t;
+
+/* Slot remembering the registry entry a path resolved to */
+typedef const mime_entry_t *_Atomic mime_slot_t;
+
+/**
+ * \brief Resolve the mime type of a path through a per-path slot
+ *
+ * The first call looks the extension up and fills the slot, later calls
+ * only check that the entry hasn't been replaced by cwhttpd_mime_add().
+ * Paths without a registered extension are looked up every time.
+ *
+ * \return mime type string
+ */
+const char *mime_resolve(
+    mime_slot_t *slot, /** [in] slot initialized to NULL, can be NULL */
+    const char *path /** [in] filesystem path or URL */
+);
@@ -6,8 +6,18 @@
 /* Copyright 2017 Chris Morgan <chmorgan@gmail.com> */
 /* Copyright 2021 Jeff Kent <jeff@jkent.net> */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+# define _GNU_SOURCE /* splice() */
+#endif
+
 #include "cb.h"
+#include "compress.h"
+#include "fs_cache.h"
+#include "fs_watch.h"
 #include "log.h"
+#include "router.h"
+#include "stat_cache.h"
+#include "tpl_cache.h"
 #include "cwhttpd/httpd.h"
 #include "cwhttpd/port.h"
 
@@ -24,12 +34,17 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #if defined(ESP_PLATFORM)
 # include <lwip/sockets.h>
 #endif /* defined(ESP_PLATFORM) */
 
+#if defined(__linux__)
+# include <sys/sendfile.h>
+#endif /* defined(__linux__) */
+
 #if defined(CONFIG_CWHTTPD_MBEDTLS)
 # include <mbedtls/platform.h>
 # include <mbedtls/entropy.h>
@@ -67,10 +82,6 @@
 # define CONFIG_CWHTTPD_WORKER_AFFINITY 0
 #endif
 
-#ifndef CONFIG_CWHTTPD_WORKER_COUNT
-# define CONFIG_CWHTTPD_WORKER_COUNT 8
-#endif
-
 #ifndef CONFIG_CWHTTPD_LISTENER_BACKLOG
 # define CONFIG_CWHTTPD_LISTENER_BACKLOG 2
 #endif
@@ -123,6 +134,10 @@ struct posix_inst_t {
 
     cwhttpd_semaphore_t *shutdown;
 
+#if CONFIG_CWHTTPD_FS_WATCH
+    fs_watch_t *watch;
+#endif /* CONFIG_CWHTTPD_FS_WATCH */
+
 #if defined(CONFIG_CWHTTPD_MBEDTLS)
     SSL_CTX *ssl;
 #endif /* defined(CONFIG_CWHTTPD_MBEDTLS) */
@@ -161,9 +176,16 @@ void cwhttpd_destroy(cwhttpd_inst_t *inst)
     }
 #endif /* defined(CONFIG_CWHTTPD_MBEDTLS) */
 
-    while (pinst->inst.route_head) {
-        cwhttpd_route_remove(&pinst->inst, 0);
-    }
+    router_destroy(pinst->inst.router);
+    fs_cache_destroy(pinst->inst.fs_cache);
+    stat_cache_destroy(pinst->inst.stat_cache);
+    tpl_cache_destroy(pinst->inst.tpl_cache);
+#if CONFIG_CWHTTPD_GZIP
+    compress_pool_destroy(pinst->inst.compress);
+#endif /* CONFIG_CWHTTPD_GZIP */
+#if CONFIG_CWHTTPD_FS_WATCH
+    fs_watch_destroy(pinst->watch);
+#endif /* CONFIG_CWHTTPD_FS_WATCH */
 
     cwhttpd_semaphore_delete(pinst->conn_empty);
     cwhttpd_semaphore_delete(pinst->conn_full);
@@ -185,6 +207,51 @@ cwhttpd_inst_t *cwhttpd_init(const char *addr, cwhttpd_flags_t flags)
 
     pinst->flags = flags;
 
+    pinst->inst.router = router_create();
+    if (pinst->inst.router == NULL) {
+        LOGE(__func__, "router_create");
+        free(pinst);
+        return NULL;
+    }
+
+#if CONFIG_CWHTTPD_FS_CACHE_SIZE > 0
+    pinst->inst.fs_cache = fs_cache_create(CONFIG_CWHTTPD_FS_CACHE_SIZE,
+            CONFIG_CWHTTPD_FS_CACHE_MAX_FILE);
+    if (pinst->inst.fs_cache == NULL) {
+        LOGW(__func__, "file content cache disabled");
+    }
+#endif /* CONFIG_CWHTTPD_FS_CACHE_SIZE > 0 */
+
+#if CONFIG_CWHTTPD_STAT_CACHE_SIZE > 0
+    fs_watch_t *watch = NULL;
+# if CONFIG_CWHTTPD_FS_WATCH
+    pinst->watch = fs_watch_create(&pinst->inst);
+    if (pinst->watch == NULL) {
+        LOGW(__func__, "file change notification disabled");
+    }
+    watch = pinst->watch;
+# endif /* CONFIG_CWHTTPD_FS_WATCH */
+    pinst->inst.stat_cache = stat_cache_create(
+            CONFIG_CWHTTPD_STAT_CACHE_SIZE, watch);
+    if (pinst->inst.stat_cache == NULL) {
+        LOGW(__func__, "file metadata cache disabled");
+    }
+#endif /* CONFIG_CWHTTPD_STAT_CACHE_SIZE > 0 */
+
+#if CONFIG_CWHTTPD_TPL_CACHE_SIZE > 0
+    pinst->inst.tpl_cache = tpl_cache_create(CONFIG_CWHTTPD_TPL_CACHE_SIZE);
+    if (pinst->inst.tpl_cache == NULL) {
+        LOGW(__func__, "template cache disabled");
+    }
+#endif /* CONFIG_CWHTTPD_TPL_CACHE_SIZE > 0 */
+
+#if CONFIG_CWHTTPD_GZIP
+    pinst->inst.compress = compress_pool_create();
+    if (pinst->inst.compress == NULL) {
+        LOGW(__func__, "response compression disabled");
+    }
+#endif /* CONFIG_CWHTTPD_GZIP */
+
 #if !defined(CONFIG_CWHTTPD_MBEDTLS)
     if (pinst->flags & CWHTTPD_FLAG_TLS) {
         LOGW(__func__, "TLS support not enabled in");
@@ -385,15 +452,26 @@ ssize_t cwhttpd_plat_send(cwhttpd_conn_t *conn, const void *buf, size_t len)
 #if defined(CONFIG_CWHTTPD_MBEDTLS)
     posix_inst_t *pinst = inst_to_pinst(conn->inst);
     if (pinst->flags & CWHTTPD_FLAG_TLS) {
-        ret = mbedtls_ssl_write(&pconn->ssl, buf, len);
-        if (ret < 0) {
-            pconn->error = true;
-            if (ret == MBEDTLS_ERR_NET_CONN_RESET) {
-                LOGW(__func__, "connection reset by peer %p", pconn);
-            } else if (ret < 0) {
-                LOGE(__func__, "mbedtls_ssl_write %d", ret);
+        /* a record holds at most 16 KB, larger buffers take several */
+        size_t total = 0;
+        while (total < len) {
+            ret = mbedtls_ssl_write(&pconn->ssl, (const uint8_t *) buf + total,
+                    len - total);
+            if (ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+                continue;
+            }
+            if (ret < 0) {
+                pconn->error = true;
+                if (ret == MBEDTLS_ERR_NET_CONN_RESET) {
+                    LOGW(__func__, "connection reset by peer %p", pconn);
+                } else {
+                    LOGE(__func__, "mbedtls_ssl_write %d", ret);
+                }
+                return ret;
             }
+            total += ret;
         }
+        ret = total;
     } else
 #endif /* defined(CONFIG_CWHTTPD_MBEDTLS) */
     {
@@ -414,6 +492,210 @@ ssize_t cwhttpd_plat_send(cwhttpd_conn_t *conn, const void *buf, size_t len)
     return ret;
 }
 
+ssize_t cwhttpd_plat_sendv(cwhttpd_conn_t *conn, const struct iovec *iov,
+        int iovcnt)
+{
+    ssize_t ret = 0;
+    posix_conn_t *pconn = conn_to_pconn(conn);
+
+#if defined(CONFIG_CWHTTPD_MBEDTLS)
+    posix_inst_t *pinst = inst_to_pinst(conn->inst);
+    if (pinst->flags & CWHTTPD_FLAG_TLS) {
+        /* records are framed per write anyway */
+        for (int i = 0; i < iovcnt; i++) {
+            ssize_t n = cwhttpd_plat_send(conn, iov[i].iov_base,
+                    iov[i].iov_len);
+            if (n < 0) {
+                return n;
+            }
+            ret += n;
+        }
+        return ret;
+    }
+#endif /* defined(CONFIG_CWHTTPD_MBEDTLS) */
+
+    ret = writev(pconn->conn_data.fd, iov, iovcnt);
+    if (ret < 0) {
+        pconn->error = true;
+        if (errno == ECONNRESET) {
+            LOGW(__func__, "connection reset by peer %p", pconn);
+            return ret;
+        } else if (errno == EPIPE) {
+            LOGW(__func__, "broken pipe %p", pconn);
+            return ret;
+        }
+        LOGE(__func__, "writev %d", errno);
+    }
+
+    return ret;
+}
+
+ssize_t cwhttpd_plat_sendfile(cwhttpd_conn_t *conn, int fd, off_t offset,
+        size_t len)
+{
+    posix_conn_t *pconn = conn_to_pconn(conn);
+    size_t total = 0;
+
+#if defined(__linux__)
+    posix_inst_t *pinst = inst_to_pinst(conn->inst);
+    while (!(pinst->flags & CWHTTPD_FLAG_TLS) && total < len) {
+        ssize_t ret = sendfile(pconn->conn_data.fd, fd, &offset,
+                len - total);
+        if (ret < 0 && total == 0 && (errno == EINVAL || errno == ENOSYS)) {
+            /* not supported for this file, read it instead */
+            break;
+        }
+        if (ret < 0) {
+            pconn->error = true;
+            if (errno == ECONNRESET) {
+                LOGW(__func__, "connection reset by peer %p", pconn);
+            } else if (errno == EPIPE) {
+                LOGW(__func__, "broken pipe %p", pconn);
+            } else {
+                LOGE(__func__, "sendfile %d", errno);
+            }
+            return ret;
+        }
+        if (ret == 0) {
+            LOGE(__func__, "file truncated");
+            pconn->error = true;
+            return -1;
+        }
+        total += ret;
+    }
+    if (total == len) {
+        return total;
+    }
+#endif /* defined(__linux__) */
+
+#if !defined(__linux__)
+    if (lseek(fd, offset, SEEK_SET) < 0) {
+        LOGE(__func__, "lseek %d", errno);
+        pconn->error = true;
+        return -1;
+    }
+#endif /* !defined(__linux__) */
+
+    char buf[1024];
+    while (total < len) {
+        size_t n = len - total < sizeof(buf) ? len - total : sizeof(buf);
+#if defined(__linux__)
+        /* the descriptor may be shared through the stat cache */
+        ssize_t ret = pread(fd, buf, n, offset + total);
+#else
+        ssize_t ret = read(fd, buf, n);
+#endif /* defined(__linux__) */
+        if (ret <= 0) {
+            LOGE(__func__, "read %d", ret < 0 ? errno : 0);
+            pconn->error = true;
+            return -1;
+        }
+        ret = cwhttpd_plat_send(conn, buf, ret);
+        if (ret < 0) {
+            return ret;
+        }
+        total += ret;
+    }
+
+    return total;
+}
+
+ssize_t cwhttpd_plat_recvfile(cwhttpd_conn_t *conn, int fd, off_t offset,
+        size_t len)
+{
+    posix_conn_t *pconn = conn_to_pconn(conn);
+    size_t total = 0;
+
+    if (cwhttpd_continue(conn) < 0) {
+        return -1;
+    }
+
+#if defined(__linux__)
+    /* the socket is moved to the file through a pipe, without copies */
+    posix_inst_t *pinst = inst_to_pinst(conn->inst);
+    int pipefd[2];
+    if (!(pinst->flags & CWHTTPD_FLAG_TLS) &&
+            pipe2(pipefd, O_CLOEXEC) == 0) {
+        /* a larger pipe means fewer trips, the default holds 64 KiB */
+        int size = fcntl(pipefd[1], F_SETPIPE_SZ, 1024 * 1024);
+        size_t pipe_size = size > 0 ? size : 65536;
+        while (total < len) {
+            size_t n = len - total < pipe_size ? len - total : pipe_size;
+            ssize_t ret = splice(pconn->conn_data.fd, NULL, pipefd[1], NULL,
+                    n, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (ret < 0 && total == 0 && errno == EINVAL) {
+                /* not supported for this file, copy it instead */
+                break;
+            }
+            if (ret <= 0) {
+                pconn->error = true;
+                if (ret == 0) {
+                    LOGW(__func__, "connection closed %p", pconn);
+                } else if (errno == ECONNRESET) {
+                    LOGW(__func__, "connection reset by peer %p", pconn);
+                } else {
+                    LOGE(__func__, "splice %d", errno);
+                }
+                close(pipefd[0]);
+                close(pipefd[1]);
+                return -1;
+            }
+            while (ret > 0) {
+                ssize_t written = splice(pipefd[0], NULL, fd, &offset, ret,
+                        SPLICE_F_MOVE | SPLICE_F_MORE);
+                if (written <= 0) {
+                    LOGE(__func__, "splice %d", written < 0 ? errno : 0);
+                    pconn->error = true;
+                    close(pipefd[0]);
+                    close(pipefd[1]);
+                    return -1;
+                }
+                ret -= written;
+                total += written;
+            }
+        }
+        close(pipefd[0]);
+        close(pipefd[1]);
+        if (total == len) {
+            return total;
+        }
+    }
+#else
+    if (lseek(fd, offset, SEEK_SET) < 0) {
+        LOGE(__func__, "lseek %d", errno);
+        pconn->error = true;
+        return -1;
+    }
+#endif /* defined(__linux__) */
+
+    char buf[1024];
+    while (total < len) {
+        size_t n = len - total < sizeof(buf) ? len - total : sizeof(buf);
+        ssize_t ret = cwhttpd_plat_recv(conn, buf, n);
+        if (ret <= 0) {
+            pconn->error = true;
+            return -1;
+        }
+        for (ssize_t done = 0; done < ret;) {
+#if defined(__linux__)
+            ssize_t written = pwrite(fd, buf + done, ret - done,
+                    offset + total + done);
+#else
+            ssize_t written = write(fd, buf + done, ret - done);
+#endif /* defined(__linux__) */
+            if (written <= 0) {
+                LOGE(__func__, "write %d", written < 0 ? errno : 0);
+                pconn->error = true;
+                return -1;
+            }
+            done += written;
+        }
+        total += ret;
+    }
+
+    return total;
+}
+
 ssize_t cwhttpd_plat_recv(cwhttpd_conn_t *conn, void *buf, size_t len)
 {
     posix_conn_t *pconn = conn_to_pconn(conn);
@@ -501,8 +783,27 @@ static void listener_task(void *arg)
 
         FD_ZERO(&read_set);
         FD_SET(pinst->listen_fd, &read_set);
-        if (select(pinst->listen_fd + 1, &read_set, NULL, NULL,
-                &timeout) <= 0) {
+        int max_fd = pinst->listen_fd;
+#if CONFIG_CWHTTPD_FS_WATCH
+        /* file changes are picked up here between accepts */
+        if (pinst->watch != NULL) {
+            int watch_fd = fs_watch_fd(pinst->watch);
+            FD_SET(watch_fd, &read_set);
+            if (watch_fd > max_fd) {
+                max_fd = watch_fd;
+            }
+        }
+#endif /* CONFIG_CWHTTPD_FS_WATCH */
+        if (select(max_fd + 1, &read_set, NULL, NULL, &timeout) <= 0) {
+            continue;
+        }
+#if CONFIG_CWHTTPD_FS_WATCH
+        if (pinst->watch != NULL &&
+                FD_ISSET(fs_watch_fd(pinst->watch), &read_set)) {
+            fs_watch_process(pinst->watch);
+        }
+#endif /* CONFIG_CWHTTPD_FS_WATCH */
+        if (!FD_ISSET(pinst->listen_fd, &read_set)) {
             continue;
         }
 
@@ -510,6 +811,12 @@ static void listener_task(void *arg)
             if (cwhttpd_semaphore_take(pinst->conn_empty, 250)) {
                 break;
             }
+#if CONFIG_CWHTTPD_FS_WATCH
+            /* keep up with changes while all workers are busy */
+            if (pinst->watch != NULL) {
+                fs_watch_process(pinst->watch);
+            }
+#endif /* CONFIG_CWHTTPD_FS_WATCH */
         }
         if (pinst->shutdown) {
             cwhttpd_semaphore_give(pinst->conn_empty);
@@ -50,6 +50,11 @@ void cwhttpd_delay_ms(uint32_t ms)
     vTaskDelay(pdMS_TO_TICKS(ms));
 }
 
+uint32_t cwhttpd_time_ms(void)
+{
+    return xTaskGetTickCount() * portTICK_PERIOD_MS;
+}
+
 #if defined(UNIX)
 long long cwhttpd_log_timestamp(void)
 {
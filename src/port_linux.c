@@ -23,6 +23,13 @@ void cwhttpd_delay_ms(uint32_t ms)
     usleep(ms * 1000);
 }
 
+uint32_t cwhttpd_time_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 long long cwhttpd_log_timestamp(void)
 {
     struct timeval te;
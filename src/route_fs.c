@@ -2,15 +2,31 @@
  * License, v. 2.0. If a copy of the MPL was not distributed with this
  * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+# define _GNU_SOURCE /* fallocate() */
+#endif
+
 /*
 Route handlers to let httpd use the filesystem to serve the files in it.
 */
 
+#include "fs_cache.h"
 #include "log.h"
+#include "mime.h"
+#include "router.h"
+#include "stat_cache.h"
+#include "tpl_cache.h"
 #include "cwhttpd/route.h"
 #include "cwhttpd/httpd.h"
+#include "cwhttpd/port.h"
 
 #include <assert.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -18,6 +34,13 @@ Route handlers to let httpd use the filesystem to serve the files in it.
 #include <sys/stat.h>
 #include <sys/errno.h>
 
+#if defined(CONFIG_CWHTTPD_FROGFS)
+# include <frogfs/frogfs.h>
+# if !defined(ESP_PLATFORM)
+#  include <sys/mman.h>
+# endif
+#endif
+
 
 #define TRY(X) ({ \
     ssize_t n = X; \
@@ -30,29 +53,65 @@ Route handlers to let httpd use the filesystem to serve the files in it.
 
 #define FILE_CHUNK_LEN    (1024)
 #define MAX_FILENAME_LENGTH (256)
+#define ETAG_LEN (64)
+#define MAX_RANGES (8)
 
 #define ESPFS_FLAG_GZIP (1 << 1)
 
+/* Cached FrogFS ETags, a power of two */
+#define FROGFS_ETAG_SLOTS (64)
+
 #define F_REOPEN_RAW 1000
 
+typedef struct byte_range_t {
+    off_t first;
+    off_t last;
+} byte_range_t;
 
-static bool get_filepath(cwhttpd_conn_t *conn, char *path, size_t len,
-        struct stat *st, const char *index)
+
+/* Stat through the instance stat cache if there is one. The previous entry
+ * in *sce is put, the new one is left for the caller. */
+static bool path_stat(cwhttpd_conn_t *conn, const char *path,
+        struct stat *st, stat_cache_entry_t **sce)
+{
+    stat_cache_entry_put(*sce);
+    *sce = stat_cache_get(conn->inst->stat_cache, path);
+    if (*sce == NULL) {
+        return stat(path, st) == 0;
+    }
+    if ((*sce)->err != 0) {
+        return false;
+    }
+    *st = (*sce)->st;
+    return true;
+}
+
+/* Part of the URL that follows the literal part of the route path */
+static const char *url_remainder(cwhttpd_conn_t *conn)
 {
-    size_t out_len = 0;
     const char *url = conn->request.url;
-    const cwhttpd_route_t *route = conn->route;
-    const char *rpath = route->path;
+    const char *rpath = conn->route->path;
 
-    while (*rpath == *url) {
+    while (*url != '\0' && *rpath == *url) {
         rpath++;
         url++;
     }
     while (*url == '/') {
         url++;
     }
+    return url;
+}
+
+/* On success *sce holds the stat cache entry of path, or NULL */
+static bool get_filepath(cwhttpd_conn_t *conn, char *path, size_t len,
+        struct stat *st, const char *index, stat_cache_entry_t **sce)
+{
+    *sce = NULL;
+
+    size_t out_len = 0;
+    const char *url = url_remainder(conn);
+    const cwhttpd_route_t *route = conn->route;
 
-    out_len = 0;
     if (route->argc < 1) {
         out_len += strlcpy(path + out_len, url, len - out_len);
     } else {
@@ -65,15 +124,15 @@ static bool get_filepath(cwhttpd_conn_t *conn, char *path, size_t len,
         out_len += strlcpy(path + out_len, index, len - out_len);
     }
 
-    if (stat(path, st) != 0) {
-        return false;
+    if (!path_stat(conn, path, st, sce)) {
+        goto fail;
     }
 
     if (S_ISDIR(st->st_mode)) {
         out_len += strlcpy(path + out_len, "/", len - out_len);
         out_len += strlcpy(path + out_len, index, len - out_len);
-        if (stat(path, st) != 0) {
-            return false;
+        if (!path_stat(conn, path, st, sce)) {
+            goto fail;
         }
     }
 
@@ -81,9 +140,467 @@ static bool get_filepath(cwhttpd_conn_t *conn, char *path, size_t len,
         return true;
     }
 
+fail:
+    stat_cache_entry_put(*sce);
+    *sce = NULL;
+    return false;
+}
+
+/* Returns true if an entity tag is in an If-None-Match or If-Match list */
+static bool etag_match(const char *list, const char *etag, bool weak)
+{
+    size_t etag_len = strlen(etag);
+    const char *p = list;
+
+    while (*p != '\0') {
+        while (*p == ' ' || *p == '\t' || *p == ',') {
+            p++;
+        }
+        if (*p == '*') {
+            return true;
+        }
+        bool is_weak = false;
+        if (p[0] == 'W' && p[1] == '/') {
+            is_weak = true;
+            p += 2;
+        }
+        const char *end = p;
+        if (*p == '"') {
+            end = strchr(p + 1, '"');
+            if (end == NULL) {
+                return false;
+            }
+            end++;
+        } else {
+            while (*end != '\0' && *end != ',') {
+                end++;
+            }
+        }
+        if ((weak || !is_weak) && end - p == etag_len &&
+                memcmp(p, etag, etag_len) == 0) {
+            return true;
+        }
+        p = end;
+    }
+
     return false;
 }
 
+/* Strong validator from the inode, size and modification time, or from the
+ * content if the filesystem keeps no timestamps. The content hash is kept
+ * with the stat cache entry, so a revalidation doesn't read the file. */
+static bool file_etag(char *etag, const char *path, const struct stat *st,
+        stat_cache_entry_t *sce, bool deflate)
+{
+    const char *suffix = deflate ? "-deflate" : "";
+
+    if (st->st_mtime != 0) {
+        cwhttpd_snprintf(etag, ETAG_LEN, "\"%lx-%lx-%lx%s\"",
+                (unsigned long) st->st_ino, (unsigned long) st->st_size,
+                (unsigned long) st->st_mtime, suffix);
+        return true;
+    }
+
+    uint64_t hash;
+    if (sce == NULL || !stat_cache_entry_get_hash(sce, &hash)) {
+        FILE *f = fopen(path, "r");
+        if (f == NULL) {
+            return false;
+        }
+        uint64_t hash = UINT64_C(14695981039346656037);
+        uint8_t chunk[256];
+        size_t len;
+        while ((len = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+            for (size_t i = 0; i < len; i++) {
+                hash ^= chunk[i];
+                hash *= UINT64_C(1099511628211);
+            }
+        }
+        fclose(f);
+        if (sce != NULL) {
+            stat_cache_entry_set_hash(sce, hash);
+        }
+    }
+
+    cwhttpd_snprintf(etag, ETAG_LEN, "\"%08lx%08lx%s\"",
+            (unsigned long) (hash >> 32), (unsigned long) (hash & 0xFFFFFFFF),
+            suffix);
+    return true;
+}
+
+/* Header lines of a file response. The ETag and Cache-Control lines come
+ * first, as those are all a 304 response repeats, and Content-Type last, as
+ * multipart responses move it into the parts. */
+typedef struct file_headers_t {
+    char buf[384];
+    size_t len; /**< length of all lines, 0 if they didn't fit */
+    size_t cond_len; /**< length of the lines of a 304 response */
+    size_t meta_len; /**< length of the lines without Content-Type */
+} file_headers_t;
+
+static void file_headers(file_headers_t *h, const char *etag,
+        const struct stat *st, const char *mimetype, bool ranges,
+        const char *encoding, bool vary)
+{
+    const size_t len = sizeof(h->buf);
+    size_t n = cwhttpd_snprintf(h->buf, len, "ETag: %s\r\n", etag);
+    const char *cache_control = cwhttpd_cache_control(mimetype);
+    if (cache_control != NULL && n < len) {
+        n += cwhttpd_snprintf(h->buf + n, len - n, "Cache-Control: %s\r\n",
+                cache_control);
+    }
+    if (vary && n < len) {
+        n += cwhttpd_snprintf(h->buf + n, len - n,
+                "Vary: Accept-Encoding\r\n");
+    }
+    h->cond_len = n;
+    if (st->st_mtime != 0 && n < len) {
+        char date[CWHTTPD_DATE_LEN];
+        cwhttpd_format_date(date, st->st_mtime);
+        n += cwhttpd_snprintf(h->buf + n, len - n, "Last-Modified: %s\r\n",
+                date);
+    }
+    if (ranges && n < len) {
+        n += cwhttpd_snprintf(h->buf + n, len - n, "Accept-Ranges: bytes\r\n");
+    }
+    h->meta_len = n;
+    if (mimetype != NULL && n < len) {
+        n += cwhttpd_snprintf(h->buf + n, len - n, "Content-Type: %s\r\n",
+                mimetype);
+    }
+    if (encoding != NULL && n < len) {
+        n += cwhttpd_snprintf(h->buf + n, len - n,
+                "Content-Encoding: %s\r\n", encoding);
+    }
+    h->len = n < len ? n : 0;
+}
+
+/* Append a line to the headers, returns false if it doesn't fit */
+static bool file_headers_add(file_headers_t *h, size_t at, const char *fmt,
+        ...)
+{
+    va_list va;
+    va_start(va, fmt);
+    size_t n = cwhttpd_vsnprintf(h->buf + at, sizeof(h->buf) - at, fmt, va);
+    va_end(va);
+    if (at + n >= sizeof(h->buf)) {
+        return false;
+    }
+    h->len = at + n;
+    return true;
+}
+
+/* Evaluate If-None-Match, or If-Modified-Since in its absence */
+static bool not_modified(cwhttpd_conn_t *conn, const char *etag,
+        const struct stat *st)
+{
+    const char *header = cwhttpd_get_header(conn, "If-None-Match");
+    if (header != NULL) {
+        return etag_match(header, etag, true);
+    }
+
+    header = cwhttpd_get_header(conn, "If-Modified-Since");
+    time_t since;
+    if (header != NULL && st->st_mtime != 0 &&
+            cwhttpd_parse_date(header, &since)) {
+        return st->st_mtime <= since;
+    }
+
+    return false;
+}
+
+/* Evaluate If-Range, which needs a strong match to allow a partial response */
+static bool if_range(cwhttpd_conn_t *conn, const char *etag,
+        const struct stat *st)
+{
+    const char *header = cwhttpd_get_header(conn, "If-Range");
+    if (header == NULL) {
+        return true;
+    }
+    if (header[0] == '"' || header[0] == 'W') {
+        return etag_match(header, etag, false);
+    }
+
+    time_t date;
+    return st->st_mtime != 0 && cwhttpd_parse_date(header, &date) &&
+            date == st->st_mtime;
+}
+
+/* Parse a Range header into sorted, coalesced ranges. Returns the number of
+ * ranges, 0 if none is satisfiable, or -1 if the header is to be ignored. */
+static int parse_ranges(const char *header, off_t size, byte_range_t *ranges)
+{
+    if (strncmp(header, "bytes=", 6) != 0) {
+        return -1;
+    }
+
+    const char *p = header + 6;
+    unsigned long long usize = size;
+    int num_ranges = 0;
+    bool empty = true;
+    while (true) {
+        while (*p == ' ' || *p == '\t') {
+            p++;
+        }
+
+        unsigned long long first, last;
+        char *end;
+        if (*p == '-' && isdigit((unsigned char) p[1])) {
+            /* suffix range, the last N bytes */
+            unsigned long long suffix = strtoull(p + 1, &end, 10);
+            first = suffix < usize ? usize - suffix : 0;
+            last = usize - 1;
+            if (suffix == 0) {
+                first = usize;
+            }
+        } else if (isdigit((unsigned char) *p)) {
+            first = strtoull(p, &end, 10);
+            if (*end != '-') {
+                return -1;
+            }
+            p = end + 1;
+            if (isdigit((unsigned char) *p)) {
+                last = strtoull(p, &end, 10);
+                if (last < first) {
+                    return -1;
+                }
+            } else {
+                last = ULLONG_MAX;
+                end = (char *) p;
+            }
+        } else {
+            return -1;
+        }
+        empty = false;
+
+        if (first < usize) {
+            if (num_ranges == MAX_RANGES) {
+                return -1;
+            }
+            ranges[num_ranges].first = first;
+            ranges[num_ranges].last = last < usize ? last : usize - 1;
+            num_ranges++;
+        }
+
+        p = end;
+        while (*p == ' ' || *p == '\t') {
+            p++;
+        }
+        if (*p == '\0') {
+            break;
+        }
+        if (*p++ != ',') {
+            return -1;
+        }
+    }
+    if (empty) {
+        return -1;
+    }
+
+    /* sort by first byte, then merge overlapping and adjacent ranges */
+    for (int i = 1; i < num_ranges; i++) {
+        byte_range_t range = ranges[i];
+        int j = i;
+        while (j > 0 && ranges[j - 1].first > range.first) {
+            ranges[j] = ranges[j - 1];
+            j--;
+        }
+        ranges[j] = range;
+    }
+    int n = 0;
+    for (int i = 1; i < num_ranges; i++) {
+        if (ranges[i].first <= ranges[n].last + 1) {
+            if (ranges[i].last > ranges[n].last) {
+                ranges[n].last = ranges[i].last;
+            }
+        } else {
+            ranges[++n] = ranges[i];
+        }
+    }
+    return num_ranges > 0 ? n + 1 : 0;
+}
+
+/* Send a piece of the file, from the cache entry if there is one */
+static ssize_t send_slice(cwhttpd_conn_t *conn, const uint8_t *data,
+        int fd, off_t offset, size_t len)
+{
+    if (data != NULL) {
+        return cwhttpd_send(conn, data + offset, len);
+    }
+    return cwhttpd_sendfile(conn, fd, offset, len);
+}
+
+/* Send a multipart/byteranges response */
+static cwhttpd_status_t send_multipart(cwhttpd_conn_t *conn,
+        file_headers_t *h, const uint8_t *data, int fd, off_t size,
+        const char *mimetype, const byte_range_t *ranges, int num_ranges)
+{
+    static atomic_uint counter;
+    char boundary[20];
+    cwhttpd_snprintf(boundary, sizeof(boundary), "%08lx%08x",
+            (unsigned long) ((uintptr_t) conn & 0xFFFFFFFF),
+            atomic_fetch_add(&counter, 1));
+
+    char part[192];
+    const char *part_fmt = mimetype ?
+            "\r\n--%s\r\nContent-Type: %s\r\n"
+            "Content-Range: bytes %lu-%lu/%lu\r\n\r\n" :
+            "\r\n--%s\r\n%s"
+            "Content-Range: bytes %lu-%lu/%lu\r\n\r\n";
+
+    size_t content_length = 0;
+    for (int i = 0; i < num_ranges; i++) {
+        content_length += cwhttpd_snprintf(part, sizeof(part), part_fmt,
+                boundary, mimetype ? mimetype : "",
+                (unsigned long) ranges[i].first,
+                (unsigned long) ranges[i].last, (unsigned long) size);
+        content_length += ranges[i].last - ranges[i].first + 1;
+    }
+    content_length += cwhttpd_snprintf(part, sizeof(part), "\r\n--%s--\r\n",
+            boundary);
+
+    if (!file_headers_add(h, h->meta_len,
+            "Content-Type: multipart/byteranges; boundary=%s\r\n",
+            boundary)) {
+        return CWHTTPD_STATUS_FAIL;
+    }
+    if (cwhttpd_send_head(conn, 206, h->buf, h->len, content_length) < 0) {
+        return CWHTTPD_STATUS_FAIL;
+    }
+
+    for (int i = 0; i < num_ranges; i++) {
+        size_t n = cwhttpd_snprintf(part, sizeof(part), part_fmt, boundary,
+                mimetype ? mimetype : "", (unsigned long) ranges[i].first,
+                (unsigned long) ranges[i].last, (unsigned long) size);
+        if (cwhttpd_send(conn, part, n) < 0) {
+            return CWHTTPD_STATUS_FAIL;
+        }
+        if (send_slice(conn, data, fd, ranges[i].first,
+                ranges[i].last - ranges[i].first + 1) < 0) {
+            return CWHTTPD_STATUS_FAIL;
+        }
+    }
+    size_t n = cwhttpd_snprintf(part, sizeof(part), "\r\n--%s--\r\n",
+            boundary);
+    if (cwhttpd_send(conn, part, n) < 0) {
+        return CWHTTPD_STATUS_FAIL;
+    }
+
+    return CWHTTPD_STATUS_DONE;
+}
+
+/* Precompressed siblings of a file, most compact first */
+static const struct {
+    const char *suffix;
+    const char *name;
+    cwhttpd_encoding_t encoding;
+} sidecars[] = {
+    {".br", "br",   CWHTTPD_ENCODING_BR},
+    {".gz", "gzip", CWHTTPD_ENCODING_GZIP},
+};
+
+#define NUM_SIDECARS (sizeof(sidecars) / sizeof(sidecars[0]))
+
+/* Look for siblings no older than the file and switch path, st and sce over
+ * to the one the client prefers. Lookups go through the stat cache, so
+ * missing siblings cost nothing on later requests. Returns the coding, or
+ * NULL to serve the file itself. */
+static const char *select_sidecar(cwhttpd_conn_t *conn, char *path,
+        size_t len, struct stat *st, stat_cache_entry_t **sce, bool *vary)
+{
+    size_t path_len = strlen(path);
+    struct stat sidecar_st[NUM_SIDECARS];
+    stat_cache_entry_t *sidecar_sce[NUM_SIDECARS] = {NULL};
+    unsigned int available = 0;
+
+    for (size_t i = 0; i < NUM_SIDECARS; i++) {
+        if (path_len + strlen(sidecars[i].suffix) >= len) {
+            break;
+        }
+        strcpy(path + path_len, sidecars[i].suffix);
+        if (path_stat(conn, path, &sidecar_st[i], &sidecar_sce[i]) &&
+                S_ISREG(sidecar_st[i].st_mode) &&
+                sidecar_st[i].st_mtime >= st->st_mtime) {
+            available |= CWHTTPD_ENCODING_MASK(sidecars[i].encoding);
+        }
+    }
+    path[path_len] = '\0';
+
+    const char *name = NULL;
+    if (available != 0) {
+        /* the response depends on Accept-Encoding even if it's identity */
+        *vary = true;
+        cwhttpd_encoding_t encoding = cwhttpd_negotiate_encoding(conn,
+                available);
+        for (size_t i = 0; i < NUM_SIDECARS; i++) {
+            if (sidecars[i].encoding == encoding) {
+                strcpy(path + path_len, sidecars[i].suffix);
+                *st = sidecar_st[i];
+                stat_cache_entry_put(*sce);
+                *sce = sidecar_sce[i];
+                sidecar_sce[i] = NULL;
+                name = sidecars[i].name;
+                break;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < NUM_SIDECARS; i++) {
+        stat_cache_entry_put(sidecar_sce[i]);
+    }
+    return name;
+}
+
+/* Read a file into a new content cache entry, returns NULL if the file
+ * can't be cached */
+static fs_cache_entry_t *fs_cache_fill(cwhttpd_fs_cache_t *cache,
+        const char *path, int fd, const struct stat *st, const char *etag,
+        const char *mimetype, const char *headers, size_t headers_len)
+{
+    fs_cache_entry_t *entry = fs_cache_entry_alloc(cache, path, st, etag,
+            mimetype, headers, headers_len);
+    if (entry == NULL) {
+        return NULL;
+    }
+
+#if defined(STAT_CACHE_FDS)
+    /* the descriptor is the file st describes */
+    if (fd >= 0) {
+        size_t len = 0;
+        while (len < entry->body_len) {
+            ssize_t ret = pread(fd, entry->body + len, entry->body_len - len,
+                    len);
+            if (ret <= 0) {
+                break;
+            }
+            len += ret;
+        }
+        if (len != entry->body_len) {
+            fs_cache_entry_put(entry);
+            return NULL;
+        }
+        fs_cache_insert(cache, entry);
+        return entry;
+    }
+#endif /* defined(STAT_CACHE_FDS) */
+
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        fs_cache_entry_put(entry);
+        return NULL;
+    }
+    size_t len = fread(entry->body, 1, entry->body_len, f);
+    fclose(f);
+    if (len != entry->body_len) {
+        /* changed while reading */
+        fs_cache_entry_put(entry);
+        return NULL;
+    }
+
+    fs_cache_insert(cache, entry);
+    return entry;
+}
+
 cwhttpd_status_t cwhttpd_route_fs_get(cwhttpd_conn_t *conn)
 {
     cwhttpd_status_t r = CWHTTPD_STATUS_DONE;
@@ -93,10 +610,10 @@ cwhttpd_status_t cwhttpd_route_fs_get(cwhttpd_conn_t *conn)
         return CWHTTPD_STATUS_NOTFOUND;
     }
 
-    /* We can use buf here because its not needed until reading data */
-    char buf[FILE_CHUNK_LEN];
+    char path[MAX_FILENAME_LENGTH];
     struct stat st;
-    if (!get_filepath(conn, buf, sizeof(buf), &st, "index.html")) {
+    stat_cache_entry_t *sce;
+    if (!get_filepath(conn, path, sizeof(path), &st, "index.html", &sce)) {
         return CWHTTPD_STATUS_NOTFOUND;
     }
 
@@ -108,83 +625,524 @@ cwhttpd_status_t cwhttpd_route_fs_get(cwhttpd_conn_t *conn)
         }
     }
 #endif
-
-    const char *mimetype = cwhttpd_get_mimetype(buf);
-
-    FILE *f = fopen(buf, "r");
-    if (f == NULL) {
-        return CWHTTPD_STATUS_NOTFOUND;
-    }
+    bool vary = deflate_compression;
 
     if (deflate_compression) {
         /* Check the request Accept-Encoding header for deflate. Reopen raw
          * if present */
         const char *header = cwhttpd_get_header(conn, "Accept-Encoding");
-        if (header && strstr(header, "deflate") == NULL) {
+        if (header && cwhttpd_negotiate_encoding(conn,
+                CWHTTPD_ENCODING_MASK(CWHTTPD_ENCODING_DEFLATE)) !=
+                CWHTTPD_ENCODING_DEFLATE) {
             deflate_compression = false;
         }
     }
-    if (deflate_compression && fcntl(fileno(f), F_REOPEN_RAW) != 0) {
-        deflate_compression = false;
+
+    /* The type is resolved once per stat cache entry */
+    const char *mimetype = mime_resolve(sce ? &sce->mime : NULL, path);
+
+    const char *encoding = NULL;
+    if (!vary && cwhttpd_mime_compressible(mimetype)) {
+        encoding = select_sidecar(conn, path, sizeof(path), &st, &sce, &vary);
+    }
+
+    /* Only the inflated content is cached */
+    cwhttpd_fs_cache_t *cache = conn->inst->fs_cache;
+    fs_cache_entry_t *entry = NULL;
+    if (!deflate_compression) {
+        entry = fs_cache_lookup(cache, path, &st);
+    }
+    if (entry != NULL && entry->mimetype != mimetype) {
+        /* the extension was mapped to another type since */
+        fs_cache_invalidate(cache, path);
+        fs_cache_entry_put(entry);
+        entry = NULL;
+    }
+
+    char etag[ETAG_LEN];
+    if (entry != NULL) {
+        strlcpy(etag, entry->etag, sizeof(etag));
+    } else if (!file_etag(etag, path, &st, sce,
+            deflate_compression)) {
+        r = CWHTTPD_STATUS_NOTFOUND;
+        goto cleanup;
+    }
+
+    /* Ranges are only served from the inflated content */
+    file_headers_t h;
+    file_headers(&h, etag, &st, mimetype, !deflate_compression &&
+            encoding == NULL, encoding, vary);
+    if (h.len == 0) {
+        LOGE(__func__, "headers too long");
+        r = CWHTTPD_STATUS_FAIL;
+        goto cleanup;
+    }
+
+    /* A revalidation never touches the file content */
+    if (not_modified(conn, etag, &st)) {
+        if (cwhttpd_send_response(conn, 304, h.buf, h.cond_len, NULL, 0) < 0) {
+            r = CWHTTPD_STATUS_FAIL;
+        }
+        goto cleanup;
+    }
+
+    byte_range_t ranges[MAX_RANGES];
+    int num_ranges = -1;
+    const char *range = cwhttpd_get_header(conn, "Range");
+    if (range != NULL && !deflate_compression && encoding == NULL &&
+            if_range(conn, etag, &st)) {
+        num_ranges = parse_ranges(range, st.st_size, ranges);
+    }
+    if (num_ranges == 0) {
+        char headers[48];
+        size_t headers_len = cwhttpd_snprintf(headers, sizeof(headers),
+                "Content-Range: bytes */%lu\r\n", (unsigned long) st.st_size);
+        if (cwhttpd_send_response(conn, 416, headers, headers_len, NULL,
+                0) < 0) {
+            r = CWHTTPD_STATUS_FAIL;
+        }
+        goto cleanup;
     }
-    if (deflate_compression && fstat(fileno(f), &st) != 0) {
-        deflate_compression = false;
+
+    /* A cached descriptor can be shared as it is only used with offsets */
+    int cached_fd = -1;
+    if (sce != NULL && !deflate_compression) {
+        cached_fd = sce->fd;
     }
 
-    TRY(cwhttpd_response(conn, 200));
-    if (deflate_compression) {
-        TRY(cwhttpd_send_header(conn, "Content-Encoding", "deflate"));
+    if (entry == NULL && !deflate_compression) {
+        entry = fs_cache_fill(cache, path, cached_fd, &st, etag, mimetype,
+                h.buf, h.len);
     }
-    if (mimetype) {
-        TRY(cwhttpd_send_header(conn, "Content-Type", mimetype));
+    /* Content in memory, from the content cache or a shared mapping. TLS
+     * can't use sendfile so it writes straight from the page cache. */
+    const uint8_t *data = NULL;
+    if (entry != NULL) {
+        data = entry->body;
+#if defined(STAT_CACHE_MMAP)
+    } else if (cached_fd >= 0 && cwhttpd_plat_is_ssl(conn)) {
+        data = stat_cache_entry_map(sce);
+#endif /* defined(STAT_CACHE_MMAP) */
     }
-    TRY(cwhttpd_send_cache_header(conn, mimetype));
 
-    size_t len;
-    TRY(cwhttpd_chunk_start(conn, st.st_size));
-    while ((len = fread(buf, 1, FILE_CHUNK_LEN, f)) > 0) {
-        TRY(cwhttpd_send(conn, buf, len));
+    if (data != NULL && num_ranges < 0) {
+        const char *headers = entry ? entry->headers : h.buf;
+        size_t headers_len = entry ? entry->headers_len : h.len;
+        if (cwhttpd_send_response(conn, 200, headers, headers_len, data,
+                st.st_size) < 0) {
+            r = CWHTTPD_STATUS_FAIL;
+        }
+        goto cleanup;
+    }
+    if (data != NULL && num_ranges == 1) {
+        size_t len = ranges[0].last - ranges[0].first + 1;
+        if (!file_headers_add(&h, h.len,
+                "Content-Range: bytes %lu-%lu/%lu\r\n",
+                (unsigned long) ranges[0].first,
+                (unsigned long) ranges[0].last, (unsigned long) st.st_size) ||
+                cwhttpd_send_response(conn, 206, h.buf, h.len,
+                data + ranges[0].first, len) < 0) {
+            r = CWHTTPD_STATUS_FAIL;
+        }
+        goto cleanup;
     }
-    TRY(cwhttpd_chunk_end(conn));
 
+    int fd = -1;
+    if (data == NULL && cached_fd >= 0) {
+        fd = cached_fd;
+    } else if (data == NULL) {
+        fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            r = CWHTTPD_STATUS_NOTFOUND;
+            goto cleanup;
+        }
+        if (deflate_compression && fcntl(fd, F_REOPEN_RAW) != 0) {
+            deflate_compression = false;
+        }
+        if (deflate_compression && fstat(fd, &st) != 0) {
+            deflate_compression = false;
+        }
+        if (deflate_compression && !file_headers_add(&h, h.len,
+                "Content-Encoding: deflate\r\n")) {
+            r = CWHTTPD_STATUS_FAIL;
+            goto cleanup_fd;
+        }
+    }
+
+    if (num_ranges > 1) {
+        r = send_multipart(conn, &h, data, fd, st.st_size, mimetype, ranges,
+                num_ranges);
+    } else if (num_ranges == 1) {
+        size_t len = ranges[0].last - ranges[0].first + 1;
+        if (!file_headers_add(&h, h.len,
+                "Content-Range: bytes %lu-%lu/%lu\r\n",
+                (unsigned long) ranges[0].first,
+                (unsigned long) ranges[0].last, (unsigned long) st.st_size) ||
+                cwhttpd_send_head(conn, 206, h.buf, h.len, len) < 0 ||
+                send_slice(conn, NULL, fd, ranges[0].first, len) < 0) {
+            r = CWHTTPD_STATUS_FAIL;
+        }
+    } else {
+        if (cwhttpd_send_head(conn, 200, h.buf, h.len, st.st_size) < 0 ||
+                send_slice(conn, NULL, fd, 0, st.st_size) < 0) {
+            r = CWHTTPD_STATUS_FAIL;
+        }
+    }
+
+cleanup_fd:
+    if (fd >= 0 && fd != cached_fd) {
+        close(fd);
+    }
 cleanup:
-    fclose(f);
+    if (entry != NULL) {
+        fs_cache_entry_put(entry);
+    }
+    stat_cache_entry_put(sce);
     return r;
 }
 
-cwhttpd_status_t cwhttpd_route_fs_tpl(cwhttpd_conn_t *conn)
+static const cwhttpd_bundle_file_t *bundle_lookup(
+        const cwhttpd_bundle_t *bundle, const char *path, size_t len)
 {
-    cwhttpd_status_t r = CWHTTPD_STATUS_DONE;
+    if (bundle->num_slots == 0) {
+        return NULL;
+    }
+
+    uint32_t bucket = router_static_hash(path, len, 0) % bundle->num_buckets;
+    uint32_t slot = router_static_hash(path, len, bundle->seeds[bucket]) %
+            bundle->num_slots;
+    const cwhttpd_bundle_file_t *file = &bundle->files[slot];
+    if (file->path == NULL || file->path_len != len ||
+            memcmp(file->path, path, len) != 0) {
+        return NULL;
+    }
+    return file;
+}
 
+cwhttpd_status_t cwhttpd_route_bundle(cwhttpd_conn_t *conn)
+{
     /* Only process GET requests, otherwise fallthrough */
     if (conn->request.method != CWHTTPD_METHOD_GET) {
         return CWHTTPD_STATUS_NOTFOUND;
     }
 
-    /* We can use buf here because its not needed until reading data */
-    char buf[FILE_CHUNK_LEN];
+    const cwhttpd_route_t *route = conn->route;
+    if (route->argc < 1) {
+        LOGE(__func__, "missing bundle");
+        return CWHTTPD_STATUS_NOTFOUND;
+    }
+    const cwhttpd_bundle_t *bundle = route->argv[0];
+    const char *url = url_remainder(conn);
+
+    const cwhttpd_bundle_file_t *file = bundle_lookup(bundle, url,
+            strlen(url));
+    if (file == NULL) {
+        return CWHTTPD_STATUS_NOTFOUND;
+    }
+
+    const cwhttpd_bundle_variant_t *variant = &file->variants[0];
+    cwhttpd_encoding_t encoding = CWHTTPD_ENCODING_IDENTITY;
+    if (file->num_variants > 1) {
+        encoding = cwhttpd_negotiate_encoding(conn, file->encodings);
+    }
+    for (size_t i = 1; i < file->num_variants; i++) {
+        if (file->variants[i].encoding == encoding) {
+            variant = &file->variants[i];
+            break;
+        }
+    }
+
+    const char *header = cwhttpd_get_header(conn, "If-None-Match");
+    if (header != NULL && etag_match(header, variant->etag, true)) {
+        if (cwhttpd_send_response(conn, 304, variant->headers,
+                variant->cond_len, NULL, 0) < 0) {
+            return CWHTTPD_STATUS_FAIL;
+        }
+        return CWHTTPD_STATUS_DONE;
+    }
+
+    if (cwhttpd_send_response(conn, 200, variant->headers,
+            variant->headers_len, variant->body, variant->body_len) < 0) {
+        return CWHTTPD_STATUS_FAIL;
+    }
+    return CWHTTPD_STATUS_DONE;
+}
+
+#if defined(CONFIG_CWHTTPD_FROGFS)
+/* Images don't change while they are loaded, so the hash of the stored bytes
+ * of an entry is computed once and kept until its image is unloaded. */
+typedef struct frogfs_etag_slot_t {
+    const frogfs_fs_t *fs;
+    const frogfs_entry_t *entry;
+    uint64_t hash;
+} frogfs_etag_slot_t;
+
+static frogfs_etag_slot_t frogfs_etags[FROGFS_ETAG_SLOTS];
+static cwhttpd_mutex_t *_Atomic frogfs_etags_mutex;
+
+/* The mutex is made on first use, NULL if that fails and nothing is cached */
+static cwhttpd_mutex_t *frogfs_etags_lock(void)
+{
+    cwhttpd_mutex_t *mutex = atomic_load(&frogfs_etags_mutex);
+    if (mutex == NULL) {
+        cwhttpd_mutex_t *created = cwhttpd_mutex_create(false);
+        if (created == NULL) {
+            LOGE(__func__, "cwhttpd_mutex_create failed");
+            return NULL;
+        }
+        if (atomic_compare_exchange_strong(&frogfs_etags_mutex, &mutex,
+                created)) {
+            mutex = created;
+        } else {
+            cwhttpd_mutex_delete(created);
+        }
+    }
+    cwhttpd_mutex_lock(mutex);
+    return mutex;
+}
+
+static uint64_t frogfs_etag_hash(const frogfs_fs_t *fs,
+        const frogfs_entry_t *entry, const uint8_t *stored, size_t len)
+{
+    frogfs_etag_slot_t *slot = &frogfs_etags[((uintptr_t) entry >> 3) &
+            (FROGFS_ETAG_SLOTS - 1)];
+
+    cwhttpd_mutex_t *mutex = frogfs_etags_lock();
+    if (mutex != NULL) {
+        bool hit = slot->fs == fs && slot->entry == entry;
+        uint64_t cached = slot->hash;
+        cwhttpd_mutex_unlock(mutex);
+        if (hit) {
+            return cached;
+        }
+    }
+
+    uint64_t hash = UINT64_C(14695981039346656037);
+    for (size_t i = 0; i < len; i++) {
+        hash ^= stored[i];
+        hash *= UINT64_C(1099511628211);
+    }
+
+    if (mutex != NULL) {
+        cwhttpd_mutex_lock(mutex);
+        slot->fs = fs;
+        slot->entry = entry;
+        slot->hash = hash;
+        cwhttpd_mutex_unlock(mutex);
+    }
+    return hash;
+}
+
+# if !defined(ESP_PLATFORM)
+/* Drop the hashes of an image, its entries may be reused by the next one */
+static void frogfs_etags_forget(const frogfs_fs_t *fs)
+{
+    /* without a mutex nothing was cached */
+    cwhttpd_mutex_t *mutex = atomic_load(&frogfs_etags_mutex);
+    if (mutex == NULL) {
+        return;
+    }
+    cwhttpd_mutex_lock(mutex);
+    for (size_t i = 0; i < FROGFS_ETAG_SLOTS; i++) {
+        if (frogfs_etags[i].fs == fs) {
+            frogfs_etags[i].fs = NULL;
+            frogfs_etags[i].entry = NULL;
+        }
+    }
+    cwhttpd_mutex_unlock(mutex);
+}
+
+bool cwhttpd_frogfs_image_load(cwhttpd_frogfs_image_t *image,
+        const char *path)
+{
+    memset(image, 0, sizeof(*image));
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        LOGE(__func__, "open %s: %d", path, errno);
+        return false;
+    }
     struct stat st;
-    if (!get_filepath(conn, buf, sizeof(buf), &st, "index.tpl")) {
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        LOGE(__func__, "%s: not an image", path);
+        close(fd);
+        return false;
+    }
+    void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        LOGE(__func__, "mmap %s: %d", path, errno);
+        return false;
+    }
+
+    frogfs_config_t conf = {
+        .addr = addr,
+    };
+    image->fs = frogfs_init(&conf);
+    if (image->fs == NULL) {
+        LOGE(__func__, "%s: frogfs_init failed", path);
+        munmap(addr, st.st_size);
+        return false;
+    }
+    image->addr = addr;
+    image->len = st.st_size;
+    return true;
+}
+
+void cwhttpd_frogfs_image_unload(cwhttpd_frogfs_image_t *image)
+{
+    if (image->fs != NULL) {
+        frogfs_etags_forget(image->fs);
+        frogfs_deinit(image->fs);
+        munmap((void *) image->addr, image->len);
+        image->fs = NULL;
+    }
+}
+# endif /* !defined(ESP_PLATFORM) */
+
+/* FrogFS paths have no leading '/', directories map to their index */
+static const frogfs_entry_t *frogfs_lookup(cwhttpd_conn_t *conn,
+        frogfs_fs_t *fs, char *path, size_t len)
+{
+    const char *url = url_remainder(conn);
+    const cwhttpd_route_t *route = conn->route;
+
+    size_t out_len = 0;
+    if (route->argc >= 1) {
+        out_len += strlcpy(path, route->argv[0], len);
+    }
+    if (out_len < len) {
+        out_len += strlcpy(path + out_len, url, len - out_len);
+    }
+    if (out_len < len && (out_len == 0 || path[out_len - 1] == '/')) {
+        out_len += strlcpy(path + out_len, "index.html", len - out_len);
+    }
+    if (out_len >= len) {
+        return NULL;
+    }
+
+    const frogfs_entry_t *entry = frogfs_get_entry(fs, path);
+    if (entry != NULL && frogfs_is_dir(entry)) {
+        out_len += strlcpy(path + out_len, "/index.html", len - out_len);
+        if (out_len >= len) {
+            return NULL;
+        }
+        entry = frogfs_get_entry(fs, path);
+    }
+    if (entry == NULL || !frogfs_is_file(entry)) {
+        return NULL;
+    }
+    return entry;
+}
+
+cwhttpd_status_t cwhttpd_route_frogfs_get(cwhttpd_conn_t *conn)
+{
+    cwhttpd_status_t r = CWHTTPD_STATUS_DONE;
+
+    /* Only process GET requests, otherwise fallthrough */
+    if (conn->request.method != CWHTTPD_METHOD_GET) {
         return CWHTTPD_STATUS_NOTFOUND;
     }
 
-    const char *mimetype = cwhttpd_get_mimetype(buf);
+    frogfs_fs_t *fs = conn->inst->frogfs;
+    if (fs == NULL) {
+        return CWHTTPD_STATUS_NOTFOUND;
+    }
 
-    FILE *f = fopen(buf, "r");
-    if (f == NULL) {
+    char path[MAX_FILENAME_LENGTH];
+    const frogfs_entry_t *entry = frogfs_lookup(conn, fs, path,
+            sizeof(path));
+    if (entry == NULL) {
         return CWHTTPD_STATUS_NOTFOUND;
     }
 
-    cwhttpd_tpl_cb_t cb = conn->route->argv[1];
-    TRY(cwhttpd_response(conn, 200));
-    if (mimetype) {
-        TRY(cwhttpd_send_header(conn, "Content-Type", mimetype));
+    frogfs_stat_t fst;
+    frogfs_stat(fs, entry, &fst);
+    bool compressed = fst.compression == FROGFS_COMP_ALGO_ZLIB;
+    bool raw = compressed && cwhttpd_negotiate_encoding(conn,
+            CWHTTPD_ENCODING_MASK(CWHTTPD_ENCODING_DEFLATE)) ==
+            CWHTTPD_ENCODING_DEFLATE;
+
+    /* The image is mapped, so stored bytes are sent from where they are */
+    frogfs_fh_t *fh = frogfs_open(fs, entry, FROGFS_OPEN_RAW);
+    if (fh == NULL) {
+        return CWHTTPD_STATUS_NOTFOUND;
     }
+    const uint8_t *stored;
+    size_t stored_len = frogfs_access(fh, (const void **) &stored);
 
-    void *user = NULL;
+    /* Images keep no timestamps, so the ETag hashes the stored bytes */
+    uint64_t hash = frogfs_etag_hash(fs, entry, stored, stored_len);
+    char etag[ETAG_LEN];
+    cwhttpd_snprintf(etag, sizeof(etag), "\"%08lx%08lx%s\"",
+            (unsigned long) (hash >> 32), (unsigned long) (hash & 0xFFFFFFFF),
+            raw ? "-deflate" : "");
+
+    /* Only clients that don't take deflate need the content inflated */
+    const void *data = stored;
+    size_t len = stored_len;
+    if (compressed && !raw) {
+        frogfs_close(fh);
+        fh = frogfs_open(fs, entry, 0);
+        if (fh == NULL) {
+            return CWHTTPD_STATUS_NOTFOUND;
+        }
+        data = NULL;
+        len = fst.size;
+    }
+
+    struct stat st = {0};
+    const char *mimetype = cwhttpd_get_mimetype(path);
+    file_headers_t h;
+    file_headers(&h, etag, &st, mimetype, false, raw ? "deflate" : NULL,
+            compressed);
+    if (h.len == 0) {
+        LOGE(__func__, "headers too long");
+        r = CWHTTPD_STATUS_FAIL;
+        goto cleanup;
+    }
+
+    if (not_modified(conn, etag, &st)) {
+        if (cwhttpd_send_response(conn, 304, h.buf, h.cond_len, NULL, 0) < 0) {
+            r = CWHTTPD_STATUS_FAIL;
+        }
+        goto cleanup;
+    }
+
+    if (data != NULL) {
+        if (cwhttpd_send_response(conn, 200, h.buf, h.len, data, len) < 0) {
+            r = CWHTTPD_STATUS_FAIL;
+        }
+        goto cleanup;
+    }
+
+    if (cwhttpd_send_head(conn, 200, h.buf, h.len, len) < 0) {
+        r = CWHTTPD_STATUS_FAIL;
+        goto cleanup;
+    }
+    uint8_t buf[FILE_CHUNK_LEN];
+    ssize_t n;
+    while ((n = frogfs_read(fh, buf, sizeof(buf))) > 0) {
+        if (cwhttpd_send(conn, buf, n) < 0) {
+            r = CWHTTPD_STATUS_FAIL;
+            break;
+        }
+    }
+
+cleanup:
+    frogfs_close(fh);
+    return r;
+}
+#endif /* defined(CONFIG_CWHTTPD_FROGFS) */
+
+/* Scan a template that is too large to be parsed in memory as it is read */
+static ssize_t tpl_stream(cwhttpd_conn_t *conn, FILE *f, cwhttpd_tpl_cb_t cb,
+        void **user)
+{
+    char buf[FILE_CHUNK_LEN];
     size_t len;
     int token_pos = -1;
-    char token[32];
+    char token[TPL_TOKEN_LEN];
     do {
         len = fread(buf, 1, FILE_CHUNK_LEN, f);
         int raw_count = 0;
@@ -196,7 +1154,9 @@ cwhttpd_status_t cwhttpd_route_fs_tpl(cwhttpd_conn_t *conn)
                     if (buf[i] == '%') {
                         /* send collected raw data */
                         if (raw_count != 0) {
-                            TRY(cwhttpd_send(conn, p, raw_count));
+                            if (cwhttpd_send(conn, p, raw_count) < 0) {
+                                return -1;
+                            }
                             raw_count = 0;
                         }
                         /* start collecting token chars */
@@ -209,11 +1169,13 @@ cwhttpd_status_t cwhttpd_route_fs_tpl(cwhttpd_conn_t *conn)
                     if (buf[i] == '%') {
                         if (token_pos == 0) {
                             /* this is an escape sequence */
-                            TRY(cwhttpd_send(conn, "%", 1));
+                            if (cwhttpd_send(conn, "%", 1) < 0) {
+                                return -1;
+                            }
                         } else {
                             /* this is a token */
                             token[token_pos] = '\0'; /* zero terminate */
-                            cb(conn, token, &user);
+                            cb(conn, token, user);
                         }
 
                         /* collect normal characters again */
@@ -230,13 +1192,307 @@ cwhttpd_status_t cwhttpd_route_fs_tpl(cwhttpd_conn_t *conn)
 
         /* send remainder */
         if (raw_count != 0) {
-            TRY(cwhttpd_send(conn, p, raw_count));
+            if (cwhttpd_send(conn, p, raw_count) < 0) {
+                return -1;
+            }
         }
     } while (len == FILE_CHUNK_LEN);
 
+    return 0;
+}
+
+/* Send the segments of a template, calling cb for tokens */
+static ssize_t tpl_render(cwhttpd_conn_t *conn,
+        const cwhttpd_tpl_segment_t *segments, size_t num_segments,
+        cwhttpd_tpl_cb_t cb, void **user)
+{
+    char token[TPL_TOKEN_LEN];
+    for (size_t i = 0; i < num_segments; i++) {
+        const cwhttpd_tpl_segment_t *segment = &segments[i];
+        if (!segment->token) {
+            if (cwhttpd_send(conn, segment->text, segment->len) < 0) {
+                return -1;
+            }
+            continue;
+        }
+        /* callbacks get a copy they are free to modify */
+        size_t len = segment->len;
+        if (len > sizeof(token) - 1) {
+            len = sizeof(token) - 1;
+        }
+        memcpy(token, segment->text, len);
+        token[len] = '\0';
+        cb(conn, token, user);
+    }
+    return 0;
+}
+
+cwhttpd_status_t cwhttpd_route_fs_tpl(cwhttpd_conn_t *conn)
+{
+    cwhttpd_status_t r = CWHTTPD_STATUS_DONE;
+
+    /* Only process GET requests, otherwise fallthrough */
+    if (conn->request.method != CWHTTPD_METHOD_GET) {
+        return CWHTTPD_STATUS_NOTFOUND;
+    }
+
+    char path[MAX_FILENAME_LENGTH];
+    struct stat st;
+    stat_cache_entry_t *sce;
+    if (!get_filepath(conn, path, sizeof(path), &st, "index.tpl", &sce)) {
+        return CWHTTPD_STATUS_NOTFOUND;
+    }
+    const char *mimetype = mime_resolve(sce ? &sce->mime : NULL, path);
+    stat_cache_entry_put(sce);
+
+    /* Templates are parsed once and kept until the file changes */
+    FILE *f = NULL;
+    tpl_cache_entry_t *tpl = tpl_cache_get(conn->inst->tpl_cache, path, &st);
+    if (tpl == NULL) {
+        f = fopen(path, "r");
+        if (f == NULL) {
+            return CWHTTPD_STATUS_NOTFOUND;
+        }
+    }
+
+    cwhttpd_tpl_cb_t cb = conn->route->argv[1];
+    void *user = NULL;
+    TRY(cwhttpd_response(conn, 200));
+    if (mimetype) {
+        TRY(cwhttpd_send_header(conn, "Content-Type", mimetype));
+    }
+
+    /* Literals and callback output go out in as few writes as possible */
+    cwhttpd_set_buffered(conn, true);
+
+    if (tpl != NULL) {
+        TRY(tpl_render(conn, tpl->segments, tpl->num_segments, cb, &user));
+    } else {
+        TRY(tpl_stream(conn, f, cb, &user));
+    }
+
 cleanup:
     /* we're done */
     cb(conn, NULL, &user);
-    fclose(f);
+    cwhttpd_set_buffered(conn, false);
+    tpl_cache_entry_put(tpl);
+    if (f != NULL) {
+        fclose(f);
+    }
+    return r;
+}
+
+/* Reject .. components that would leave the base directory */
+static bool path_is_safe(const char *path)
+{
+    while (true) {
+        const char *end = path + strcspn(path, "/");
+        if (end - path == 2 && path[0] == '.' && path[1] == '.') {
+            return false;
+        }
+        if (*end == '\0') {
+            return true;
+        }
+        path = end + 1;
+    }
+}
+
+/* Create the missing directories of path below its first start bytes */
+static bool make_dirs(char *path, size_t start)
+{
+    for (char *p = strchr(path + start, '/'); p != NULL;
+            p = strchr(p + 1, '/')) {
+        *p = '\0';
+        int ret = mkdir(path, 0755);
+        *p = '/';
+        if (ret != 0 && errno != EEXIST) {
+            LOGE(__func__, "mkdir %d", errno);
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Returns 0, or the status code to answer a failed write with */
+static int write_all(int fd, const char *buf, size_t len)
+{
+    for (size_t done = 0; done < len;) {
+        ssize_t ret = write(fd, buf + done, len - done);
+        if (ret <= 0) {
+            LOGE(__func__, "write %d", ret < 0 ? errno : 0);
+            return ret < 0 && errno == ENOSPC ? 507 : 500;
+        }
+        done += ret;
+    }
+    return 0;
+}
+
+/* The unread body leaves the connection unusable */
+static cwhttpd_status_t put_error(cwhttpd_conn_t *conn, int code)
+{
+    cwhttpd_set_close(conn, true);
+    cwhttpd_send_response(conn, code, NULL, 0, NULL, 0);
+    return CWHTTPD_STATUS_CLOSE;
+}
+
+cwhttpd_status_t cwhttpd_route_fs_put(cwhttpd_conn_t *conn)
+{
+    /* POST is kept for upload forms and clients of the ?filename= form, the
+     * body is the raw file either way */
+    if (conn->request.method != CWHTTPD_METHOD_PUT &&
+            conn->request.method != CWHTTPD_METHOD_POST) {
+        return CWHTTPD_STATUS_NOTFOUND;
+    }
+    if (conn->route->argc < 1) {
+        LOGE(__func__, "missing path argument");
+        return put_error(conn, 500);
+    }
+
+    cwhttpd_post_t *post = conn->post;
+    if (post == NULL) {
+        return put_error(conn, 411);
+    }
+    if (post->boundary != NULL) {
+        return put_error(conn, 415);
+    }
+
+    char path[MAX_FILENAME_LENGTH];
+    size_t base_len = strlcpy(path, conn->route->argv[0], sizeof(path));
+    size_t out_len = base_len;
+    if (base_len > 0 && path[base_len - 1] == '/') {
+        /* only the query string names the file, never the body */
+        char arg[MAX_FILENAME_LENGTH];
+        size_t arg_len = sizeof(arg);
+        const char *name = url_remainder(conn);
+        if (conn->request.args != NULL && cwhttpd_find_param("filename",
+                conn->request.args, arg, &arg_len) >= 0) {
+            if (arg_len > sizeof(arg)) {
+                return put_error(conn, 414);
+            }
+            name = arg;
+        }
+        while (*name == '/') {
+            name++;
+        }
+        if (!path_is_safe(name)) {
+            return put_error(conn, 403);
+        }
+        out_len += strlcpy(path + out_len, name, sizeof(path) - out_len);
+    }
+    if (out_len >= sizeof(path)) {
+        return put_error(conn, 414);
+    }
+    if (out_len == 0 || path[out_len - 1] == '/') {
+        return put_error(conn, 400);
+    }
+    if (!make_dirs(path, base_len)) {
+        return put_error(conn, 500);
+    }
+
+    /* Readers see either the old or the complete new file */
+    char tmp_path[MAX_FILENAME_LENGTH + 16];
+    cwhttpd_snprintf(tmp_path, sizeof(tmp_path), "%s.%lx~", path,
+            (unsigned long) (uintptr_t) conn);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        LOGE(__func__, "open %s %d", tmp_path, errno);
+        return put_error(conn, 500);
+    }
+
+    int code = 500;
+#if defined(__linux__)
+    /* a full disk fails before the body is read, and the file is laid out
+     * in one piece */
+    if (post->len > 0 && fallocate(fd, 0, 0, post->len) != 0 &&
+            errno == ENOSPC) {
+        code = 507;
+        goto fail;
+    }
+#endif /* defined(__linux__) */
+
+    /* the start of the body has already been read by the server, and more
+     * of it can still be left over from the read of the headers */
+    size_t left = conn->priv.req + conn->priv.req_len - conn->priv.data;
+    if (left > post->len - post->received) {
+        left = post->len - post->received;
+    }
+    int err = write_all(fd, post->buf, post->buf_len);
+    if (err == 0) {
+        err = write_all(fd, conn->priv.data, left);
+    }
+    if (err != 0) {
+        code = err;
+        goto fail;
+    }
+    conn->priv.data += left;
+    post->received += left;
+    if (post->received < post->len) {
+        ssize_t ret = cwhttpd_plat_recvfile(conn, fd, post->buf_len + left,
+                post->len - post->received);
+        if (ret < 0) {
+            /* nothing sensible can be sent on a broken connection */
+            close(fd);
+            unlink(tmp_path);
+            return CWHTTPD_STATUS_FAIL;
+        }
+        post->received += ret;
+    }
+    post->buf_len = 0;
+
+    if (fsync(fd) != 0) {
+        LOGE(__func__, "fsync %d", errno);
+        goto fail;
+    }
+    close(fd);
+    fd = -1;
+
+    struct stat st;
+    bool exists = stat(path, &st) == 0;
+    if (rename(tmp_path, path) != 0) {
+        /* the target is left as it was rather than replaced non-atomically */
+        LOGE(__func__, "rename %s %d", path, errno);
+        goto fail;
+    }
+
+    stat_cache_invalidate(conn->inst->stat_cache, path);
+    fs_cache_invalidate(conn->inst->fs_cache, path);
+    tpl_cache_invalidate(conn->inst->tpl_cache, path);
+
+    cwhttpd_send_response(conn, exists ? 200 : 201, NULL, 0, NULL, 0);
+    return CWHTTPD_STATUS_DONE;
+
+fail:
+    if (fd >= 0) {
+        close(fd);
+    }
+    unlink(tmp_path);
+    if (post->received < post->len) {
+        return put_error(conn, code);
+    }
+    cwhttpd_send_response(conn, code, NULL, 0, NULL, 0);
+    return CWHTTPD_STATUS_DONE;
+}
+
+cwhttpd_status_t cwhttpd_route_tpl(cwhttpd_conn_t *conn)
+{
+    cwhttpd_status_t r = CWHTTPD_STATUS_DONE;
+
+    /* Only process GET requests, otherwise fallthrough */
+    if (conn->request.method != CWHTTPD_METHOD_GET) {
+        return CWHTTPD_STATUS_NOTFOUND;
+    }
+
+    const cwhttpd_tpl_t *tpl = conn->route->argv[0];
+    cwhttpd_tpl_cb_t cb = conn->route->argv[1];
+    void *user = NULL;
+    TRY(cwhttpd_response(conn, 200));
+    TRY(cwhttpd_send_header(conn, "Content-Type", tpl->mimetype));
+
+    cwhttpd_set_buffered(conn, true);
+    TRY(tpl_render(conn, tpl->segments, tpl->num_segments, cb, &user));
+
+cleanup:
+    cb(conn, NULL, &user);
+    cwhttpd_set_buffered(conn, false);
     return r;
 }
@@ -11,11 +11,42 @@
 #endif
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 
+/* Longest host name allowed by DNS */
+#define MAX_HOSTNAME_LEN 253
+
+#define REDIRECT_NONE SIZE_MAX
+
+typedef struct redirect_rule_t redirect_rule_t;
+
+struct redirect_rule_t {
+    const char *from; /**< request path or prefix without '*' */
+    size_t from_len;
+    const char *to; /**< target without a trailing '*' */
+    size_t to_len;
+    uint32_t hash; /**< hash of from, exact rules only */
+    int code; /**< redirect status code, 0 to rewrite */
+    bool append; /**< append the rest of the path to the target */
+    bool has_query; /**< target has a query string */
+    size_t parent; /**< longest prefix rule this one starts with */
+    char *headers; /**< prebuilt Location header, fixed redirects only */
+    size_t headers_len;
+};
+
+struct cwhttpd_redirect_map_t {
+    redirect_rule_t **exact; /**< exact rules by hash, linear probing */
+    size_t exact_mask; /**< number of slots - 1 */
+    size_t num_exact;
+    redirect_rule_t **prefixes; /**< prefix rules, sorted by prefix */
+    size_t num_prefixes;
+};
+
+
 cwhttpd_status_t cwhttpd_route_redirect(cwhttpd_conn_t *conn)
 {
     cwhttpd_redirect(conn, (char *) conn->route->argv[0]);
@@ -25,7 +56,7 @@ cwhttpd_status_t cwhttpd_route_redirect(cwhttpd_conn_t *conn)
 cwhttpd_status_t cwhttpd_route_redirect_hostname(cwhttpd_conn_t *conn)
 {
     const char *new_hostname = (char *) conn->route->argv[0];
-    char *buf;
+    char headers[sizeof("Location: https://\r\n") + MAX_HOSTNAME_LEN];
 
     if (conn->request.hostname == NULL) {
         return CWHTTPD_STATUS_NOTFOUND;
@@ -55,24 +86,401 @@ cwhttpd_status_t cwhttpd_route_redirect_hostname(cwhttpd_conn_t *conn)
 #endif
 #endif
 
-    const char *uri_fmt;
-    if (cwhttpd_plat_is_ssl(conn)) {
-        uri_fmt = "https://%s";
-    } else {
-        uri_fmt = "http://%s";
-    }
-
     /* Tests failed.  Redirect to real hostname.
      */
-    buf = malloc(strlen(new_hostname) + strlen(uri_fmt) - 1);
-    if (buf == NULL) {
+    int len = cwhttpd_snprintf(headers, sizeof(headers),
+            "Location: %s://%s\r\n",
+            cwhttpd_plat_is_ssl(conn) ? "https" : "http", new_hostname);
+    if (len >= sizeof(headers)) {
+        LOGE(__func__, "hostname too long");
+        return CWHTTPD_STATUS_NOTFOUND;
+    }
+
+    LOGD(__func__, "redirecting to %s", new_hostname);
+    cwhttpd_send_response(conn, 302, headers, len, NULL, 0);
+    return CWHTTPD_STATUS_DONE;
+}
+
+/* FNV-1a */
+static uint32_t path_hash(const char *path, size_t len)
+{
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char) path[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static const redirect_rule_t *map_match(const cwhttpd_redirect_map_t *map,
+        const char *url, size_t len)
+{
+    if (map->num_exact > 0) {
+        uint32_t hash = path_hash(url, len);
+        for (size_t i = hash & map->exact_mask; map->exact[i];
+                i = (i + 1) & map->exact_mask) {
+            const redirect_rule_t *rule = map->exact[i];
+            if (rule->hash == hash && rule->from_len == len &&
+                    memcmp(rule->from, url, len) == 0) {
+                return rule;
+            }
+        }
+    }
+
+    /* The greatest prefix not above the URL starts with every prefix of the
+     * URL, so the longest matching prefix is on its parent chain. */
+    size_t lo = 0, hi = map->num_prefixes;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        const redirect_rule_t *rule = map->prefixes[mid];
+        if (strncmp(rule->from, url, rule->from_len) <= 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    size_t i = lo > 0 ? lo - 1 : REDIRECT_NONE;
+    while (i != REDIRECT_NONE) {
+        const redirect_rule_t *rule = map->prefixes[i];
+        if (strncmp(rule->from, url, rule->from_len) == 0) {
+            return rule;
+        }
+        i = rule->parent;
+    }
+    return NULL;
+}
+
+static bool exact_add(cwhttpd_redirect_map_t *map, redirect_rule_t *rule)
+{
+    size_t slots = map->num_exact ? map->exact_mask + 1 : 0;
+
+    /* keep the load factor at or below one half */
+    if ((map->num_exact + 1) * 2 > slots) {
+        size_t new_slots = slots ? slots * 2 : 16;
+        redirect_rule_t **exact = calloc(new_slots, sizeof(redirect_rule_t *));
+        if (exact == NULL) {
+            LOGE(__func__, "calloc failed");
+            return false;
+        }
+        for (size_t i = 0; i < slots; i++) {
+            if (map->exact[i]) {
+                size_t j = map->exact[i]->hash & (new_slots - 1);
+                while (exact[j]) {
+                    j = (j + 1) & (new_slots - 1);
+                }
+                exact[j] = map->exact[i];
+            }
+        }
+        free(map->exact);
+        map->exact = exact;
+        map->exact_mask = new_slots - 1;
+    }
+
+    size_t i = rule->hash & map->exact_mask;
+    while (map->exact[i]) {
+        const redirect_rule_t *other = map->exact[i];
+        if (other->from_len == rule->from_len &&
+                memcmp(other->from, rule->from, rule->from_len) == 0) {
+            LOGW(__func__, "duplicate rule for %s", rule->from);
+            return false;
+        }
+        i = (i + 1) & map->exact_mask;
+    }
+    map->exact[i] = rule;
+    map->num_exact++;
+    return true;
+}
+
+static bool prefix_add(cwhttpd_redirect_map_t *map, redirect_rule_t *rule)
+{
+    size_t lo = 0, hi = map->num_prefixes;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (strcmp(map->prefixes[mid]->from, rule->from) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo < map->num_prefixes && strcmp(map->prefixes[lo]->from,
+            rule->from) == 0) {
+        LOGW(__func__, "duplicate rule for %s*", rule->from);
+        return false;
+    }
+
+    redirect_rule_t **prefixes = realloc(map->prefixes,
+            sizeof(redirect_rule_t *) * (map->num_prefixes + 1));
+    if (prefixes == NULL) {
+        LOGE(__func__, "realloc failed");
+        return false;
+    }
+    memmove(prefixes + lo + 1, prefixes + lo,
+            sizeof(redirect_rule_t *) * (map->num_prefixes - lo));
+    prefixes[lo] = rule;
+    map->prefixes = prefixes;
+    map->num_prefixes++;
+
+    /* parents before the new rule are unaffected */
+    for (size_t i = lo; i < map->num_prefixes; i++) {
+        redirect_rule_t *r = prefixes[i];
+        size_t parent = i > 0 ? i - 1 : REDIRECT_NONE;
+        while (parent != REDIRECT_NONE && strncmp(r->from,
+                prefixes[parent]->from, prefixes[parent]->from_len) != 0) {
+            parent = prefixes[parent]->parent;
+        }
+        r->parent = parent;
+    }
+    return true;
+}
+
+cwhttpd_redirect_map_t *cwhttpd_redirect_map_create(void)
+{
+    cwhttpd_redirect_map_t *map = calloc(1, sizeof(cwhttpd_redirect_map_t));
+    if (map == NULL) {
+        LOGE(__func__, "calloc failed");
+    }
+    return map;
+}
+
+bool cwhttpd_redirect_map_add(cwhttpd_redirect_map_t *map, int code,
+        const char *from, const char *to)
+{
+    if (code != 0 && code != 301 && code != 302 && code != 303 &&
+            code != 307 && code != 308) {
+        LOGE(__func__, "invalid code %d", code);
+        return false;
+    }
+
+    size_t from_len = strlen(from);
+    size_t to_len = strlen(to);
+    bool prefix = from_len > 0 && from[from_len - 1] == '*';
+    bool append = prefix && to_len > 0 && to[to_len - 1] == '*';
+    from_len -= prefix;
+    to_len -= append;
+
+    if (code == 0 && memchr(to, '?', to_len)) {
+        LOGE(__func__, "rewrite target %s has a query string", to);
+        return false;
+    }
+
+    /* one block for the rule, its strings and the prebuilt header */
+    size_t headers_len = (code != 0 && !append) ?
+            sizeof("Location: \r\n") - 1 + to_len : 0;
+    redirect_rule_t *rule = malloc(sizeof(redirect_rule_t) + from_len +
+            to_len + headers_len + 2);
+    if (rule == NULL) {
         LOGE(__func__, "malloc failed");
+        return false;
+    }
+
+    char *p = (char *) (rule + 1);
+    memcpy(p, from, from_len);
+    p[from_len] = '\0';
+    rule->from = p;
+    rule->from_len = from_len;
+    p += from_len + 1;
+    memcpy(p, to, to_len);
+    p[to_len] = '\0';
+    rule->to = p;
+    rule->to_len = to_len;
+    p += to_len + 1;
+    rule->headers = NULL;
+    rule->headers_len = headers_len;
+    if (headers_len) {
+        rule->headers = p;
+        memcpy(p, "Location: ", 10);
+        memcpy(p + 10, to, to_len);
+        memcpy(p + 10 + to_len, "\r\n", 2);
+    }
+    rule->hash = path_hash(rule->from, from_len);
+    rule->code = code;
+    rule->append = append;
+    rule->has_query = memchr(to, '?', to_len) != NULL;
+    rule->parent = REDIRECT_NONE;
+
+    if (!(prefix ? prefix_add(map, rule) : exact_add(map, rule))) {
+        free(rule);
+        return false;
+    }
+    return true;
+}
+
+/* Split a map file line into tokens, dropping comments */
+static size_t tokenize(char *line, char **tokens, size_t max_tokens)
+{
+    size_t count = 0;
+    char *p = line;
+
+    while (true) {
+        while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') {
+            p++;
+        }
+        if (*p == '\0' || *p == '#') {
+            return count;
+        }
+        if (count == max_tokens) {
+            return max_tokens + 1;
+        }
+        tokens[count++] = p;
+        while (*p && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') {
+            p++;
+        }
+        if (*p) {
+            *p++ = '\0';
+        }
+    }
+}
+
+cwhttpd_redirect_map_t *cwhttpd_redirect_map_load(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        LOGE(__func__, "unable to open %s", path);
+        return NULL;
+    }
+
+    cwhttpd_redirect_map_t *map = cwhttpd_redirect_map_create();
+    if (map == NULL) {
+        fclose(f);
+        return NULL;
+    }
+
+    char line[512];
+    size_t lineno = 0;
+    while (fgets(line, sizeof(line), f)) {
+        lineno++;
+        if (strchr(line, '\n') == NULL && !feof(f)) {
+            LOGW(__func__, "%s:%zu: line too long", path, lineno);
+            int c;
+            while ((c = fgetc(f)) != EOF && c != '\n') {
+            }
+            continue;
+        }
+
+        char *tokens[3];
+        size_t count = tokenize(line, tokens, 3);
+        if (count == 0) {
+            continue;
+        }
+
+        int code = 301;
+        char **rule = tokens;
+        if (count == 3) {
+            char *end;
+            if (strcmp(tokens[0], "rewrite") == 0) {
+                code = 0;
+            } else {
+                code = strtol(tokens[0], &end, 10);
+                if (*end != '\0') {
+                    code = -1;
+                }
+            }
+            rule++;
+        } else if (count != 2) {
+            code = -1;
+        }
+
+        if (code < 0 || !cwhttpd_redirect_map_add(map, code, rule[0],
+                rule[1])) {
+            LOGW(__func__, "%s:%zu: rule ignored", path, lineno);
+        }
+    }
+
+    fclose(f);
+    return map;
+}
+
+void cwhttpd_redirect_map_free(cwhttpd_redirect_map_t *map)
+{
+    if (map == NULL) {
+        return;
+    }
+
+    for (size_t i = 0; map->num_exact && i <= map->exact_mask; i++) {
+        free(map->exact[i]);
+    }
+    for (size_t i = 0; i < map->num_prefixes; i++) {
+        free(map->prefixes[i]);
+    }
+    free(map->exact);
+    free(map->prefixes);
+    free(map);
+}
+
+cwhttpd_status_t cwhttpd_route_redirect_map(cwhttpd_conn_t *conn)
+{
+    const cwhttpd_redirect_map_t *map = conn->route->argv[0];
+    const char *url = conn->request.url;
+    size_t url_len = strlen(url);
+
+    const redirect_rule_t *rule = map_match(map, url, url_len);
+    if (rule == NULL) {
+        return CWHTTPD_STATUS_NOTFOUND;
+    }
+
+    const char *rest = url + rule->from_len;
+    size_t rest_len = rule->append ? url_len - rule->from_len : 0;
+
+    if (rule->code == 0) {
+        if (!rule->append) {
+            conn->request.url = rule->to;
+            return CWHTTPD_STATUS_NOTFOUND;
+        }
+
+        /* the old URL can live in url_buf, so build the new one first */
+        char *buf = malloc(rule->to_len + rest_len + 1);
+        if (buf == NULL) {
+            LOGE(__func__, "malloc failed");
+            return CWHTTPD_STATUS_FAIL;
+        }
+        memcpy(buf, rule->to, rule->to_len);
+        memcpy(buf + rule->to_len, rest, rest_len);
+        buf[rule->to_len + rest_len] = '\0';
+        free(conn->priv.url_buf);
+        conn->priv.url_buf = buf;
+        conn->request.url = buf;
+        return CWHTTPD_STATUS_NOTFOUND;
+    }
+
+    const char *args = conn->request.args;
+    size_t args_len = args ? strlen(args) : 0;
+    if (rule->headers && args_len == 0) {
+        cwhttpd_send_response(conn, rule->code, rule->headers,
+                rule->headers_len, NULL, 0);
         return CWHTTPD_STATUS_DONE;
     }
 
-    sprintf(buf, uri_fmt, new_hostname);
-    LOGD(__func__, "redirecting to %s", buf);
-    cwhttpd_redirect(conn, buf);
-    free(buf);
+    char stack_buf[256];
+    char *headers = stack_buf;
+    size_t len = sizeof("Location: \r\n") - 1 + rule->to_len + rest_len +
+            (args_len ? args_len + 1 : 0);
+    if (len > sizeof(stack_buf)) {
+        headers = malloc(len);
+        if (headers == NULL) {
+            LOGE(__func__, "malloc failed");
+            return CWHTTPD_STATUS_FAIL;
+        }
+    }
+
+    char *p = headers;
+    memcpy(p, "Location: ", 10);
+    p += 10;
+    memcpy(p, rule->to, rule->to_len);
+    p += rule->to_len;
+    memcpy(p, rest, rest_len);
+    p += rest_len;
+    if (args_len) {
+        *p++ = rule->has_query ? '&' : '?';
+        memcpy(p, args, args_len);
+        p += args_len;
+    }
+    memcpy(p, "\r\n", 2);
+
+    cwhttpd_send_response(conn, rule->code, headers, len, NULL, 0);
+    if (headers != stack_buf) {
+        free(headers);
+    }
     return CWHTTPD_STATUS_DONE;
 }
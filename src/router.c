@@ -0,0 +1,1001 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/*
+Route tables and the compressed radix tree used to dispatch requests.
+
+Every route path is a key in the tree. Exact paths are stored at the node
+where their key ends, and paths ending in '*' are stored without the '*' as
+prefix routes. Each entry remembers its position in the route table, so a
+lookup can return the next matching route after a given position. This
+keeps the ordered fallthrough semantics of a route list while only walking
+the URL once. Routes with a method mask are skipped when the request method
+is not in it, so their handlers are never called just to decline.
+
+A path segment of the form :name captures one non-empty URL segment. Every
+node has at most one capture child, whatever the capture is named, and static
+edge labels stop before a capture. Matching tries both the static and the
+capture child, keeping the spans of the best match as it goes. Names are only
+resolved from the route path when a handler asks for one.
+
+A table can also refer to a static route table compiled by routegen.py.
+Static routes come first in dispatch order. Their exact paths are found with
+a CHD perfect hash, and their wildcard prefixes by a binary search for the
+greatest prefix not above the URL. Every prefix that matches the URL is on
+the parent chain of that one.
+
+Every virtual host has its own route table, and a host map selects the
+table for a request by a hash of its Host header, falling back to the default
+table. A host whose last route is removed leaves the map again.
+
+Host maps and route tables are immutable once published. Writers serialize
+on a mutex, build a new table and a new map pointing at it, and swap the map
+in atomically. Readers claim a slot tagged with the current epoch only while
+they look a route up, falling back to the writer lock if all slots are
+taken. A replaced map is retired with the epoch it was replaced in and freed
+once every claimed slot carries a later epoch, along with the table it
+dropped.
+
+Routes added at runtime are reference counted. The tables hold one reference
+between them, which the retired map that dropped a route gives up, and a
+request holds another while its handler runs. A long running handler, such
+as a WebSocket session, keeps only its own route alive.
+*/
+
+#include "kref.h"
+#include "log.h"
+#include "router.h"
+#include "cwhttpd/httpd.h"
+#include "cwhttpd/port.h"
+
+#include <ctype.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+
+/* Every worker holds at most one reader slot at a time */
+#define ROUTER_READERS CONFIG_CWHTTPD_WORKER_COUNT
+
+
+typedef struct router_entry_t router_entry_t;
+typedef struct router_list_t router_list_t;
+typedef struct router_match_t router_match_t;
+typedef struct router_node_t router_node_t;
+typedef struct router_route_t router_route_t;
+
+struct router_route_t {
+    struct kref ref;
+    cwhttpd_route_t route; /**< must be last, it ends in argv */
+};
+
+struct router_entry_t {
+    size_t pos; /**< position in the route table */
+    const cwhttpd_route_t *route;
+};
+
+struct router_list_t {
+    router_entry_t *entries; /**< entries, sorted by position */
+    size_t count;
+};
+
+struct router_node_t {
+    const char *label; /**< edge label, points into a route path */
+    size_t label_len;
+    router_node_t **children;
+    size_t num_children;
+    router_list_t exact; /**< routes whose path ends here */
+    router_list_t prefix; /**< wildcard routes whose prefix ends here */
+    router_node_t *param; /**< child matching a captured segment */
+};
+
+struct router_table_t {
+    char *host; /**< lowercase host name, NULL for the default table */
+    size_t host_len;
+    uint32_t hash; /**< host name hash */
+    const cwhttpd_static_routes_t *statics; /**< static routes, tried
+            first */
+    cwhttpd_route_t **routes; /**< routes in dispatch order */
+    size_t num_routes;
+    router_node_t root;
+};
+
+struct router_map_t {
+    router_table_t *fallback; /**< default table */
+    router_table_t **hosts; /**< tables by host hash, linear probing */
+    size_t mask; /**< number of host slots - 1 */
+    size_t num_hosts;
+    router_table_t *replaced; /**< table dropped by the next map */
+    cwhttpd_route_t *orphan; /**< route dropped by the next map */
+    unsigned long epoch; /**< epoch this map was retired in */
+    router_map_t *next; /**< next retired map */
+};
+
+struct router_match_t {
+    uint32_t method; /**< request method mask */
+    size_t pos; /**< first table position to consider */
+    const router_entry_t *best; /**< best entry so far */
+    cwhttpd_span_t spans[CONFIG_CWHTTPD_MAX_ROUTE_PARAMS]; /**< segments
+            captured on the current walk */
+    size_t num_spans;
+    cwhttpd_span_t *captures; /**< segments captured for the best entry */
+};
+
+struct cwhttpd_router_t {
+    _Atomic(router_map_t *) map; /**< current host map */
+    atomic_ulong epoch; /**< current epoch, starts at 1 */
+    atomic_ulong readers[ROUTER_READERS]; /**< reader epochs, 0 if free */
+    cwhttpd_mutex_t *lock; /**< writer lock */
+    router_map_t *retired_head; /**< retired maps, oldest first */
+    router_map_t *retired_tail;
+};
+
+
+cwhttpd_route_t *router_route_alloc(size_t argc)
+{
+    router_route_t *r = calloc(1, sizeof(router_route_t) +
+            sizeof(void *) * argc);
+    if (r == NULL) {
+        LOGE(__func__, "calloc failed");
+        return NULL;
+    }
+    kref_init(&r->ref);
+    return &r->route;
+}
+
+static void route_release(struct kref *ref)
+{
+    free(kcontainer_of(ref, router_route_t, ref));
+}
+
+static void route_put(cwhttpd_route_t *route)
+{
+    if (route != NULL) {
+        kref_put(&kcontainer_of(route, router_route_t, route)->ref,
+                route_release);
+    }
+}
+
+static bool list_append(router_list_t *list, size_t pos,
+        const cwhttpd_route_t *route)
+{
+    router_entry_t *entries = realloc(list->entries,
+            sizeof(router_entry_t) * (list->count + 1));
+    if (entries == NULL) {
+        return false;
+    }
+    entries[list->count].pos = pos;
+    entries[list->count].route = route;
+    list->entries = entries;
+    list->count++;
+    return true;
+}
+
+static void list_match(const router_list_t *list, router_match_t *m)
+{
+    for (size_t i = 0; i < list->count; i++) {
+        const router_entry_t *entry = &list->entries[i];
+        if (entry->route->methods && !(entry->route->methods & m->method)) {
+            continue;
+        }
+        if (entry->pos >= m->pos) {
+            if (m->best == NULL || entry->pos < m->best->pos) {
+                m->best = entry;
+                memcpy(m->captures, m->spans,
+                        sizeof(cwhttpd_span_t) * m->num_spans);
+            }
+            return;
+        }
+    }
+}
+
+/* Length of a route path without its trailing wildcard */
+static size_t path_key_len(const cwhttpd_route_t *route, bool *wildcard)
+{
+    *wildcard = route->path_len > 0 && route->path[route->path_len - 1] == '*';
+    return route->path_len - *wildcard;
+}
+
+/* Return the start of the next capture in a route path, or end */
+static const char *next_capture(const char *path, const char *p,
+        const char *end)
+{
+    for (; p < end; p++) {
+        if (*p == ':' && p > path && p[-1] == '/') {
+            break;
+        }
+    }
+    return p;
+}
+
+/* Return the end of the capture name at p */
+static const char *capture_end(const char *p, const char *end)
+{
+    p++;
+    while (p < end && *p != '/') {
+        p++;
+    }
+    return p;
+}
+
+static size_t count_captures(const cwhttpd_route_t *route)
+{
+    bool wildcard;
+    const char *end = route->path + path_key_len(route, &wildcard);
+    size_t count = 0;
+
+    const char *p = next_capture(route->path, route->path, end);
+    while (p < end) {
+        count++;
+        p = next_capture(route->path, capture_end(p, end), end);
+    }
+    return count;
+}
+
+static router_node_t *node_child(const router_node_t *node, char c)
+{
+    for (size_t i = 0; i < node->num_children; i++) {
+        if (node->children[i]->label[0] == c) {
+            return node->children[i];
+        }
+    }
+    return NULL;
+}
+
+static router_node_t *node_add_child(router_node_t *node, const char *label,
+        size_t label_len)
+{
+    router_node_t **children = realloc(node->children,
+            sizeof(router_node_t *) * (node->num_children + 1));
+    if (children == NULL) {
+        return NULL;
+    }
+    node->children = children;
+
+    router_node_t *child = calloc(1, sizeof(router_node_t));
+    if (child == NULL) {
+        return NULL;
+    }
+    child->label = label;
+    child->label_len = label_len;
+    node->children[node->num_children++] = child;
+    return child;
+}
+
+static void node_free(router_node_t *node)
+{
+    for (size_t i = 0; i < node->num_children; i++) {
+        node_free(node->children[i]);
+        free(node->children[i]);
+    }
+    free(node->children);
+    free(node->exact.entries);
+    free(node->prefix.entries);
+    if (node->param) {
+        node_free(node->param);
+        free(node->param);
+    }
+}
+
+static bool tree_insert(router_node_t *root, size_t pos,
+        const cwhttpd_route_t *route)
+{
+    bool wildcard;
+    const char *key = route->path;
+    const char *end = key + path_key_len(route, &wildcard);
+
+    router_node_t *node = root;
+    while (key < end) {
+        const char *capture = next_capture(route->path, key, end);
+        if (capture == key) {
+            if (node->param == NULL) {
+                node->param = calloc(1, sizeof(router_node_t));
+                if (node->param == NULL) {
+                    return false;
+                }
+            }
+            node = node->param;
+            key = capture_end(key, end);
+            continue;
+        }
+
+        /* static labels stop before the next capture */
+        size_t key_len = capture - key;
+        router_node_t *child = node_child(node, *key);
+        if (child == NULL) {
+            node = node_add_child(node, key, key_len);
+            if (node == NULL) {
+                return false;
+            }
+            key += key_len;
+            continue;
+        }
+
+        size_t common = 1;
+        while (common < child->label_len && common < key_len &&
+                child->label[common] == key[common]) {
+            common++;
+        }
+
+        if (common < child->label_len) {
+            /* split the edge, the new node takes over the child's slot */
+            router_node_t *mid = calloc(1, sizeof(router_node_t));
+            if (mid == NULL) {
+                return false;
+            }
+            mid->children = malloc(sizeof(router_node_t *));
+            if (mid->children == NULL) {
+                free(mid);
+                return false;
+            }
+            mid->label = child->label;
+            mid->label_len = common;
+            mid->children[0] = child;
+            mid->num_children = 1;
+            child->label += common;
+            child->label_len -= common;
+            for (size_t i = 0; i < node->num_children; i++) {
+                if (node->children[i] == child) {
+                    node->children[i] = mid;
+                    break;
+                }
+            }
+            child = mid;
+        }
+
+        node = child;
+        key += common;
+    }
+
+    return list_append(wildcard ? &node->prefix : &node->exact, pos, route);
+}
+
+/* Length of a host name without port and trailing dot */
+static size_t host_len(const char *host)
+{
+    size_t len;
+
+    if (host[0] == '[') {
+        const char *end = strchr(host, ']');
+        len = end ? end - host + 1 : strlen(host);
+    } else {
+        len = strcspn(host, ":");
+    }
+    if (len > 0 && host[len - 1] == '.') {
+        len--;
+    }
+    return len;
+}
+
+/* FNV-1a over the lowercase host name */
+static uint32_t host_hash(const char *host, size_t len)
+{
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char) tolower((unsigned char) host[i]);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void table_free(router_table_t *table)
+{
+    node_free(&table->root);
+    free(table->routes);
+    free(table->host);
+    free(table);
+}
+
+static router_table_t *table_build(const char *host,
+        const cwhttpd_static_routes_t *statics, cwhttpd_route_t **routes,
+        size_t num_routes)
+{
+    router_table_t *table = calloc(1, sizeof(router_table_t));
+    if (table == NULL) {
+        LOGE(__func__, "calloc failed");
+        return NULL;
+    }
+
+    if (host) {
+        table->host_len = host_len(host);
+        table->hash = host_hash(host, table->host_len);
+        table->host = malloc(table->host_len + 1);
+        if (table->host == NULL) {
+            LOGE(__func__, "malloc failed");
+            free(table);
+            return NULL;
+        }
+        for (size_t i = 0; i < table->host_len; i++) {
+            table->host[i] = tolower((unsigned char) host[i]);
+        }
+        table->host[table->host_len] = '\0';
+    }
+
+    for (size_t pos = 0; pos < num_routes; pos++) {
+        if (!tree_insert(&table->root, pos, routes[pos])) {
+            LOGE(__func__, "out of memory");
+            table_free(table);
+            return NULL;
+        }
+    }
+    table->statics = statics;
+    table->routes = routes;
+    table->num_routes = num_routes;
+
+    return table;
+}
+
+static void map_free(router_map_t *map)
+{
+    if (map->replaced) {
+        table_free(map->replaced);
+    }
+    route_put(map->orphan);
+    free(map->hosts);
+    free(map);
+}
+
+static router_table_t *map_lookup(const router_map_t *map, const char *host,
+        size_t len, uint32_t hash)
+{
+    if (map->num_hosts == 0) {
+        return NULL;
+    }
+
+    for (size_t i = hash & map->mask; map->hosts[i];
+            i = (i + 1) & map->mask) {
+        router_table_t *table = map->hosts[i];
+        if (table->hash == hash && table->host_len == len &&
+                strncasecmp(table->host, host, len) == 0) {
+            return table;
+        }
+    }
+    return NULL;
+}
+
+static router_table_t *map_find(const router_map_t *map, const char *host)
+{
+    if (host == NULL) {
+        return map->fallback;
+    }
+    size_t len = host_len(host);
+    return map_lookup(map, host, len, host_hash(host, len));
+}
+
+static void map_add(router_map_t *map, router_table_t *table)
+{
+    size_t i = table->hash & map->mask;
+    while (map->hosts[i]) {
+        i = (i + 1) & map->mask;
+    }
+    map->hosts[i] = table;
+    map->num_hosts++;
+}
+
+/* Copy a map, with table old replaced by table new. Either can be NULL to
+ * add or drop a host table. */
+static router_map_t *map_replace(const router_map_t *map, router_table_t *old,
+        router_table_t *new)
+{
+    router_map_t *copy = calloc(1, sizeof(router_map_t));
+    if (copy == NULL) {
+        LOGE(__func__, "calloc failed");
+        return NULL;
+    }
+
+    copy->fallback = map->fallback;
+    if (old == map->fallback) {
+        copy->fallback = new;
+        new = NULL;
+    }
+
+    size_t num_hosts = map->num_hosts + (new ? 1 : 0);
+    if (num_hosts > 0) {
+        /* keep the load factor at or below one half */
+        size_t slots = 2;
+        while (slots < num_hosts * 2) {
+            slots <<= 1;
+        }
+        copy->hosts = calloc(slots, sizeof(router_table_t *));
+        if (copy->hosts == NULL) {
+            LOGE(__func__, "calloc failed");
+            free(copy);
+            return NULL;
+        }
+        copy->mask = slots - 1;
+    }
+
+    for (size_t i = 0; map->num_hosts && i <= map->mask; i++) {
+        if (map->hosts[i] && map->hosts[i] != old) {
+            map_add(copy, map->hosts[i]);
+        }
+    }
+    if (new) {
+        map_add(copy, new);
+    }
+
+    return copy;
+}
+
+static void reclaim(cwhttpd_router_t *router)
+{
+    unsigned long oldest = ULONG_MAX;
+
+    for (size_t i = 0; i < ROUTER_READERS; i++) {
+        unsigned long epoch = atomic_load(&router->readers[i]);
+        if (epoch != 0 && epoch < oldest) {
+            oldest = epoch;
+        }
+    }
+
+    while (router->retired_head && router->retired_head->epoch < oldest) {
+        router_map_t *map = router->retired_head;
+        router->retired_head = map->next;
+        map_free(map);
+    }
+    if (router->retired_head == NULL) {
+        router->retired_tail = NULL;
+    }
+}
+
+/* Must be called with the writer lock held */
+static void publish(cwhttpd_router_t *router, router_map_t *map,
+        router_table_t *replaced, cwhttpd_route_t *orphan)
+{
+    router_map_t *old = atomic_exchange(&router->map, map);
+    old->replaced = replaced;
+    old->orphan = orphan;
+    old->epoch = atomic_fetch_add(&router->epoch, 1);
+    if (router->retired_tail) {
+        router->retired_tail->next = old;
+    } else {
+        router->retired_head = old;
+    }
+    router->retired_tail = old;
+    reclaim(router);
+}
+
+/* Must be called with the writer lock held. Publishes a table with the given
+ * routes in place of table old, consuming routes even on failure. */
+static bool replace_table(cwhttpd_router_t *router, const char *host,
+        router_table_t *old, const cwhttpd_static_routes_t *statics,
+        cwhttpd_route_t **routes, size_t num_routes, cwhttpd_route_t *orphan)
+{
+    const router_map_t *map = atomic_load(&router->map);
+    router_table_t *table = NULL;
+
+    /* a host without routes leaves the map, the default table stays */
+    if (num_routes > 0 || statics || host == NULL) {
+        table = table_build(host, statics, routes, num_routes);
+        if (table == NULL) {
+            free(routes);
+            return false;
+        }
+    } else {
+        free(routes);
+    }
+
+    router_map_t *copy = map_replace(map, old, table);
+    if (copy == NULL) {
+        if (table) {
+            table_free(table);
+        }
+        return false;
+    }
+
+    publish(router, copy, old, orphan);
+    return true;
+}
+
+static size_t normalize_index(ssize_t index, size_t count)
+{
+    if (index < 0) {
+        index = count + index;
+        if (index < 0 || index >= count) {
+            index = 0;
+        }
+    } else if (index > count) {
+        index = count;
+    }
+    return index;
+}
+
+cwhttpd_router_t *router_create(void)
+{
+    cwhttpd_router_t *router = calloc(1, sizeof(cwhttpd_router_t));
+    if (router == NULL) {
+        LOGE(__func__, "calloc failed");
+        return NULL;
+    }
+
+    router->lock = cwhttpd_mutex_create(false);
+    router_map_t *map = calloc(1, sizeof(router_map_t));
+    if (map) {
+        map->fallback = table_build(NULL, NULL, NULL, 0);
+    }
+    if (router->lock == NULL || map == NULL || map->fallback == NULL) {
+        if (router->lock) {
+            cwhttpd_mutex_delete(router->lock);
+        }
+        free(map);
+        free(router);
+        return NULL;
+    }
+
+    atomic_init(&router->map, map);
+    atomic_init(&router->epoch, 1);
+    for (size_t i = 0; i < ROUTER_READERS; i++) {
+        atomic_init(&router->readers[i], 0);
+    }
+    return router;
+}
+
+static void table_destroy(router_table_t *table)
+{
+    for (size_t i = 0; i < table->num_routes; i++) {
+        route_put(table->routes[i]);
+    }
+    table_free(table);
+}
+
+void router_destroy(cwhttpd_router_t *router)
+{
+    if (router == NULL) {
+        return;
+    }
+
+    while (router->retired_head) {
+        router_map_t *map = router->retired_head;
+        router->retired_head = map->next;
+        map_free(map);
+    }
+
+    router_map_t *map = atomic_load(&router->map);
+    for (size_t i = 0; map->num_hosts && i <= map->mask; i++) {
+        if (map->hosts[i]) {
+            table_destroy(map->hosts[i]);
+        }
+    }
+    table_destroy(map->fallback);
+    map_free(map);
+
+    cwhttpd_mutex_delete(router->lock);
+    free(router);
+}
+
+bool router_insert(cwhttpd_router_t *router, const char *host, ssize_t index,
+        cwhttpd_route_t *route)
+{
+    if (count_captures(route) > CONFIG_CWHTTPD_MAX_ROUTE_PARAMS) {
+        LOGE(__func__, "too many captures in %s", route->path);
+        return false;
+    }
+
+    cwhttpd_mutex_lock(router->lock);
+    router_table_t *old = map_find(atomic_load(&router->map), host);
+    size_t num_routes = old ? old->num_routes : 0;
+    size_t pos = normalize_index(index, num_routes);
+
+    cwhttpd_route_t **routes = malloc(sizeof(cwhttpd_route_t *) *
+            (num_routes + 1));
+    if (routes == NULL) {
+        LOGE(__func__, "malloc failed");
+        cwhttpd_mutex_unlock(router->lock);
+        return false;
+    }
+    if (old) {
+        memcpy(routes, old->routes, sizeof(cwhttpd_route_t *) * pos);
+        memcpy(routes + pos + 1, old->routes + pos,
+                sizeof(cwhttpd_route_t *) * (num_routes - pos));
+    }
+    routes[pos] = route;
+
+    bool ok = replace_table(router, host, old, old ? old->statics : NULL,
+            routes, num_routes + 1, NULL);
+    cwhttpd_mutex_unlock(router->lock);
+    return ok;
+}
+
+void router_remove(cwhttpd_router_t *router, const char *host, ssize_t index)
+{
+    cwhttpd_mutex_lock(router->lock);
+    router_table_t *old = map_find(atomic_load(&router->map), host);
+    if (old == NULL || old->num_routes == 0) {
+        cwhttpd_mutex_unlock(router->lock);
+        return;
+    }
+    size_t pos = normalize_index(index, old->num_routes);
+    if (pos == old->num_routes) {
+        pos--;
+    }
+
+    cwhttpd_route_t **routes = NULL;
+    if (old->num_routes > 1) {
+        routes = malloc(sizeof(cwhttpd_route_t *) * (old->num_routes - 1));
+        if (routes == NULL) {
+            LOGE(__func__, "malloc failed");
+            cwhttpd_mutex_unlock(router->lock);
+            return;
+        }
+        memcpy(routes, old->routes, sizeof(cwhttpd_route_t *) * pos);
+        memcpy(routes + pos, old->routes + pos + 1,
+                sizeof(cwhttpd_route_t *) * (old->num_routes - pos - 1));
+    }
+
+    replace_table(router, host, old, old->statics, routes,
+            old->num_routes - 1, old->routes[pos]);
+    cwhttpd_mutex_unlock(router->lock);
+}
+
+void router_set_static(cwhttpd_router_t *router, const char *host,
+        const cwhttpd_static_routes_t *statics)
+{
+    cwhttpd_mutex_lock(router->lock);
+    router_table_t *old = map_find(atomic_load(&router->map), host);
+    size_t num_routes = old ? old->num_routes : 0;
+    if ((old ? old->statics : NULL) == statics) {
+        cwhttpd_mutex_unlock(router->lock);
+        return;
+    }
+
+    cwhttpd_route_t **routes = NULL;
+    if (num_routes > 0) {
+        routes = malloc(sizeof(cwhttpd_route_t *) * num_routes);
+        if (routes == NULL) {
+            LOGE(__func__, "malloc failed");
+            cwhttpd_mutex_unlock(router->lock);
+            return;
+        }
+        memcpy(routes, old->routes, sizeof(cwhttpd_route_t *) * num_routes);
+    }
+
+    replace_table(router, host, old, statics, routes, num_routes, NULL);
+    cwhttpd_mutex_unlock(router->lock);
+}
+
+cwhttpd_route_t *router_get(cwhttpd_router_t *router, const char *host,
+        ssize_t index)
+{
+    cwhttpd_mutex_lock(router->lock);
+    const router_table_t *table = map_find(atomic_load(&router->map), host);
+    cwhttpd_route_t *route = NULL;
+    if (table && table->num_routes > 0) {
+        size_t pos = normalize_index(index, table->num_routes);
+        if (pos == table->num_routes) {
+            pos--;
+        }
+        route = table->routes[pos];
+    }
+    cwhttpd_mutex_unlock(router->lock);
+    return route;
+}
+
+/* Readers only hold a slot while they look a route up. If every slot is
+ * taken, the writer lock keeps the map from being retired just as well. */
+static const router_map_t *router_enter(cwhttpd_router_t *router,
+        size_t *slot)
+{
+    unsigned long epoch = atomic_load(&router->epoch);
+    for (size_t i = 0; i < ROUTER_READERS; i++) {
+        unsigned long expected = 0;
+        if (atomic_compare_exchange_strong(&router->readers[i], &expected,
+                epoch)) {
+            *slot = i;
+            return atomic_load(&router->map);
+        }
+    }
+
+    cwhttpd_mutex_lock(router->lock);
+    *slot = ROUTER_READERS;
+    return atomic_load(&router->map);
+}
+
+static void router_leave(cwhttpd_router_t *router, size_t slot)
+{
+    if (slot == ROUTER_READERS) {
+        cwhttpd_mutex_unlock(router->lock);
+    } else {
+        atomic_store(&router->readers[slot], 0);
+    }
+}
+
+static const router_table_t *router_select(const router_map_t *map,
+        const char *host)
+{
+    if (host && map->num_hosts > 0) {
+        size_t len = host_len(host);
+        const router_table_t *table = map_lookup(map, host, len,
+                host_hash(host, len));
+        if (table) {
+            return table;
+        }
+    }
+    return map->fallback;
+}
+
+/* Must be kept in sync with route_hash() in tools/routegen.py */
+uint32_t router_static_hash(const char *s, size_t len, uint32_t seed)
+{
+    uint32_t hash = 2166136261u ^ seed;
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char) s[i];
+        hash *= 16777619u;
+    }
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+/* Lowest route index of a key at or after pos, accepting the method */
+static size_t static_key_match(const cwhttpd_static_routes_t *statics,
+        const cwhttpd_static_key_t *key, uint32_t method, size_t pos)
+{
+    const uint16_t *index = statics->indexes + key->first;
+
+    for (size_t i = 0; i < key->count; i++) {
+        const cwhttpd_route_t *route = statics->routes[index[i]];
+        if (index[i] >= pos &&
+                (route->methods == 0 || route->methods & method)) {
+            return index[i];
+        }
+    }
+    return SIZE_MAX;
+}
+
+static size_t static_match(const cwhttpd_static_routes_t *statics,
+        uint32_t method, const char *url, size_t pos)
+{
+    size_t best = SIZE_MAX;
+
+    if (statics->num_slots > 0) {
+        size_t len = strlen(url);
+        uint32_t bucket = router_static_hash(url, len, 0) %
+                statics->num_buckets;
+        uint32_t slot = router_static_hash(url, len,
+                statics->seeds[bucket]) % statics->num_slots;
+        const cwhttpd_static_key_t *key = &statics->exact[slot];
+        if (key->path && key->path_len == len &&
+                memcmp(key->path, url, len) == 0) {
+            best = static_key_match(statics, key, method, pos);
+        }
+    }
+
+    /* find the greatest prefix that is not above the URL */
+    size_t lo = 0, hi = statics->num_prefixes;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        const cwhttpd_static_key_t *key = &statics->prefixes[mid];
+        if (strncmp(key->path, url, key->path_len) <= 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    size_t i = lo > 0 ? lo - 1 : CWHTTPD_STATIC_NONE;
+    while (i != CWHTTPD_STATIC_NONE) {
+        const cwhttpd_static_key_t *key = &statics->prefixes[i];
+        if (strncmp(key->path, url, key->path_len) == 0) {
+            size_t index = static_key_match(statics, key, method, pos);
+            if (index < best) {
+                best = index;
+            }
+        }
+        i = key->parent;
+    }
+
+    return best;
+}
+
+static void node_match(const router_node_t *node, const char *url,
+        router_match_t *m)
+{
+    while (true) {
+        if (m->best && m->best->pos == m->pos) {
+            /* nothing can come before the best entry */
+            return;
+        }
+
+        list_match(&node->prefix, m);
+        if (node->param && *url != '\0' && *url != '/') {
+            size_t len = strcspn(url, "/");
+            m->spans[m->num_spans].ptr = url;
+            m->spans[m->num_spans].len = len;
+            m->num_spans++;
+            node_match(node->param, url + len, m);
+            m->num_spans--;
+        }
+        if (*url == '\0') {
+            list_match(&node->exact, m);
+            return;
+        }
+
+        node = node_child(node, *url);
+        if (node == NULL || strncmp(node->label, url, node->label_len) != 0) {
+            return;
+        }
+        url += node->label_len;
+    }
+}
+
+static const cwhttpd_route_t *router_match(const router_table_t *table,
+        cwhttpd_method_t method, const char *url, size_t *pos,
+        cwhttpd_span_t *captures)
+{
+    const cwhttpd_static_routes_t *statics = table->statics;
+    size_t num_static = statics ? statics->num_routes : 0;
+    router_match_t m = {
+        .method = CWHTTPD_METHOD_MASK(method),
+        .captures = captures,
+    };
+
+    if (*pos < num_static) {
+        size_t index = static_match(statics, m.method, url, *pos);
+        if (index < num_static) {
+            *pos = index + 1;
+            return statics->routes[index];
+        }
+    }
+
+    m.pos = *pos > num_static ? *pos - num_static : 0;
+    node_match(&table->root, url, &m);
+    if (m.best == NULL) {
+        return NULL;
+    }
+    *pos = num_static + m.best->pos + 1;
+    return m.best->route;
+}
+
+const cwhttpd_route_t *router_resolve(cwhttpd_router_t *router,
+        const char *host, cwhttpd_method_t method, const char *url,
+        size_t *pos, cwhttpd_span_t *captures, cwhttpd_route_t **pinned)
+{
+    size_t slot;
+    const router_map_t *map = router_enter(router, &slot);
+    const router_table_t *table = router_select(map, host);
+    const cwhttpd_route_t *route = router_match(table, method, url, pos,
+            captures);
+
+    /* static routes are never freed by the router */
+    size_t num_static = table->statics ? table->statics->num_routes : 0;
+    *pinned = NULL;
+    if (route != NULL && *pos > num_static) {
+        *pinned = table->routes[*pos - num_static - 1];
+        kref_get(&kcontainer_of(*pinned, router_route_t, route)->ref);
+    }
+    router_leave(router, slot);
+    return route;
+}
+
+void router_route_put(cwhttpd_route_t *route)
+{
+    route_put(route);
+}
+
+ssize_t router_param_index(const cwhttpd_route_t *route, const char *name)
+{
+    bool wildcard;
+    const char *end = route->path + path_key_len(route, &wildcard);
+    size_t name_len = strlen(name);
+    ssize_t index = 0;
+
+    const char *p = next_capture(route->path, route->path, end);
+    while (p < end) {
+        const char *e = capture_end(p, end);
+        if (e - p - 1 == name_len && memcmp(p + 1, name, name_len) == 0) {
+            return index;
+        }
+        index++;
+        p = next_capture(route->path, e, end);
+    }
+    return -1;
+}
@@ -0,0 +1,137 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include "cwhttpd/httpd.h"
+
+
+typedef struct router_map_t router_map_t;
+typedef struct router_table_t router_table_t;
+
+/**
+ * \brief Create an empty router
+ *
+ * \return router or NULL on error
+ */
+cwhttpd_router_t *router_create(void);
+
+/**
+ * \brief Free a router, its host map, route tables and routes
+ *
+ * \note There must be no readers left.
+ */
+void router_destroy(
+    cwhttpd_router_t *router /** [in] router, can be NULL */
+);
+
+/**
+ * \brief Allocate a reference counted route with room for argc arguments
+ *
+ * \return zeroed route or NULL on error
+ */
+cwhttpd_route_t *router_route_alloc(
+    size_t argc /** [in] argument count */
+);
+
+/**
+ * \brief Drop a reference to a route from router_route_alloc() or
+ *        router_resolve()
+ */
+void router_route_put(
+    cwhttpd_route_t *route /** [in] route, can be NULL */
+);
+
+/**
+ * \brief Publish a new route table with a route inserted
+ *
+ * Adds the virtual host if it has no routes yet.
+ *
+ * \return true on success, the router owns the route afterwards
+ */
+bool router_insert(
+    cwhttpd_router_t *router, /** [in] router */
+    const char *host, /** [in] virtual host name, NULL for the default */
+    ssize_t index, /** [in] index of route entry, can be negative */
+    cwhttpd_route_t *route /** [in] new route */
+);
+
+/**
+ * \brief Publish a new route table with a route removed
+ *
+ * A virtual host is dropped along with its last route.
+ */
+void router_remove(
+    cwhttpd_router_t *router, /** [in] router */
+    const char *host, /** [in] virtual host name, NULL for the default */
+    ssize_t index /** [in] index of route entry, can be negative */
+);
+
+/**
+ * \brief Publish a new route table with a static route table set
+ */
+void router_set_static(
+    cwhttpd_router_t *router, /** [in] router */
+    const char *host, /** [in] virtual host name, NULL for the default */
+    const cwhttpd_static_routes_t *statics /** [in] static routes or NULL */
+);
+
+/**
+ * \brief Return the route at an index of a current route table
+ *
+ * \return route or NULL if there are no routes
+ */
+cwhttpd_route_t *router_get(
+    cwhttpd_router_t *router, /** [in] router */
+    const char *host, /** [in] virtual host name, NULL for the default */
+    ssize_t index /** [in] index of route entry, can be negative */
+);
+
+/**
+ * \brief Find the first route at or after a table position matching a
+ *        method and URL in the current table of a host
+ *
+ * Positions refer to whichever table is current at each call, so routes
+ * inserted or removed between the calls for one request can shift the
+ * fallthrough by as many entries.
+ *
+ * \return matching route or NULL if there are no more
+ */
+const cwhttpd_route_t *router_resolve(
+    cwhttpd_router_t *router, /** [in] router */
+    const char *host, /** [in] Host header value, can be NULL */
+    cwhttpd_method_t method, /** [in] request method */
+    const char *url, /** [in] request URL */
+    size_t *pos, /** [in,out] first table position to consider, updated to
+                             the position after the returned route */
+    cwhttpd_span_t *captures, /** [out] URL segments captured by the
+                                        returned route, room for
+                                        CONFIG_CWHTTPD_MAX_ROUTE_PARAMS */
+    cwhttpd_route_t **pinned /** [out] reference to pass to
+                                       router_route_put(), NULL for static
+                                       routes */
+);
+
+/**
+ * \brief Return the capture index of a named segment in a route path
+ *
+ * \return index or -1 if the route has no such capture
+ */
+ssize_t router_param_index(
+    const cwhttpd_route_t *route, /** [in] route */
+    const char *name /** [in] capture name without the ':' */
+);
+
+/**
+ * \brief Hash of the perfect hash tables generated at build time
+ *
+ * Must be kept in sync with route_hash() in tools/routegen.py.
+ *
+ * \return hash
+ */
+uint32_t router_static_hash(
+    const char *s, /** [in] key */
+    size_t len, /** [in] length of key */
+    uint32_t seed /** [in] bucket seed, 0 to find the bucket */
+);
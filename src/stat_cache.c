@@ -0,0 +1,348 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "kref.h"
+#include "log.h"
+#include "stat_cache.h"
+#include "cwhttpd/httpd.h"
+#include "cwhttpd/port.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#if defined(STAT_CACHE_MMAP)
+# include <sys/mman.h>
+#endif /* defined(STAT_CACHE_MMAP) */
+#include <unistd.h>
+
+
+/* Hash chains, a power of two */
+#define STAT_CACHE_BUCKETS 64
+
+struct cwhttpd_stat_cache_t {
+    cwhttpd_mutex_t *mutex;
+    stat_cache_entry_t *buckets[STAT_CACHE_BUCKETS];
+    stat_cache_entry_t lru; /**< list head, lru.lru_next is the most recent */
+    size_t entries;
+    size_t max_entries;
+    fs_watch_t *watch;
+    atomic_uint invalidations; /**< bumped whenever the watcher drops entries */
+};
+
+
+static uint32_t path_hash(const char *path)
+{
+    uint32_t hash = 2166136261;
+    while (*path) {
+        hash ^= (uint8_t) *path++;
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+static void entry_release(struct kref *ref)
+{
+    stat_cache_entry_t *entry = kcontainer_of(ref, stat_cache_entry_t, ref);
+#if defined(STAT_CACHE_MMAP)
+    void *map = atomic_load(&entry->map);
+    if (map != NULL) {
+        munmap(map, entry->st.st_size);
+    }
+#endif /* defined(STAT_CACHE_MMAP) */
+    if (entry->fd >= 0) {
+        close(entry->fd);
+    }
+    free(atomic_load(&entry->content_hash));
+    free(entry);
+}
+
+/* Move the content hash of a stale entry to its successor if the file is
+ * still the same */
+static void carry_hash(stat_cache_entry_t *old, stat_cache_entry_t *entry)
+{
+    if (old->err != 0 || entry->err != 0 ||
+            old->st.st_ino != entry->st.st_ino ||
+            old->st.st_dev != entry->st.st_dev ||
+            old->st.st_size != entry->st.st_size ||
+            old->st.st_mtime != entry->st.st_mtime) {
+        return;
+    }
+    atomic_store(&entry->content_hash,
+            atomic_exchange(&old->content_hash, NULL));
+}
+
+/* Expects the cache to be locked, the cache reference is dropped by the
+ * caller */
+static void cache_unlink(cwhttpd_stat_cache_t *cache,
+        stat_cache_entry_t *entry)
+{
+    stat_cache_entry_t **p = &cache->buckets[entry->hash &
+            (STAT_CACHE_BUCKETS - 1)];
+    while (*p != entry) {
+        p = &(*p)->next;
+    }
+    *p = entry->next;
+    entry->lru_prev->lru_next = entry->lru_next;
+    entry->lru_next->lru_prev = entry->lru_prev;
+    cache->entries--;
+}
+
+static stat_cache_entry_t *cache_find(cwhttpd_stat_cache_t *cache,
+        uint32_t hash, const char *path)
+{
+    stat_cache_entry_t *entry = cache->buckets[hash &
+            (STAT_CACHE_BUCKETS - 1)];
+    while (entry != NULL) {
+        if (entry->hash == hash && strcmp(entry->path, path) == 0) {
+            return entry;
+        }
+        entry = entry->next;
+    }
+    return NULL;
+}
+
+static void lru_push(cwhttpd_stat_cache_t *cache, stat_cache_entry_t *entry)
+{
+    entry->lru_prev = &cache->lru;
+    entry->lru_next = cache->lru.lru_next;
+    cache->lru.lru_next->lru_prev = entry;
+    cache->lru.lru_next = entry;
+}
+
+static void cache_flush(cwhttpd_stat_cache_t *cache)
+{
+    while (cache->lru.lru_prev != &cache->lru) {
+        stat_cache_entry_t *entry = cache->lru.lru_prev;
+        cache_unlink(cache, entry);
+        kref_put(&entry->ref, entry_release);
+    }
+}
+
+cwhttpd_stat_cache_t *stat_cache_create(size_t max_entries,
+        fs_watch_t *watch)
+{
+    cwhttpd_stat_cache_t *cache = calloc(1, sizeof(cwhttpd_stat_cache_t));
+    if (cache == NULL) {
+        LOGE(__func__, "calloc failed");
+        return NULL;
+    }
+
+    cache->mutex = cwhttpd_mutex_create(false);
+    if (cache->mutex == NULL) {
+        LOGE(__func__, "cwhttpd_mutex_create failed");
+        free(cache);
+        return NULL;
+    }
+    cache->lru.lru_prev = &cache->lru;
+    cache->lru.lru_next = &cache->lru;
+    cache->max_entries = max_entries;
+    cache->watch = watch;
+    atomic_init(&cache->invalidations, 0);
+
+    return cache;
+}
+
+void stat_cache_destroy(cwhttpd_stat_cache_t *cache)
+{
+    if (cache == NULL) {
+        return;
+    }
+
+    cache_flush(cache);
+    cwhttpd_mutex_delete(cache->mutex);
+    free(cache);
+}
+
+stat_cache_entry_t *stat_cache_get(cwhttpd_stat_cache_t *cache,
+        const char *path)
+{
+    if (cache == NULL) {
+        return NULL;
+    }
+
+    uint32_t hash = path_hash(path);
+    uint32_t now = cwhttpd_time_ms();
+
+    cwhttpd_mutex_lock(cache->mutex);
+    stat_cache_entry_t *stale = NULL;
+    stat_cache_entry_t *entry = cache_find(cache, hash, path);
+    if (entry != NULL) {
+        if (entry->watched || (int32_t) (entry->expires - now) > 0) {
+            kref_get(&entry->ref);
+            entry->lru_prev->lru_next = entry->lru_next;
+            entry->lru_next->lru_prev = entry->lru_prev;
+            lru_push(cache, entry);
+            cwhttpd_mutex_unlock(cache->mutex);
+            return entry;
+        }
+        /* the cache reference is kept until the hash is carried over */
+        cache_unlink(cache, entry);
+        stale = entry;
+    }
+    cwhttpd_mutex_unlock(cache->mutex);
+
+    /* The filesystem is only touched outside of the lock. Any invalidation
+     * from here on may concern the result. */
+    bool watched = fs_watch_dir(cache->watch, path);
+    unsigned int invalidations = atomic_load(&cache->invalidations);
+
+    size_t path_len = strlen(path);
+    entry = malloc(sizeof(stat_cache_entry_t) + path_len + 1);
+    if (entry == NULL) {
+        LOGE(__func__, "malloc failed");
+        if (stale != NULL) {
+            kref_put(&stale->ref, entry_release);
+        }
+        return NULL;
+    }
+    kref_init(&entry->ref);
+    entry->hash = hash;
+    entry->fd = -1;
+#if defined(STAT_CACHE_MMAP)
+    atomic_init(&entry->map, NULL);
+#endif /* defined(STAT_CACHE_MMAP) */
+    atomic_init(&entry->mime, NULL);
+    atomic_init(&entry->content_hash, NULL);
+    memcpy(entry->path, path, path_len + 1);
+
+    int ret = watched ? lstat(path, &entry->st) : stat(path, &entry->st);
+    if (ret == 0 && S_ISLNK(entry->st.st_mode)) {
+        /* changes of a link target are not reported */
+        watched = false;
+        ret = stat(path, &entry->st);
+    }
+    entry->err = ret != 0 ? errno : 0;
+#if defined(STAT_CACHE_FDS)
+    if (entry->err == 0 && S_ISREG(entry->st.st_mode)) {
+        /* the stat result describes the file that was opened */
+        entry->fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (entry->fd >= 0 && fstat(entry->fd, &entry->st) != 0) {
+            close(entry->fd);
+            entry->fd = -1;
+        }
+    }
+#endif /* defined(STAT_CACHE_FDS) */
+    entry->expires = now + (entry->err ? CONFIG_CWHTTPD_STAT_CACHE_NEG_TTL_MS :
+            CONFIG_CWHTTPD_STAT_CACHE_TTL_MS);
+    if (stale != NULL) {
+        carry_hash(stale, entry);
+        kref_put(&stale->ref, entry_release);
+    }
+
+    cwhttpd_mutex_lock(cache->mutex);
+    entry->watched = watched &&
+            atomic_load(&cache->invalidations) == invalidations;
+    stat_cache_entry_t *old = cache_find(cache, hash, path);
+    if (old != NULL) {
+        cache_unlink(cache, old);
+        kref_put(&old->ref, entry_release);
+    }
+    while (cache->entries >= cache->max_entries) {
+        stat_cache_entry_t *victim = cache->lru.lru_prev;
+        cache_unlink(cache, victim);
+        kref_put(&victim->ref, entry_release);
+    }
+    kref_get(&entry->ref);
+    stat_cache_entry_t **bucket = &cache->buckets[hash &
+            (STAT_CACHE_BUCKETS - 1)];
+    entry->next = *bucket;
+    *bucket = entry;
+    lru_push(cache, entry);
+    cache->entries++;
+    cwhttpd_mutex_unlock(cache->mutex);
+
+    return entry;
+}
+
+#if defined(STAT_CACHE_MMAP)
+const uint8_t *stat_cache_entry_map(stat_cache_entry_t *entry)
+{
+    void *map = atomic_load(&entry->map);
+    if (map != NULL || entry->fd < 0 || entry->st.st_size == 0) {
+        return map;
+    }
+
+    map = mmap(NULL, entry->st.st_size, PROT_READ, MAP_SHARED, entry->fd, 0);
+    if (map == MAP_FAILED) {
+        LOGW(__func__, "mmap %d", errno);
+        return NULL;
+    }
+
+    /* another worker may have been faster */
+    void *expected = NULL;
+    if (!atomic_compare_exchange_strong(&entry->map, &expected, map)) {
+        munmap(map, entry->st.st_size);
+        map = expected;
+    }
+    return map;
+}
+#endif /* defined(STAT_CACHE_MMAP) */
+
+bool stat_cache_entry_get_hash(stat_cache_entry_t *entry, uint64_t *hash)
+{
+    const uint64_t *stored = atomic_load(&entry->content_hash);
+    if (stored == NULL) {
+        return false;
+    }
+    *hash = *stored;
+    return true;
+}
+
+void stat_cache_entry_set_hash(stat_cache_entry_t *entry, uint64_t hash)
+{
+    uint64_t *stored = malloc(sizeof(*stored));
+    if (stored == NULL) {
+        return;
+    }
+    *stored = hash;
+
+    /* another worker may have been faster */
+    uint64_t *expected = NULL;
+    if (!atomic_compare_exchange_strong(&entry->content_hash, &expected,
+            stored)) {
+        free(stored);
+    }
+}
+
+void stat_cache_invalidate(cwhttpd_stat_cache_t *cache, const char *path)
+{
+    if (cache == NULL) {
+        return;
+    }
+
+    uint32_t hash = path_hash(path);
+
+    cwhttpd_mutex_lock(cache->mutex);
+    atomic_fetch_add(&cache->invalidations, 1);
+    stat_cache_entry_t *entry = cache_find(cache, hash, path);
+    if (entry != NULL) {
+        cache_unlink(cache, entry);
+        kref_put(&entry->ref, entry_release);
+    }
+    cwhttpd_mutex_unlock(cache->mutex);
+}
+
+void stat_cache_flush(cwhttpd_stat_cache_t *cache)
+{
+    if (cache == NULL) {
+        return;
+    }
+
+    cwhttpd_mutex_lock(cache->mutex);
+    atomic_fetch_add(&cache->invalidations, 1);
+    cache_flush(cache);
+    cwhttpd_mutex_unlock(cache->mutex);
+}
+
+void stat_cache_entry_put(stat_cache_entry_t *entry)
+{
+    if (entry != NULL) {
+        kref_put(&entry->ref, entry_release);
+    }
+}
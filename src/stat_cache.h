@@ -0,0 +1,146 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include "fs_watch.h"
+#include "kref.h"
+#include "mime.h"
+#include "cwhttpd/httpd.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+
+/* Open descriptors are only kept where pread() lets workers share them */
+#if defined(__linux__)
+# define STAT_CACHE_FDS
+# if CONFIG_CWHTTPD_FS_MMAP
+#  define STAT_CACHE_MMAP
+# endif
+#endif
+
+typedef struct stat_cache_entry_t stat_cache_entry_t;
+
+/**
+ * \brief Result of a stat() call on a path
+ *
+ * Entries are reference counted and immutable once looked up, the open
+ * descriptor stays valid until the last reference is put.
+ */
+struct stat_cache_entry_t {
+    struct kref ref; /**< reference count */
+    stat_cache_entry_t *next; /**< next entry in the hash chain */
+    stat_cache_entry_t *lru_prev; /**< more recently used entry */
+    stat_cache_entry_t *lru_next; /**< less recently used entry */
+    uint32_t hash; /**< hash of path */
+    uint32_t expires; /**< cwhttpd_time_ms() when the entry goes stale */
+    bool watched; /**< changes are reported, the entry never goes stale */
+    int err; /**< errno of a failed stat(), 0 on success */
+    struct stat st; /**< stat result, valid if err is 0 */
+    int fd; /**< read-only descriptor of a regular file, or -1 */
+#if defined(STAT_CACHE_MMAP)
+    void *_Atomic map; /**< read-only mapping of fd, made on first use */
+#endif /* defined(STAT_CACHE_MMAP) */
+    mime_slot_t mime; /**< mime type of path, resolved on first use */
+    uint64_t *_Atomic content_hash; /**< hash of the content, or NULL until
+            stat_cache_entry_set_hash() */
+    char path[]; /**< filesystem path */
+};
+
+/**
+ * \brief Create a stat cache
+ *
+ * \return cache or NULL on error
+ */
+cwhttpd_stat_cache_t *stat_cache_create(
+    size_t max_entries, /** [in] number of paths to keep */
+    fs_watch_t *watch /** [in] watcher reporting changes, can be NULL */
+);
+
+/**
+ * \brief Free a stat cache
+ *
+ * Entries still referenced are freed when they are put.
+ */
+void stat_cache_destroy(
+    cwhttpd_stat_cache_t *cache /** [in] cache, can be NULL */
+);
+
+/**
+ * \brief Stat a path, or return a recent result for it
+ *
+ * Failed lookups are kept for CONFIG_CWHTTPD_STAT_CACHE_NEG_TTL_MS, others
+ * for CONFIG_CWHTTPD_STAT_CACHE_TTL_MS. Paths in a directory the watcher
+ * reports changes of are kept until they are invalidated, unless they are
+ * symbolic links.
+ *
+ * \return referenced entry, or NULL if the cache is disabled or out of
+ *         memory
+ */
+stat_cache_entry_t *stat_cache_get(
+    cwhttpd_stat_cache_t *cache, /** [in] cache, can be NULL */
+    const char *path /** [in] filesystem path */
+);
+
+#if defined(STAT_CACHE_MMAP)
+/**
+ * \brief Map the file of an entry
+ *
+ * The mapping is shared by all users of the entry and stays valid until the
+ * last reference is put.
+ *
+ * \return start of the file, or NULL if it can't be mapped
+ */
+const uint8_t *stat_cache_entry_map(
+    stat_cache_entry_t *entry /** [in] entry with an open descriptor */
+);
+#endif /* defined(STAT_CACHE_MMAP) */
+
+/**
+ * \brief Get the content hash stored with an entry
+ *
+ * The hash is carried over to the next entry of the path as long as the
+ * inode, size and modification time stay the same, so it is only computed
+ * again when the file changes.
+ *
+ * \return true if a hash was stored
+ */
+bool stat_cache_entry_get_hash(
+    stat_cache_entry_t *entry, /** [in] entry */
+    uint64_t *hash /** [out] content hash */
+);
+
+/**
+ * \brief Store the content hash of the file of an entry
+ */
+void stat_cache_entry_set_hash(
+    stat_cache_entry_t *entry, /** [in] entry */
+    uint64_t hash /** [in] content hash */
+);
+
+/**
+ * \brief Drop the entry of a path
+ */
+void stat_cache_invalidate(
+    cwhttpd_stat_cache_t *cache, /** [in] cache, can be NULL */
+    const char *path /** [in] filesystem path */
+);
+
+/**
+ * \brief Drop all entries
+ */
+void stat_cache_flush(
+    cwhttpd_stat_cache_t *cache /** [in] cache, can be NULL */
+);
+
+/**
+ * \brief Drop a reference to an entry
+ */
+void stat_cache_entry_put(
+    stat_cache_entry_t *entry /** [in] entry, can be NULL */
+);
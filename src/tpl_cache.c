@@ -0,0 +1,323 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "kref.h"
+#include "log.h"
+#include "tpl_cache.h"
+#include "cwhttpd/httpd.h"
+#include "cwhttpd/port.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+
+/* Hash chains, a power of two */
+#define TPL_CACHE_BUCKETS 16
+
+struct cwhttpd_tpl_cache_t {
+    cwhttpd_mutex_t *mutex;
+    tpl_cache_entry_t *buckets[TPL_CACHE_BUCKETS];
+    tpl_cache_entry_t lru; /**< list head, lru.lru_next is the most recent */
+    size_t entries;
+    size_t max_entries;
+};
+
+
+static uint32_t path_hash(const char *path)
+{
+    uint32_t hash = 2166136261;
+    while (*path) {
+        hash ^= (uint8_t) *path++;
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+static void entry_release(struct kref *ref)
+{
+    tpl_cache_entry_t *entry = kcontainer_of(ref, tpl_cache_entry_t, ref);
+    free((void *) entry->text);
+    free(entry);
+}
+
+/* Expects the cache to be locked, the cache reference is dropped by the
+ * caller */
+static void cache_unlink(cwhttpd_tpl_cache_t *cache, tpl_cache_entry_t *entry)
+{
+    tpl_cache_entry_t **p = &cache->buckets[entry->hash &
+            (TPL_CACHE_BUCKETS - 1)];
+    while (*p != entry) {
+        p = &(*p)->next;
+    }
+    *p = entry->next;
+    entry->lru_prev->lru_next = entry->lru_next;
+    entry->lru_next->lru_prev = entry->lru_prev;
+    cache->entries--;
+}
+
+static tpl_cache_entry_t *cache_find(cwhttpd_tpl_cache_t *cache,
+        uint32_t hash, const char *path)
+{
+    tpl_cache_entry_t *entry = cache->buckets[hash & (TPL_CACHE_BUCKETS - 1)];
+    while (entry != NULL) {
+        if (entry->hash == hash && strcmp(entry->path, path) == 0) {
+            return entry;
+        }
+        entry = entry->next;
+    }
+    return NULL;
+}
+
+static void lru_push(cwhttpd_tpl_cache_t *cache, tpl_cache_entry_t *entry)
+{
+    entry->lru_prev = &cache->lru;
+    entry->lru_next = cache->lru.lru_next;
+    cache->lru.lru_next->lru_prev = entry;
+    cache->lru.lru_next = entry;
+}
+
+static void cache_flush(cwhttpd_tpl_cache_t *cache)
+{
+    while (cache->lru.lru_prev != &cache->lru) {
+        tpl_cache_entry_t *entry = cache->lru.lru_prev;
+        cache_unlink(cache, entry);
+        kref_put(&entry->ref, entry_release);
+    }
+}
+
+static size_t add_literal(cwhttpd_tpl_segment_t *segments, size_t n,
+        const char *start, const char *end)
+{
+    if (end > start) {
+        segments[n].text = start;
+        segments[n].len = end - start;
+        segments[n].token = false;
+        n++;
+    }
+    return n;
+}
+
+/* Split text into literals and tokens. Every pair of '%' yields at most two
+ * segments, so there are never more than one plus the number of '%'. */
+static size_t parse(const char *text, size_t len,
+        cwhttpd_tpl_segment_t *segments)
+{
+    const char *end = text + len;
+    const char *p = text;
+    const char *literal = text;
+    size_t n = 0;
+
+    while (p < end) {
+        const char *start = memchr(p, '%', end - p);
+        if (start == NULL) {
+            break;
+        }
+        const char *stop = memchr(start + 1, '%', end - start - 1);
+        if (stop == NULL) {
+            /* an unterminated token is dropped */
+            end = start;
+            break;
+        }
+
+        if (stop == start + 1) {
+            /* %% is an escaped %, the first one ends the literal */
+            n = add_literal(segments, n, literal, stop);
+        } else {
+            n = add_literal(segments, n, literal, start);
+            size_t token_len = stop - start - 1;
+            if (token_len > TPL_TOKEN_LEN - 1) {
+                token_len = TPL_TOKEN_LEN - 1;
+            }
+            segments[n].text = start + 1;
+            segments[n].len = token_len;
+            segments[n].token = true;
+            n++;
+        }
+        literal = stop + 1;
+        p = stop + 1;
+    }
+
+    return add_literal(segments, n, literal, end);
+}
+
+static tpl_cache_entry_t *parse_file(const char *path, const struct stat *st,
+        uint32_t hash)
+{
+    size_t len = st->st_size;
+    char *text = malloc(len + 1);
+    if (text == NULL) {
+        LOGE(__func__, "malloc failed");
+        return NULL;
+    }
+
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        free(text);
+        return NULL;
+    }
+    size_t n = fread(text, 1, len, f);
+    fclose(f);
+    if (n != len) {
+        /* changed since the stat, let the caller stream it */
+        free(text);
+        return NULL;
+    }
+    text[len] = '\0';
+
+    size_t max_segments = 1;
+    for (const char *p = text; (p = memchr(p, '%', text + len - p)) != NULL;
+            p++) {
+        max_segments++;
+    }
+
+    size_t path_len = strlen(path);
+    tpl_cache_entry_t *entry = malloc(sizeof(tpl_cache_entry_t) +
+            max_segments * sizeof(cwhttpd_tpl_segment_t) + path_len + 1);
+    if (entry == NULL) {
+        LOGE(__func__, "malloc failed");
+        free(text);
+        return NULL;
+    }
+
+    kref_init(&entry->ref);
+    entry->hash = hash;
+    entry->mtime = st->st_mtime;
+    entry->size = st->st_size;
+    entry->ino = st->st_ino;
+    entry->text = text;
+    entry->num_segments = parse(text, len, entry->segments);
+    char *entry_path = (char *) &entry->segments[max_segments];
+    memcpy(entry_path, path, path_len + 1);
+    entry->path = entry_path;
+
+    return entry;
+}
+
+cwhttpd_tpl_cache_t *tpl_cache_create(size_t max_entries)
+{
+    cwhttpd_tpl_cache_t *cache = calloc(1, sizeof(cwhttpd_tpl_cache_t));
+    if (cache == NULL) {
+        LOGE(__func__, "calloc failed");
+        return NULL;
+    }
+
+    cache->mutex = cwhttpd_mutex_create(false);
+    if (cache->mutex == NULL) {
+        LOGE(__func__, "cwhttpd_mutex_create failed");
+        free(cache);
+        return NULL;
+    }
+    cache->lru.lru_prev = &cache->lru;
+    cache->lru.lru_next = &cache->lru;
+    cache->max_entries = max_entries;
+
+    return cache;
+}
+
+void tpl_cache_destroy(cwhttpd_tpl_cache_t *cache)
+{
+    if (cache == NULL) {
+        return;
+    }
+
+    cache_flush(cache);
+    cwhttpd_mutex_delete(cache->mutex);
+    free(cache);
+}
+
+tpl_cache_entry_t *tpl_cache_get(cwhttpd_tpl_cache_t *cache,
+        const char *path, const struct stat *st)
+{
+    uint32_t hash = path_hash(path);
+
+    if (cache != NULL) {
+        cwhttpd_mutex_lock(cache->mutex);
+        tpl_cache_entry_t *entry = cache_find(cache, hash, path);
+        if (entry != NULL) {
+            if (entry->mtime == st->st_mtime && entry->size == st->st_size &&
+                    entry->ino == st->st_ino) {
+                kref_get(&entry->ref);
+                entry->lru_prev->lru_next = entry->lru_next;
+                entry->lru_next->lru_prev = entry->lru_prev;
+                lru_push(cache, entry);
+                cwhttpd_mutex_unlock(cache->mutex);
+                return entry;
+            }
+            cache_unlink(cache, entry);
+            kref_put(&entry->ref, entry_release);
+        }
+        cwhttpd_mutex_unlock(cache->mutex);
+    }
+
+    if (st->st_size > CONFIG_CWHTTPD_TPL_MAX_FILE) {
+        return NULL;
+    }
+
+    /* The file is only read outside of the lock */
+    tpl_cache_entry_t *entry = parse_file(path, st, hash);
+    if (entry == NULL || cache == NULL) {
+        return entry;
+    }
+
+    cwhttpd_mutex_lock(cache->mutex);
+    tpl_cache_entry_t *old = cache_find(cache, hash, path);
+    if (old != NULL) {
+        cache_unlink(cache, old);
+        kref_put(&old->ref, entry_release);
+    }
+    while (cache->entries >= cache->max_entries) {
+        tpl_cache_entry_t *victim = cache->lru.lru_prev;
+        cache_unlink(cache, victim);
+        kref_put(&victim->ref, entry_release);
+    }
+    kref_get(&entry->ref);
+    tpl_cache_entry_t **bucket = &cache->buckets[hash &
+            (TPL_CACHE_BUCKETS - 1)];
+    entry->next = *bucket;
+    *bucket = entry;
+    lru_push(cache, entry);
+    cache->entries++;
+    cwhttpd_mutex_unlock(cache->mutex);
+
+    return entry;
+}
+
+void tpl_cache_invalidate(cwhttpd_tpl_cache_t *cache, const char *path)
+{
+    if (cache == NULL) {
+        return;
+    }
+
+    uint32_t hash = path_hash(path);
+
+    cwhttpd_mutex_lock(cache->mutex);
+    tpl_cache_entry_t *entry = cache_find(cache, hash, path);
+    if (entry != NULL) {
+        cache_unlink(cache, entry);
+        kref_put(&entry->ref, entry_release);
+    }
+    cwhttpd_mutex_unlock(cache->mutex);
+}
+
+void tpl_cache_flush(cwhttpd_tpl_cache_t *cache)
+{
+    if (cache == NULL) {
+        return;
+    }
+
+    cwhttpd_mutex_lock(cache->mutex);
+    cache_flush(cache);
+    cwhttpd_mutex_unlock(cache->mutex);
+}
+
+void tpl_cache_entry_put(tpl_cache_entry_t *entry)
+{
+    if (entry != NULL) {
+        kref_put(&entry->ref, entry_release);
+    }
+}
@@ -0,0 +1,95 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include "kref.h"
+#include "cwhttpd/httpd.h"
+#include "cwhttpd/route.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+
+/* Longest token name passed to a template callback, including the NULL */
+#define TPL_TOKEN_LEN 32
+
+typedef struct tpl_cache_entry_t tpl_cache_entry_t;
+
+/**
+ * \brief A template file split into segments
+ *
+ * Entries are reference counted and immutable once returned.
+ */
+struct tpl_cache_entry_t {
+    struct kref ref; /**< reference count */
+    tpl_cache_entry_t *next; /**< next entry in the hash chain */
+    tpl_cache_entry_t *lru_prev; /**< more recently used entry */
+    tpl_cache_entry_t *lru_next; /**< less recently used entry */
+    uint32_t hash; /**< hash of path */
+    time_t mtime; /**< modification time of the file */
+    off_t size; /**< size of the file */
+    ino_t ino; /**< inode of the file */
+    const char *path; /**< filesystem path */
+    const char *text; /**< file content */
+    size_t num_segments; /**< number of segments */
+    cwhttpd_tpl_segment_t segments[]; /**< segments pointing into text */
+};
+
+/**
+ * \brief Create a template cache
+ *
+ * \return cache or NULL on error
+ */
+cwhttpd_tpl_cache_t *tpl_cache_create(
+    size_t max_entries /** [in] number of templates to keep */
+);
+
+/**
+ * \brief Free a template cache
+ *
+ * Entries still referenced are freed when they are put.
+ */
+void tpl_cache_destroy(
+    cwhttpd_tpl_cache_t *cache /** [in] cache, can be NULL */
+);
+
+/**
+ * \brief Get the parsed template of a file, validated against a fresh stat
+ *
+ * A stale entry is replaced by parsing the file again. Without a cache the
+ * entry belongs to the caller alone.
+ *
+ * \return referenced entry, or NULL if the file is larger than
+ *         CONFIG_CWHTTPD_TPL_MAX_FILE or on error
+ */
+tpl_cache_entry_t *tpl_cache_get(
+    cwhttpd_tpl_cache_t *cache, /** [in] cache, can be NULL */
+    const char *path, /** [in] filesystem path */
+    const struct stat *st /** [in] current stat of path */
+);
+
+/**
+ * \brief Drop the entry of a path
+ */
+void tpl_cache_invalidate(
+    cwhttpd_tpl_cache_t *cache, /** [in] cache, can be NULL */
+    const char *path /** [in] filesystem path */
+);
+
+/**
+ * \brief Drop all entries
+ */
+void tpl_cache_flush(
+    cwhttpd_tpl_cache_t *cache /** [in] cache, can be NULL */
+);
+
+/**
+ * \brief Drop a reference to an entry
+ */
+void tpl_cache_entry_put(
+    tpl_cache_entry_t *entry /** [in] entry, can be NULL */
+);
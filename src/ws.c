@@ -10,10 +10,15 @@
 #include "cwhttpd/ws.h"
 
 #include <endian.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(__SSE2__)
+# include <immintrin.h>
+#endif
+
 
 #define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
 
@@ -86,39 +91,94 @@ static int send_frame_head(cwhttpd_ws_t *ws, uint8_t opcode, size_t len)
     return cwhttpd_plat_send(ws->conn, buf, i);
 }
 
-static void unmask(const uint8_t *mask, uint8_t *buf, size_t len)
+/* XOR a part of the payload with the masking key, then rotate the key so the
+ * next part of the frame starts with mask[0] again */
+static void unmask(uint8_t *mask, uint8_t *buf, size_t len)
 {
-    for (size_t i = 0; i < len; i += 4) {
-        buf[i] ^= mask[0];
-        if (i < len - 3) {
-            buf[i] ^= mask[1];
-            buf[i] ^= mask[2];
-            buf[i] ^= mask[3];
-        } else if (i < len - 2) {
-            buf[i] ^= mask[1];
-            buf[i] ^= mask[2];
-        } else if (i < len - 1) {
-            buf[i] ^= mask[1];
+    size_t i = 0;
+
+    /* bytes up to a word boundary */
+    while (i < len && ((uintptr_t) (buf + i) & 7)) {
+        buf[i] ^= mask[i & 3];
+        i++;
+    }
+
+    /* the key repeated as it lines up from here on */
+    uint8_t key[8];
+    for (size_t j = 0; j < sizeof(key); j++) {
+        key[j] = mask[(i + j) & 3];
+    }
+    uint64_t key64;
+    memcpy(&key64, key, sizeof(key64));
+
+#if defined(__AVX2__)
+    const __m256i key256 = _mm256_set1_epi64x(key64);
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (buf + i));
+        _mm256_storeu_si256((__m256i *) (buf + i),
+                _mm256_xor_si256(v, key256));
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i key128 = _mm_set1_epi64x(key64);
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (buf + i));
+        _mm_storeu_si128((__m128i *) (buf + i), _mm_xor_si128(v, key128));
+    }
+#endif
+    for (; i + 8 <= len; i += 8) {
+        uint64_t v;
+        memcpy(&v, buf + i, sizeof(v));
+        v ^= key64;
+        memcpy(buf + i, &v, sizeof(v));
+    }
+    for (; i < len; i++) {
+        buf[i] ^= mask[i & 3];
+    }
+
+    size_t shift = len & 3;
+    if (shift) {
+        uint8_t rotated[4];
+        for (size_t j = 0; j < 4; j++) {
+            rotated[j] = mask[(j + shift) & 3];
+        }
+        memcpy(mask, rotated, sizeof(rotated));
+    }
+}
+
+/* Frame header fields are mostly served from the receive buffer of the
+ * connection, but may be split across reads */
+static bool recv_exact(cwhttpd_ws_t *ws, void *buf, size_t len)
+{
+    uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t ret = cwhttpd_recv(ws->conn, p, len);
+        if (ret <= 0) {
+            return false;
         }
+        p += ret;
+        len -= ret;
     }
+    return true;
 }
 
 ssize_t cwhttpd_ws_recv(cwhttpd_ws_t *ws, void *buf, size_t len)
 {
+    uint8_t *p = buf;
     size_t outlen = 0;
 
     while (outlen < len) {
         if (ws->priv.frame.len) {
-            size_t recvlen = (ws->priv.frame.len < len) ?
-                    ws->priv.frame.len : len;
-            ssize_t ret = cwhttpd_recv(ws->conn, buf, recvlen);
-            if (ret < 0) {
+            size_t recvlen = (ws->priv.frame.len < len - outlen) ?
+                    ws->priv.frame.len : len - outlen;
+            ssize_t ret = cwhttpd_recv(ws->conn, p, recvlen);
+            if (ret <= 0) {
                 return -1;
             }
             if (ws->priv.frame.len8 & IS_MASKED) {
-                unmask(ws->priv.frame.mask, buf, ret);
+                unmask(ws->priv.frame.mask, p, ret);
             }
-            buf += ret;
+            p += ret;
             ws->priv.frame.len -= ret;
             outlen += ret;
 
@@ -130,28 +190,24 @@ ssize_t cwhttpd_ws_recv(cwhttpd_ws_t *ws, void *buf, size_t len)
             }
         } else {
             ws->flags = CWHTTPD_WS_FLAG_NONE;
-            ssize_t ret = cwhttpd_recv(ws->conn, &ws->priv.frame, 2);
-            if (ret != 2) {
+            if (!recv_exact(ws, &ws->priv.frame, 2)) {
                 return -1;
             }
             ws->priv.frame.len = (ws->priv.frame.len8 & PAYLOAD_MASK);
             if (ws->priv.frame.len == 126) {
                 uint16_t len16;
-                ret = cwhttpd_recv(ws->conn, &len16, 2);
-                if (ret != 2) {
+                if (!recv_exact(ws, &len16, 2)) {
                     return -1;
                 }
                 ws->priv.frame.len = ntohs(len16);
             } else if (ws->priv.frame.len == 127) {
-                ret = cwhttpd_recv(ws->conn, &ws->priv.frame.len, 8);
-                if (ret != 8) {
+                if (!recv_exact(ws, &ws->priv.frame.len, 8)) {
                     return -1;
                 }
                 ws->priv.frame.len = be64toh(ws->priv.frame.len);
             }
             if (ws->priv.frame.len8 & IS_MASKED) {
-                ret = cwhttpd_recv(ws->conn, ws->priv.frame.mask, 4);
-                if (ret != 4) {
+                if (!recv_exact(ws, ws->priv.frame.mask, 4)) {
                     return -1;
                 }
             }
@@ -170,10 +226,13 @@ ssize_t cwhttpd_ws_recv(cwhttpd_ws_t *ws, void *buf, size_t len)
                 case OPCODE_CLOSE: {
                     uint16_t reason = htons(1000);
                     if (ws->priv.frame.len >= 2) {
-                        ret = cwhttpd_recv(ws->conn, &reason, 2);
-                        if (ret != 2) {
+                        if (!recv_exact(ws, &reason, 2)) {
                             return -1;
                         }
+                        if (ws->priv.frame.len8 & IS_MASKED) {
+                            unmask(ws->priv.frame.mask, (uint8_t *) &reason,
+                                    2);
+                        }
                     }
                     cwhttpd_ws_close(ws, reason);
                     return 0;
@@ -184,13 +243,16 @@ ssize_t cwhttpd_ws_recv(cwhttpd_ws_t *ws, void *buf, size_t len)
                     if (ws->priv.frame.len > sizeof(buf)) {
                         return -1;
                     }
-                    ret = cwhttpd_recv(ws->conn, buf, ws->priv.frame.len);
-                    if (ret != ws->priv.frame.len) {
+                    size_t n = ws->priv.frame.len;
+                    if (!recv_exact(ws, buf, n)) {
                         return -1;
                     }
-                    send_frame_head(ws, OPCODE_PONG | FLAG_FIN,
-                            ws->priv.frame.len);
-                    cwhttpd_plat_send(ws->conn, buf, ret);
+                    if (ws->priv.frame.len8 & IS_MASKED) {
+                        unmask(ws->priv.frame.mask, (uint8_t *) buf, n);
+                    }
+                    send_frame_head(ws, OPCODE_PONG | FLAG_FIN, n);
+                    cwhttpd_plat_send(ws->conn, buf, n);
+                    ws->priv.frame.len = 0;
                     break;
                 }
 
@@ -0,0 +1,280 @@
+#!/usr/bin/env python
+
+from argparse import ArgumentParser
+import gzip
+import os
+import sys
+
+from routegen import build_chd, c_string
+
+
+# Must be kept in sync with builtin_types in src/mime.c
+MIME_TYPES = {
+    'htm': 'text/html',
+    'html': 'text/html',
+    'css': 'text/css',
+    'js': 'text/javascript',
+    'mjs': 'text/javascript',
+    'txt': 'text/plain',
+    'csv': 'text/csv',
+    'md': 'text/markdown',
+    'xml': 'text/xml',
+    'json': 'application/json',
+    'map': 'application/json',
+    'webmanifest': 'application/manifest+json',
+    'wasm': 'application/wasm',
+    'pdf': 'application/pdf',
+    'zip': 'application/zip',
+    'gz': 'application/gzip',
+    'tar': 'application/x-tar',
+    'bin': 'application/octet-stream',
+    'jpg': 'image/jpeg',
+    'jpeg': 'image/jpeg',
+    'png': 'image/png',
+    'gif': 'image/gif',
+    'svg': 'image/svg+xml',
+    'ico': 'image/x-icon',
+    'webp': 'image/webp',
+    'avif': 'image/avif',
+    'bmp': 'image/bmp',
+    'woff': 'font/woff',
+    'woff2': 'font/woff2',
+    'ttf': 'font/ttf',
+    'otf': 'font/otf',
+    'mp3': 'audio/mpeg',
+    'ogg': 'audio/ogg',
+    'wav': 'audio/wav',
+    'mp4': 'video/mp4',
+    'webm': 'video/webm',
+}
+DEFAULT_MIME = 'text/html'
+
+# Must be kept in sync with cwhttpd_mime_compressible() in src/httpd.c
+COMPRESSIBLE = (
+    'application/javascript',
+    'application/json',
+    'application/manifest+json',
+    'application/wasm',
+    'application/xml',
+    'image/svg+xml',
+    'image/x-icon',
+)
+
+# Must be kept in sync with cwhttpd_cache_control() in src/httpd.c
+NO_CACHE_CONTROL = ('text/html', 'text/plain', 'text/csv', 'application/json')
+CACHE_CONTROL = 'max-age=7200, public, must-revalidate'
+
+# cwhttpd_encoding_t
+ENCODING_IDENTITY = 0
+ENCODING_GZIP = 2
+ENCODING_BR = 3
+
+# A variant has to save this much to be worth a Vary header
+MIN_SAVING = 0.9
+
+
+def content_hash(data):
+    '''FNV-1a, as used for content based ETags by route_fs.c'''
+    h = 14695981039346656037
+    for byte in data:
+        h ^= byte
+        h = (h * 1099511628211) & 0xFFFFFFFFFFFFFFFF
+    return h
+
+def mime_type(path):
+    name = path.rsplit('/', 1)[-1]
+    ext = name.rsplit('.', 1)[-1].lower() if '.' in name else ''
+    return MIME_TYPES.get(ext, DEFAULT_MIME)
+
+def compressible(mime):
+    if mime.startswith('text/event-stream'):
+        return False
+    return mime.startswith('text/') or mime in COMPRESSIBLE
+
+def walk(root):
+    '''Relative paths of all files below root, hidden ones skipped'''
+    paths = []
+    for dirpath, dirnames, filenames in os.walk(root):
+        dirnames[:] = sorted(d for d in dirnames if not d.startswith('.'))
+        for filename in sorted(filenames):
+            if filename.startswith('.'):
+                continue
+            path = os.path.relpath(os.path.join(dirpath, filename), root)
+            paths.append(path.replace(os.sep, '/'))
+    return paths
+
+def make_variants(data, mime, use_gzip, use_brotli):
+    variants = [(ENCODING_IDENTITY, None, '', data)]
+    if not compressible(mime):
+        return variants
+    if use_brotli:
+        import brotli
+        body = brotli.compress(data, quality=11)
+        if len(body) < len(data) * MIN_SAVING:
+            variants.append((ENCODING_BR, 'br', '-br', body))
+    if use_gzip:
+        body = gzip.compress(data, 9, mtime=0)
+        if len(body) < len(data) * MIN_SAVING:
+            variants.append((ENCODING_GZIP, 'gzip', '-gzip', body))
+    return variants
+
+def make_headers(etag, mime, encoding, vary):
+    headers = f'ETag: {etag}\r\n'
+    if mime not in NO_CACHE_CONTROL:
+        headers += f'Cache-Control: {CACHE_CONTROL}\r\n'
+    if vary:
+        headers += 'Vary: Accept-Encoding\r\n'
+    cond_len = len(headers)
+    headers += f'Content-Type: {mime}\r\n'
+    if encoding is not None:
+        headers += f'Content-Encoding: {encoding}\r\n'
+    return headers, cond_len
+
+def save_bundle(src_dir, dst_path, symbol, use_gzip, use_brotli, use_array):
+    blob = bytearray()
+    files = {}
+    for path in walk(src_dir):
+        with open(os.path.join(src_dir, path), 'rb') as f:
+            data = f.read()
+        mime = mime_type(path)
+        variants = []
+        raw = make_variants(data, mime, use_gzip, use_brotli)
+        for encoding, name, suffix, body in raw:
+            etag = f'"{content_hash(body):016x}{suffix}"'
+            headers, cond_len = make_headers(etag, mime, name, len(raw) > 1)
+            variants.append({
+                'encoding': encoding,
+                'etag': etag,
+                'headers': headers,
+                'cond_len': cond_len,
+                'offset': len(blob),
+                'len': len(body),
+            })
+            blob += body
+            blob += bytes(-len(blob) % 4)
+        files[path.encode()] = variants
+
+    # Directories are served by their index.html
+    for path in list(files):
+        if path == b'index.html' or path.endswith(b'/index.html'):
+            dirname = path[:-len(b'index.html')]
+            files.setdefault(dirname, files[path])
+            if dirname:
+                files.setdefault(dirname[:-1], files[path])
+
+    if len(files) >= 0xFFFF:
+        sys.exit(f'{src_dir}: too many files')
+    seeds, slots = build_chd(list(files))
+
+    blob_path = dst_path + '.bin'
+    with open(blob_path, 'wb') as f:
+        f.write(blob)
+
+    with open(dst_path, 'w') as dst_f:
+        dst_f.write(f'/* Generated by bundle.py from '
+                f'{os.path.basename(os.path.normpath(src_dir))}, '
+                f'do not edit */\n')
+        dst_f.write('\n')
+        dst_f.write('#include "cwhttpd/httpd.h"\n')
+        dst_f.write('#include "cwhttpd/route.h"\n')
+        dst_f.write('\n')
+        dst_f.write('#include <stddef.h>\n')
+        dst_f.write('#include <stdint.h>\n')
+        dst_f.write('\n')
+
+        data_symbol = f'{symbol}_data'
+        if use_array:
+            dst_f.write(f'static const __attribute__((aligned(4))) uint8_t '
+                    f'{data_symbol}[] = {{\n')
+            for i in range(0, len(blob), 12):
+                s = ', '.join(f'0x{byte:02X}' for byte in blob[i:i + 12])
+                dst_f.write(f'    {s},\n')
+            if not blob:
+                dst_f.write('    0,\n')
+            dst_f.write('};\n')
+        else:
+            dst_f.write(f'extern const uint8_t {data_symbol}[];\n')
+            dst_f.write('\n')
+            dst_f.write('asm (\n')
+            dst_f.write('    ".section .rodata\\n"\n')
+            dst_f.write('    ".balign 4\\n"\n')
+            dst_f.write(f'    "{data_symbol}:\\n"\n')
+            dst_f.write(f'    ".incbin \\"{os.path.abspath(blob_path)}\\"\\n"\n')
+            dst_f.write('    ".balign 4\\n"\n')
+            dst_f.write('    ".section .text\\n"\n')
+            dst_f.write(');\n')
+        dst_f.write('\n')
+
+        # Aliases share the variants of the file they stand for
+        names = {}
+        for key in sorted(files):
+            variants = files[key]
+            if id(variants) in names:
+                continue
+            name = f'variants_{len(names)}'
+            names[id(variants)] = name
+            dst_f.write(f'static const cwhttpd_bundle_variant_t {name}[] = {{\n')
+            for v in variants:
+                dst_f.write('    {\n')
+                dst_f.write(f'        .etag = {c_string(v["etag"].encode())},\n')
+                dst_f.write(f'        .headers = '
+                        f'{c_string(v["headers"].encode())},\n')
+                dst_f.write(f'        .headers_len = {len(v["headers"])},\n')
+                dst_f.write(f'        .cond_len = {v["cond_len"]},\n')
+                dst_f.write(f'        .encoding = {v["encoding"]},\n')
+                dst_f.write(f'        .body = {data_symbol} + {v["offset"]},\n')
+                dst_f.write(f'        .body_len = {v["len"]},\n')
+                dst_f.write('    },\n')
+            dst_f.write('};\n')
+            dst_f.write('\n')
+
+        dst_f.write('static const uint16_t seeds[] = {\n')
+        for i in range(0, len(seeds), 12):
+            s = ', '.join(str(seed) for seed in seeds[i:i + 12])
+            dst_f.write(f'    {s},\n')
+        if not seeds:
+            dst_f.write('    0,\n')
+        dst_f.write('};\n')
+        dst_f.write('\n')
+
+        dst_f.write('static const cwhttpd_bundle_file_t files[] = {\n')
+        for key in slots or [None]:
+            if key is None:
+                dst_f.write('    {NULL, 0, 0, 0, NULL},\n')
+                continue
+            variants = files[key]
+            encodings = 0
+            for v in variants:
+                encodings |= 1 << v['encoding']
+            dst_f.write(f'    {{{c_string(key)}, {len(key)}, {encodings}, '
+                    f'{len(variants)}, {names[id(variants)]}}},\n')
+        dst_f.write('};\n')
+        dst_f.write('\n')
+
+        dst_f.write(f'const cwhttpd_bundle_t {symbol} = {{\n')
+        dst_f.write(f'    .seeds = seeds,\n')
+        dst_f.write(f'    .num_buckets = {len(seeds)},\n')
+        dst_f.write(f'    .files = files,\n')
+        dst_f.write(f'    .num_slots = {len(slots)},\n')
+        dst_f.write('};\n')
+
+if __name__ == '__main__':
+    parser = ArgumentParser()
+    parser.add_argument('--symbol', help='bundle symbol, defaults to the '
+            'directory name')
+    parser.add_argument('--gzip', action='store_true',
+            help='add gzip variants of compressible files')
+    parser.add_argument('--brotli', action='store_true',
+            help='add brotli variants of compressible files, needs the '
+            'brotli module')
+    parser.add_argument('--use-array', action='store_true',
+            help='use slower but portable array method')
+    parser.add_argument('directory', metavar='DIRECTORY',
+            help='source directory')
+    parser.add_argument('output', metavar='OUTPUT', help='destination C source')
+    args = parser.parse_args()
+
+    symbol = args.symbol or os.path.basename(os.path.normpath(
+            args.directory)).translate(str.maketrans('-.', '__'))
+    save_bundle(args.directory, args.output, symbol, args.gzip, args.brotli,
+            args.use_array)
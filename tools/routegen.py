@@ -0,0 +1,230 @@
+#!/usr/bin/env python
+
+from argparse import ArgumentParser
+import os
+import shlex
+import sys
+
+
+METHODS = ('GET', 'POST', 'OPTIONS', 'PUT', 'PATCH', 'DELETE')
+NONE = 0xFFFF
+EMPTY_KEY = '{NULL, 0, CWHTTPD_STATIC_NONE, 0, 0}'
+
+
+def route_hash(data, seed):
+    '''Must be kept in sync with static_hash() in src/router.c'''
+    h = 2166136261 ^ seed
+    for byte in data:
+        h ^= byte
+        h = (h * 16777619) & 0xFFFFFFFF
+    h ^= h >> 16
+    h = (h * 0x85EBCA6B) & 0xFFFFFFFF
+    h ^= h >> 13
+    h = (h * 0xC2B2AE35) & 0xFFFFFFFF
+    h ^= h >> 16
+    return h
+
+def c_string(data):
+    out = '"'
+    for byte in data:
+        c = chr(byte)
+        if c in '"\\':
+            out += '\\' + c
+        elif 0x20 <= byte < 0x7F and c != '?':
+            out += c
+        else:
+            out += f'\\{byte:03o}'
+    return out + '"'
+
+def parse_routes(src_path):
+    '''Parse lines of the form [METHOD[,METHOD...]] PATH HANDLER [ARG...]'''
+    routes = []
+    with open(src_path, 'r') as src_f:
+        for lineno, line in enumerate(src_f, 1):
+            tokens = shlex.split(line, comments=True, posix=False)
+            if not tokens:
+                continue
+
+            def error(msg):
+                sys.exit(f'{src_path}:{lineno}: {msg}')
+
+            methods = []
+            if not tokens[0].startswith(('/', '*')):
+                for method in tokens.pop(0).upper().split(','):
+                    if method not in METHODS:
+                        error(f'unknown method {method}')
+                    methods.append(method)
+            if len(tokens) < 2:
+                error('expected a path and a handler')
+
+            path = tokens[0].encode()
+            for i, segment in enumerate(path.split(b'/')):
+                if i > 0 and segment.startswith(b':'):
+                    error('captures are not supported in static routes')
+            if b'*' in path[:-1]:
+                error('only a trailing * is supported')
+
+            routes.append({
+                'methods': methods,
+                'path': path,
+                'handler': tokens[1],
+                'args': tokens[2:],
+            })
+
+    if len(routes) >= NONE:
+        sys.exit(f'{src_path}: too many routes')
+    return routes
+
+def group_keys(routes, wildcard):
+    keys = {}
+    for index, route in enumerate(routes):
+        if route['path'].endswith(b'*') == wildcard:
+            key = route['path'][:-1] if wildcard else route['path']
+            keys.setdefault(key, []).append(index)
+    return keys
+
+def build_chd(keys):
+    '''Compress, hash and displace: find a seed for every bucket so that all
+    keys land in distinct slots'''
+    n = len(keys)
+    if n == 0:
+        return [], []
+
+    num_buckets = (n + 3) // 4
+    num_slots = max(1, (n * 5 + 3) // 4)
+    while True:
+        buckets = [[] for _ in range(num_buckets)]
+        for key in keys:
+            buckets[route_hash(key, 0) % num_buckets].append(key)
+
+        slots = [None] * num_slots
+        seeds = [0] * num_buckets
+        order = sorted(range(num_buckets), key=lambda b: -len(buckets[b]))
+        for b in order:
+            if not buckets[b]:
+                continue
+            for seed in range(1, NONE):
+                taken = [route_hash(key, seed) % num_slots
+                        for key in buckets[b]]
+                if len(set(taken)) == len(taken) and \
+                        all(slots[slot] is None for slot in taken):
+                    break
+            else:
+                break
+            seeds[b] = seed
+            for key, slot in zip(buckets[b], taken):
+                slots[slot] = key
+        else:
+            return seeds, slots
+        num_slots += 1
+
+def build_prefixes(keys):
+    prefixes = sorted(keys)
+    parents = []
+    for i, prefix in enumerate(prefixes):
+        parent = i - 1 if i > 0 else NONE
+        while parent != NONE and not prefix.startswith(prefixes[parent]):
+            parent = parents[parent]
+        parents.append(parent)
+    return prefixes, parents
+
+def save_routes_c(src_path, dst_path, symbol):
+    routes = parse_routes(src_path)
+    exact_keys = group_keys(routes, False)
+    prefix_keys = group_keys(routes, True)
+    seeds, slots = build_chd(list(exact_keys))
+    prefixes, parents = build_prefixes(list(prefix_keys))
+
+    indexes = []
+    def key_entry(key, parent, group):
+        first = len(indexes)
+        indexes.extend(group)
+        parent = 'CWHTTPD_STATIC_NONE' if parent == NONE else parent
+        return f'{{{c_string(key)}, {len(key)}, {parent}, {first}, ' \
+               f'{len(group)}}}'
+
+    exact = []
+    for key in slots:
+        if key is None:
+            exact.append(EMPTY_KEY)
+        else:
+            exact.append(key_entry(key, NONE, exact_keys[key]))
+    prefix = [key_entry(key, parent, prefix_keys[key])
+            for key, parent in zip(prefixes, parents)]
+
+    handlers = sorted({route['handler'] for route in routes
+            if not route['handler'].startswith('cwhttpd_')})
+
+    with open(dst_path, 'w') as dst_f:
+        dst_f.write(f'/* Generated by routegen.py from '
+                f'{os.path.basename(src_path)}, do not edit */\n')
+        dst_f.write('\n')
+        dst_f.write('#include "cwhttpd/httpd.h"\n')
+        dst_f.write('#include "cwhttpd/route.h"\n')
+        dst_f.write('\n')
+        dst_f.write('#include <stddef.h>\n')
+        dst_f.write('#include <stdint.h>\n')
+        dst_f.write('\n')
+        for handler in handlers:
+            dst_f.write(f'cwhttpd_status_t {handler}(cwhttpd_conn_t *conn);\n')
+        if handlers:
+            dst_f.write('\n')
+
+        for index, route in enumerate(routes):
+            methods = ' | '.join(f'CWHTTPD_METHOD_MASK(CWHTTPD_METHOD_{m})'
+                    for m in route['methods']) or '0'
+            dst_f.write(f'static const cwhttpd_route_t route_{index} = {{\n')
+            dst_f.write(f'    .handler = {route["handler"]},\n')
+            dst_f.write(f'    .path = {c_string(route["path"])},\n')
+            dst_f.write(f'    .path_len = {len(route["path"])},\n')
+            dst_f.write(f'    .methods = {methods},\n')
+            dst_f.write(f'    .argc = {len(route["args"])},\n')
+            if route['args']:
+                args = ', '.join(f'(const void *) {arg}'
+                        for arg in route['args'])
+                dst_f.write(f'    .argv = {{{args}}},\n')
+            dst_f.write('};\n')
+            dst_f.write('\n')
+
+        def write_array(decl, items, per_line=1):
+            dst_f.write(f'{decl}[] = {{\n')
+            for i in range(0, len(items), per_line):
+                s = ', '.join(str(item) for item in items[i:i + per_line])
+                dst_f.write(f'    {s},\n')
+            if not items:
+                dst_f.write('    0,\n')
+            dst_f.write('};\n')
+            dst_f.write('\n')
+
+        write_array('static const cwhttpd_route_t *const routes',
+                [f'&route_{i}' for i in range(len(routes))] or ['NULL'])
+        write_array('static const uint16_t indexes', indexes, 12)
+        write_array('static const uint16_t seeds', seeds, 12)
+        write_array('static const cwhttpd_static_key_t exact',
+                exact or [EMPTY_KEY])
+        write_array('static const cwhttpd_static_key_t prefixes',
+                prefix or [EMPTY_KEY])
+
+        dst_f.write(f'const cwhttpd_static_routes_t {symbol} = {{\n')
+        dst_f.write(f'    .routes = routes,\n')
+        dst_f.write(f'    .num_routes = {len(routes)},\n')
+        dst_f.write(f'    .indexes = indexes,\n')
+        dst_f.write(f'    .seeds = seeds,\n')
+        dst_f.write(f'    .num_buckets = {len(seeds)},\n')
+        dst_f.write(f'    .exact = exact,\n')
+        dst_f.write(f'    .num_slots = {len(slots)},\n')
+        dst_f.write(f'    .prefixes = prefixes,\n')
+        dst_f.write(f'    .num_prefixes = {len(prefixes)},\n')
+        dst_f.write('};\n')
+
+if __name__ == '__main__':
+    parser = ArgumentParser()
+    parser.add_argument('--symbol', help='table symbol, defaults to the '
+            'source file name')
+    parser.add_argument('routes', metavar='ROUTES', help='route description')
+    parser.add_argument('output', metavar='OUTPUT', help='destination C source')
+    args = parser.parse_args()
+
+    symbol = args.symbol or os.path.basename(args.routes).translate(
+            str.maketrans('-.', '__'))
+    save_routes_c(args.routes, args.output, symbol)
@@ -0,0 +1,111 @@
+#!/usr/bin/env python
+
+from argparse import ArgumentParser
+import os
+import sys
+
+from bundle import mime_type
+from routegen import c_string
+
+
+# Must be kept in sync with TPL_TOKEN_LEN in src/tpl_cache.h
+MAX_TOKEN_LEN = 31
+
+
+def parse_template(data, src_path):
+    '''Split a template into (is_token, bytes) segments, the same way
+    cwhttpd_route_fs_tpl() does at runtime'''
+    segments = []
+    literal = b''
+    pos = 0
+    while True:
+        start = data.find(b'%', pos)
+        if start < 0:
+            literal += data[pos:]
+            break
+        stop = data.find(b'%', start + 1)
+        if stop < 0:
+            print(f'{src_path}: unterminated token dropped', file=sys.stderr)
+            literal += data[pos:start]
+            break
+
+        literal += data[pos:start]
+        if stop == start + 1:
+            literal += b'%'
+        else:
+            if literal:
+                segments.append((False, literal))
+                literal = b''
+            token = data[start + 1:stop]
+            if len(token) > MAX_TOKEN_LEN:
+                print(f'{src_path}: token {token.decode()} truncated',
+                        file=sys.stderr)
+                token = token[:MAX_TOKEN_LEN]
+            segments.append((True, token))
+        pos = stop + 1
+
+    if literal:
+        segments.append((False, literal))
+    return segments
+
+def c_text(data, indent):
+    '''C string literal split after every line of the template'''
+    lines = data.splitlines(keepends=True)
+    return f'\n{indent}'.join(c_string(line) for line in lines)
+
+def save_template(src_path, dst_path, symbol):
+    with open(src_path, 'rb') as f:
+        segments = parse_template(f.read(), src_path)
+
+    # page.html.tpl is served as page.html, page.tpl as the default type
+    name = os.path.basename(src_path)
+    if name.endswith('.tpl'):
+        name = name[:-len('.tpl')]
+    mime = mime_type(name)
+
+    with open(dst_path, 'w') as dst_f:
+        dst_f.write(f'/* Generated by tpl2c.py from '
+                f'{os.path.basename(src_path)}, do not edit */\n')
+        dst_f.write('\n')
+        dst_f.write('#include "cwhttpd/httpd.h"\n')
+        dst_f.write('#include "cwhttpd/route.h"\n')
+        dst_f.write('\n')
+        dst_f.write('#include <stdbool.h>\n')
+        dst_f.write('\n')
+
+        segments_symbol = f'{symbol}_segments'
+        dst_f.write(f'static const cwhttpd_tpl_segment_t '
+                f'{segments_symbol}[] = {{\n')
+        for is_token, text in segments:
+            dst_f.write(f'    {{\n')
+            dst_f.write(f'        .text = {c_text(text, " " * 16)},\n')
+            dst_f.write(f'        .len = {len(text)},\n')
+            dst_f.write(f'        .token = {"true" if is_token else "false"},\n')
+            dst_f.write(f'    }},\n')
+        if not segments:
+            dst_f.write('    {"", 0, false},\n')
+        dst_f.write('};\n')
+        dst_f.write('\n')
+
+        dst_f.write(f'const cwhttpd_tpl_t {symbol} = {{\n')
+        dst_f.write(f'    .mimetype = {c_string(mime.encode())},\n')
+        dst_f.write(f'    .segments = {segments_symbol},\n')
+        dst_f.write(f'    .num_segments = {len(segments)},\n')
+        dst_f.write('};\n')
+
+if __name__ == '__main__':
+    parser = ArgumentParser()
+    parser.add_argument('--symbol', help='template symbol, defaults to the '
+            'file name with a _tpl suffix')
+    parser.add_argument('template', metavar='TEMPLATE',
+            help='source template')
+    parser.add_argument('output', metavar='OUTPUT', help='destination C source')
+    args = parser.parse_args()
+
+    symbol = args.symbol
+    if symbol is None:
+        name = os.path.basename(args.template)
+        if name.endswith('.tpl'):
+            name = name[:-len('.tpl')]
+        symbol = name.translate(str.maketrans('-.', '__')) + '_tpl'
+    save_template(args.template, args.output, symbol)